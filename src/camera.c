@@ -17,7 +17,6 @@
 #include <stdio.h>
 #include <SDL/SDL.h>
 #include <GL/gl.h>
-#include <GL/glu.h>
 
 #include "util.h"
 #include "camera.h"
@@ -106,13 +105,38 @@ camera_free(void){
 	free(camera);
 }
 
+void
+camera_projection_matrix(double m[16]){
+	double aspect = WINDOW_WIDTH / WINDOW_HEIGHT;
+	mat_perspective(m, CAMERA_FOV, aspect, NEAR_PLANE, FAR_PLANE);
+}
+
+void
+camera_modelview_matrix(double m[16]){
+	double center[3];
+	center[0] = camera->eye[0] + camera->forward.x;
+	center[1] = camera->eye[1] + camera->forward.y;
+	center[2] = camera->eye[2] + camera->forward.z;
+	double up[3] = { camera->up.x, camera->up.y, camera->up.z };
+	mat_lookat(m, camera->eye, center, up);
+}
+
+void
+camera_frustum_planes(double planes[6][4]){
+	double projection[16], modelview[16], m[16];
+	camera_projection_matrix(projection);
+	camera_modelview_matrix(modelview);
+	mat_mult(m, projection, modelview);
+	mat_frustum_planes(planes, m);
+}
+
 void
 camera_load_perspective(void){
 	glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
 	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	double aspect = WINDOW_WIDTH / WINDOW_HEIGHT;
-	gluPerspective(60.0, aspect, NEAR_PLANE, FAR_PLANE);
+	double m[16];
+	camera_projection_matrix(m);
+	glLoadMatrixd(m);
 	
 	glMatrixMode(GL_MODELVIEW);
 }
@@ -212,14 +236,9 @@ handle_mousemove(SDL_Event *e){
 
 void
 camera_load_modelview(void){
-	double center[3];
-	center[0] = camera->eye[0] + camera->forward.x;
-	center[1] = camera->eye[1] + camera->forward.y;
-	center[2] = camera->eye[2] + camera->forward.z;
-
-	gluLookAt(camera->eye[0], camera->eye[1], camera->eye[2], 
-		  center[0], center[1], center[2],
-		  camera->up.x, camera->up.y, camera->up.z);
+	double m[16];
+	camera_modelview_matrix(m);
+	glMultMatrixd(m);
 }
 
 static void
@@ -16,6 +16,8 @@
 #ifndef __CAMERA_H__
 #define __CAMERA_H__
 
+/* Vertical field of view in degrees */
+#define CAMERA_FOV 60.0
 #define NEAR_PLANE 0.1
 #define FAR_PLANE 1000.0
 #define CAMERA_RADIUS 100
@@ -30,6 +32,12 @@ typedef struct camera_s {
 extern camera_t *camera;
 
 void camera_create(void);
+/* The matrices loaded by camera_load_perspective and camera_load_modelview */
+void camera_projection_matrix(double m[16]);
+void camera_modelview_matrix(double m[16]);
+/* The planes of the view frustum in world coordinates as of now, like 
+ * mat_frustum_planes */
+void camera_frustum_planes(double planes[6][4]);
 void camera_load_perspective(void);
 void camera_load_modelview(void);
 void camera_free(void);
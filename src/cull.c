@@ -0,0 +1,280 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL/SDL.h>
+
+#include "util.h"
+#include "cull.h"
+#include "simd.h"
+
+typedef struct cull_key_s {
+	float key;
+	int index;
+} cull_key_t;
+
+void
+cull_table_init(cull_table_t *t){
+	memset(t, 0, sizeof(cull_table_t));
+}
+
+void
+cull_table_free(cull_table_t *t){
+	for(int a = 0; a < 3; a++){
+		free(t->min[a]);
+		free(t->max[a]);
+	}
+	free(t->active_blocks);
+	free(t->flags);
+	free(t->handles);
+	free(t->visible);
+	free(t->order);
+	free(t->keys);
+	free(t->mark);
+	memset(t, 0, sizeof(cull_table_t));
+}
+
+/* Grow an array of capacity elements of elm_size bytes to new_capacity,
+ * clearing the new elements */
+static void*
+cull_grow(void *data, int capacity, int new_capacity, int elm_size){
+	char *p = realloc(data, (size_t) new_capacity * elm_size);
+	if(p == NULL)
+		FATAL_ERROR("Out of memory");
+	memset(p + (size_t) capacity * elm_size, 0, (size_t) (new_capacity - capacity) * elm_size);
+	return p;
+}
+
+int
+cull_table_add(cull_table_t *t, void *handle){
+	if(t->size == t->capacity){
+		/* A multiple of SIMD_WIDTH, so the last batch can be loaded 
+		 * past size */
+		int capacity = t->capacity > 0 ? 2 * t->capacity : 64 * SIMD_WIDTH;
+		for(int a = 0; a < 3; a++){
+			t->min[a] = cull_grow(t->min[a], t->capacity, capacity, sizeof(float));
+			t->max[a] = cull_grow(t->max[a], t->capacity, capacity, sizeof(float));
+		}
+		t->active_blocks = cull_grow(t->active_blocks, t->capacity, capacity, sizeof(int));
+		t->flags = cull_grow(t->flags, t->capacity, capacity, sizeof(int));
+		t->handles = cull_grow(t->handles, t->capacity, capacity, sizeof(void*));
+		t->visible = cull_grow(t->visible, t->capacity, capacity, sizeof(int));
+		t->order = cull_grow(t->order, t->capacity, capacity, sizeof(int));
+		t->keys = cull_grow(t->keys, t->capacity, capacity, sizeof(cull_key_t));
+		t->mark = cull_grow(t->mark, t->capacity, capacity, sizeof(unsigned char));
+		t->capacity = capacity;
+	}
+
+	int i = t->size++;
+	for(int a = 0; a < 3; a++){
+		t->min[a][i] = 1;
+		t->max[a][i] = 0;
+	}
+	t->active_blocks[i] = 0;
+	t->flags[i] = 0;
+	t->handles[i] = handle;
+	return i;
+}
+
+void*
+cull_table_remove(cull_table_t *t, int i){
+	int last = --t->size;
+	if(i == last)
+		return NULL;
+
+	for(int a = 0; a < 3; a++){
+		t->min[a][i] = t->min[a][last];
+		t->max[a][i] = t->max[a][last];
+	}
+	t->active_blocks[i] = t->active_blocks[last];
+	t->flags[i] = t->flags[last];
+	t->handles[i] = t->handles[last];
+	return t->handles[i];
+}
+
+void
+cull_table_set(cull_table_t *t, int i, float min[3], float max[3], int active_blocks, int flags){
+	for(int a = 0; a < 3; a++){
+		t->min[a][i] = min[a];
+		t->max[a][i] = max[a];
+	}
+	t->active_blocks[i] = active_blocks;
+	t->flags[i] = flags;
+}
+
+static int
+cull_count(int mask){
+	int n = 0;
+	for(; mask != 0; mask >>= 1)
+		n += mask & 1;
+	return n;
+}
+
+/* The distance test takes the point of the box closest to the eye. A box
+ * is outside the frustum if its corner furthest along the normal of one 
+ * of the planes is behind it. That corner takes max on the axes where the 
+ * normal is positive, so every plane reads a fixed array per axis */
+int
+cull_table_visible(cull_table_t *t, double planes[6][4], double eye[3], double radius, cull_stats_t *stats){
+	const float *far_side[6][3];
+	float plane[6][4];
+	for(int k = 0; k < 6; k++){
+		for(int a = 0; a < 3; a++)
+			far_side[k][a] = planes[k][a] > 0 ? t->max[a] : t->min[a];
+		for(int j = 0; j < 4; j++)
+			plane[k][j] = planes[k][j];
+	}
+	float e[3] = { eye[0], eye[1], eye[2] };
+	float r2 = radius * radius;
+
+#if SIMD_WIDTH > 1
+	simd_t zero = simd_set1(0);
+	simd_t e_v[3], plane_v[6][4];
+	for(int a = 0; a < 3; a++)
+		e_v[a] = simd_set1(e[a]);
+	for(int k = 0; k < 6; k++)
+		for(int j = 0; j < 4; j++)
+			plane_v[k][j] = simd_set1(plane[k][j]);
+	simd_t r2_v = simd_set1(r2);
+#endif
+
+	int n_visible = 0;
+	memset(stats, 0, sizeof(cull_stats_t));
+	for(int i = 0; i < t->size; i += SIMD_WIDTH){
+		int n = t->size - i < SIMD_WIDTH ? t->size - i : SIMD_WIDTH;
+		int valid = (1 << n) - 1;
+		int empty = 0;
+		for(int j = 0; j < n; j++)
+			empty |= ((t->active_blocks[i + j] == 0) | (t->flags[i + j] & CULL_HIDDEN)) << j;
+		empty &= valid;
+		if(empty == valid){
+			stats->empty += n;
+			continue;
+		}
+
+#if SIMD_WIDTH > 1
+		simd_t d2 = zero;
+		for(int a = 0; a < 3; a++){
+			simd_t below = simd_sub(simd_load(t->min[a] + i), e_v[a]);
+			simd_t above = simd_sub(e_v[a], simd_load(t->max[a] + i));
+			simd_t d = simd_max(simd_max(below, above), zero);
+			d2 = simd_add(d2, simd_mul(d, d));
+		}
+		int distant = ~simd_mask(simd_lt(d2, r2_v));
+
+		int outside = 0;
+		for(int k = 0; k < 6; k++){
+			simd_t d = plane_v[k][3];
+			for(int a = 0; a < 3; a++)
+				d = simd_add(d, simd_mul(plane_v[k][a], simd_load(far_side[k][a] + i)));
+			outside |= simd_mask(simd_lt(d, zero));
+		}
+#else
+		float d2 = 0;
+		for(int a = 0; a < 3; a++){
+			float d = fmaxf(fmaxf(t->min[a][i] - e[a], e[a] - t->max[a][i]), 0);
+			d2 += d * d;
+		}
+		int distant = !(d2 < r2);
+
+		int outside = 0;
+		for(int k = 0; k < 6; k++){
+			float d = plane[k][3];
+			for(int a = 0; a < 3; a++)
+				d += plane[k][a] * far_side[k][a][i];
+			outside |= d < 0;
+		}
+#endif
+
+		/* Each entry is counted for the first test it fails */
+		distant &= valid & ~empty;
+		outside &= valid & ~empty & ~distant;
+		int pass = valid & ~empty & ~distant & ~outside;
+		stats->empty += cull_count(empty);
+		stats->distant += cull_count(distant);
+		stats->frustum += cull_count(outside);
+		for(int j = 0; pass != 0; j++, pass >>= 1)
+			if(pass & 1)
+				t->visible[n_visible++] = i + j;
+	}
+	return n_visible;
+}
+
+static float
+cull_key(cull_table_t *t, int i, float eye[3]){
+	float d2 = 0;
+	for(int a = 0; a < 3; a++){
+		float d = 0.5f * (t->min[a][i] + t->max[a][i]) - eye[a];
+		d2 += d * d;
+	}
+	return d2;
+}
+
+static int
+cull_key_cmp(const void *a, const void *b){
+	float ka = ((const cull_key_t*) a)->key;
+	float kb = ((const cull_key_t*) b)->key;
+	return ka < kb ? -1 : ka > kb;
+}
+
+/* The entries visible last time are kept in their order and put right 
+ * with an insertion sort. The newly visible ones, a lot of them after a 
+ * quick turn, are sorted on their own and merged in. Entries removed from 
+ * the table since, or moved past its end, are dropped */
+void
+cull_table_sort_visible(cull_table_t *t, int n_visible, double eye[3]){
+	float e[3] = { eye[0], eye[1], eye[2] };
+	for(int j = 0; j < n_visible; j++)
+		t->mark[t->visible[j]] = 1;
+
+	cull_key_t *keys = t->keys;
+	int n_kept = 0;
+	for(int j = 0; j < t->n_order; j++){
+		int i = t->order[j];
+		if(i >= t->size || !t->mark[i])
+			continue;
+		t->mark[i] = 0;
+		cull_key_t k = { cull_key(t, i, e), i };
+		int pos = n_kept++;
+		for(; pos > 0 && keys[pos - 1].key > k.key; pos--)
+			keys[pos] = keys[pos - 1];
+		keys[pos] = k;
+	}
+
+	cull_key_t *fresh = keys + n_kept;
+	int n_fresh = 0;
+	for(int j = 0; j < n_visible; j++){
+		int i = t->visible[j];
+		if(!t->mark[i])
+			continue;
+		t->mark[i] = 0;
+		fresh[n_fresh].key = cull_key(t, i, e);
+		fresh[n_fresh].index = i;
+		n_fresh++;
+	}
+	qsort(fresh, n_fresh, sizeof(cull_key_t), cull_key_cmp);
+
+	int a = 0, b = 0;
+	for(int j = 0; j < n_visible; j++){
+		if(b == n_fresh || (a < n_kept && keys[a].key <= fresh[b].key))
+			t->visible[j] = keys[a++].index;
+		else
+			t->visible[j] = fresh[b++].index;
+	}
+	memcpy(t->order, t->visible, n_visible * sizeof(int));
+	t->n_order = n_visible;
+}
@@ -0,0 +1,75 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __CULL_H__
+#define __CULL_H__
+
+/* Entry flags */
+/* Can't be seen whatever the camera does, like a chunk surrounded by full chunks */
+#define CULL_HIDDEN 1
+
+/* What the visibility pass needs of every loaded chunk, as parallel
+ * arrays. It streams through these instead of the chunks themselves and 
+ * tests SIMD_WIDTH entries at a time with SSE or AVX where the compiler 
+ * targets them. Entry i is for handles[i] */
+typedef struct cull_table_s {
+	int size;
+	int capacity;
+	/* Box in world coordinates. min above max for nothing */
+	float *min[3];
+	float *max[3];
+	int *active_blocks;
+	int *flags;
+	void **handles;
+	/* Indices of the entries that passed the last cull_table_visible */
+	int *visible;
+	/* The visible entries as cull_table_sort_visible last ordered them */
+	int *order;
+	int n_order;
+	/* Internal, for sorting */
+	struct cull_key_s *keys;
+	unsigned char *mark;
+} cull_table_t;
+
+/* Why entries were left out by the last cull_table_visible */
+typedef struct cull_stats_s {
+	/* Without active blocks or flagged hidden */
+	int empty;
+	/* Further than the radius */
+	int distant;
+	/* Outside the view frustum */
+	int frustum;
+} cull_stats_t;
+
+void cull_table_init(cull_table_t *t);
+void cull_table_free(cull_table_t *t);
+/* Add an empty entry for handle. Returns its index */
+int cull_table_add(cull_table_t *t, void *handle);
+/* Remove entry i by moving the last entry into its place. Returns the
+ * handle of the moved entry, now at i, or NULL if i was the last */
+void* cull_table_remove(cull_table_t *t, int i);
+void cull_table_set(cull_table_t *t, int i, float min[3], float max[3], int active_blocks, int flags);
+/* Find the entries with active blocks, not hidden, with the box closer
+ * than radius to eye and not outside the frustum planes, as given by 
+ * mat_frustum_planes. Their indices go to t->visible in table order. 
+ * Returns how many there are */
+int cull_table_visible(cull_table_t *t, double planes[6][4], double eye[3], double radius, cull_stats_t *stats);
+/* Order the first n_visible entries of t->visible nearest first, by the 
+ * distance from eye to the centre of the box. The order is carried over 
+ * from the last call with the entries that are still visible, so while 
+ * the camera moves smoothly it only takes small fixes */
+void cull_table_sort_visible(cull_table_t *t, int n_visible, double eye[3]);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+/* Times culling BENCH_CHUNKS synthetic chunks per frame with the cull
+ * table against walking a list of separately allocated chunks, as the 
+ * render list used to be made. The camera looks in a new random 
+ * direction every frame. Sorting the visible chunks front to back is 
+ * timed for those views, and for the camera turning slowly where the 
+ * order of the last frame is mostly right. Build with -mavx to time the 
+ * AVX path */
+
+/* clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <SDL/SDL.h>
+
+#ifndef WIN32
+#include <time.h>
+#endif
+
+#include "util.h"
+#include "cull.h"
+
+/* BENCH_X x BENCH_Y x BENCH_Z chunks of 16 blocks, 2 units each */
+#define BENCH_X 100
+#define BENCH_Y 10
+#define BENCH_Z 100
+#define BENCH_CHUNKS (BENCH_X * BENCH_Y * BENCH_Z)
+#define BENCH_CHUNK_WIDTH 32
+/* As the camera has them */
+#define BENCH_FOV 60.0
+#define BENCH_NEAR 0.1
+#define BENCH_FAR 1000.0
+/* Blocks of a chunk kept in a separate allocation, like block storage */
+#define BENCH_STORAGE 512
+
+/* A chunk as the list walk sees it */
+typedef struct bench_chunk_s {
+	double pos[3];
+	int box_lo[3];
+	int box_hi[3];
+	int active_blocks;
+	int hidden;
+	void *storage;
+} bench_chunk_t;
+
+void
+usage(void){
+	fprintf(stderr, "Usage: cullbench [frames]\n");
+	exit(1);
+}
+
+static double
+bench_ms(void){
+#ifndef WIN32
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+#else
+	return SDL_GetTicks();
+#endif
+}
+
+/* The tests of cull_table_visible on one chunk, in doubles */
+static int
+is_bench_chunk_visible(bench_chunk_t *c, double planes[6][4], double eye[3], double radius){
+	if(c->active_blocks == 0 || c->hidden)
+		return 0;
+
+	double lo[3], hi[3], d2 = 0;
+	for(int a = 0; a < 3; a++){
+		lo[a] = c->pos[a] + 2 * c->box_lo[a] - 1;
+		hi[a] = c->pos[a] + 2 * c->box_hi[a] + 1;
+		double d = lo[a] - eye[a] > eye[a] - hi[a] ? lo[a] - eye[a] : eye[a] - hi[a];
+		if(d > 0)
+			d2 += d * d;
+	}
+	if(d2 >= radius * radius)
+		return 0;
+
+	for(int i = 0; i < 6; i++){
+		double *p = planes[i];
+		double d = p[3];
+		for(int a = 0; a < 3; a++)
+			d += p[a] * (p[a] > 0 ? hi[a] : lo[a]);
+		if(d < 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+bench_planes(double planes[6][4], double eye[3], double dir[3]){
+	double center[3] = { eye[0] + dir[0], eye[1] + dir[1], eye[2] + dir[2] };
+	double up[3] = { 0, 1, 0 };
+	double proj[16], view[16], m[16];
+	mat_perspective(proj, BENCH_FOV, (double) WINDOW_WIDTH / WINDOW_HEIGHT, BENCH_NEAR, BENCH_FAR);
+	mat_lookat(view, eye, center, up);
+	mat_mult(m, proj, view);
+	mat_frustum_planes(planes, m);
+}
+
+static double
+bench_random(void){
+	return rand() / (double) RAND_MAX;
+}
+
+int
+main(int argc, char *argv[]){
+	if(argc > 2)
+		usage();
+	int frames = argc == 2 ? atoi(argv[1]) : 200;
+	if(frames <= 0)
+		usage();
+
+	/* Chunks of terrain: air above, solid below and a surface between */
+	bench_chunk_t **chunks = malloc(BENCH_CHUNKS * sizeof(bench_chunk_t*));
+	srand(1);
+	for(int i = 0; i < BENCH_CHUNKS; i++){
+		bench_chunk_t *c = malloc(sizeof(bench_chunk_t));
+		int ind[3] = { i / (BENCH_Y * BENCH_Z), i / BENCH_Z % BENCH_Y, i % BENCH_Z };
+		int surface = BENCH_Y / 2 + rand() % 3 - 1;
+		for(int a = 0; a < 3; a++){
+			c->pos[a] = ind[a] * BENCH_CHUNK_WIDTH;
+			c->box_lo[a] = rand() % 4;
+			c->box_hi[a] = 15 - rand() % 4;
+		}
+		c->active_blocks = ind[1] > surface ? 0 : ind[1] < surface ? 4096 : 1 + rand() % 4095;
+		c->hidden = ind[1] < surface - 1;
+		c->storage = malloc(BENCH_STORAGE);
+		chunks[i] = c;
+	}
+
+	/* Chunks are loaded in no particular order */
+	for(int i = BENCH_CHUNKS - 1; i > 0; i--){
+		int j = rand() % (i + 1);
+		bench_chunk_t *tmp = chunks[i];
+		chunks[i] = chunks[j];
+		chunks[j] = tmp;
+	}
+
+	linked_list_t *list = util_list_create();
+	cull_table_t table;
+	cull_table_init(&table);
+	for(int i = 0; i < BENCH_CHUNKS; i++){
+		bench_chunk_t *c = chunks[i];
+		util_list_add(list, c);
+		float min[3], max[3];
+		for(int a = 0; a < 3; a++){
+			min[a] = c->pos[a] + 2 * c->box_lo[a] - 1;
+			max[a] = c->pos[a] + 2 * c->box_hi[a] + 1;
+		}
+		int j = cull_table_add(&table, c);
+		cull_table_set(&table, j, min, max, c->active_blocks, c->hidden ? CULL_HIDDEN : 0);
+	}
+
+	double table_ms = 0, list_ms = 0, sort_ms = 0, turn_ms = 0;
+	long table_visible = 0, list_visible = 0;
+	cull_stats_t stats, total = { 0, 0, 0 };
+	double eye[3] = {
+		BENCH_X * BENCH_CHUNK_WIDTH / 2.0,
+		BENCH_Y * BENCH_CHUNK_WIDTH / 2.0 + 20,
+		BENCH_Z * BENCH_CHUNK_WIDTH / 2.0
+	};
+	for(int frame = 0; frame < frames; frame++){
+		double dir[3] = { bench_random() - 0.5, 0.5 * (bench_random() - 0.5), bench_random() - 0.5 };
+		double planes[6][4];
+		bench_planes(planes, eye, dir);
+
+		double start = bench_ms();
+		int n = cull_table_visible(&table, planes, eye, BENCH_FAR, &stats);
+		table_ms += bench_ms() - start;
+		table_visible += n;
+		start = bench_ms();
+		cull_table_sort_visible(&table, n, eye);
+		sort_ms += bench_ms() - start;
+		total.empty += stats.empty;
+		total.distant += stats.distant;
+		total.frustum += stats.frustum;
+
+		start = bench_ms();
+		for(linked_list_elm_t *elm = list->head; elm != NULL; elm = elm->next)
+			list_visible += is_bench_chunk_visible(elm->data, planes, eye, BENCH_FAR);
+		list_ms += bench_ms() - start;
+	}
+
+	/* A degree per frame */
+	for(int frame = 0; frame < frames; frame++){
+		double dir[3] = { cos(frame * 0.0175), -0.1, sin(frame * 0.0175) };
+		double planes[6][4];
+		bench_planes(planes, eye, dir);
+		int n = cull_table_visible(&table, planes, eye, BENCH_FAR, &stats);
+		double start = bench_ms();
+		cull_table_sort_visible(&table, n, eye);
+		turn_ms += bench_ms() - start;
+	}
+
+#if defined(__AVX__)
+	char *simd = "AVX";
+#elif defined(__SSE__)
+	char *simd = "SSE";
+#else
+	char *simd = "scalar";
+#endif
+	printf("%d chunks, %d frames\n", BENCH_CHUNKS, frames);
+	printf("culled per frame: %.0f empty or hidden, %.0f distant, %.0f outside the frustum\n",
+			total.empty / (double) frames, total.distant / (double) frames, total.frustum / (double) frames);
+	char label[32];
+	snprintf(label, sizeof(label), "cull table (%s):", simd);
+	printf("%-18s %8.3f ms per frame, %.0f visible\n", label, table_ms / frames, table_visible / (double) frames);
+	printf("%-18s %8.3f ms per frame, %.0f visible\n", "chunk list:", list_ms / frames, list_visible / (double) frames);
+	printf("front to back:     %8.3f ms per frame for random views, %.3f ms turning\n", sort_ms / frames, turn_ms / frames);
+	if(list_visible != table_visible)
+		printf("The visible counts differ by %ld, boxes on the plane may go either way in floats\n",
+				table_visible - list_visible);
+
+	util_list_free(list);
+	cull_table_free(&table);
+	for(int i = 0; i < BENCH_CHUNKS; i++){
+		free(chunks[i]->storage);
+		free(chunks[i]);
+	}
+	free(chunks);
+	return 0;
+}
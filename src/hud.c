@@ -25,6 +25,7 @@
 #include "camera.h"
 #include "startup.h"
 
+int hud_has_selection;
 int hud_selected_block[3];
 chunk_t *hud_selected_chunk;
 
@@ -110,9 +111,7 @@ hud_init(void){
 	/* TODO: Don't hardcore font size */
 	font_tileset = hud_load_tileset(util_settings_polls("hud/font/path"), 6, 8, 16, 6, 1, 0xFF, 0x00, 0x00, GL_NEAREST);
 	cross_tile = hud_load_single_tile(util_settings_polls("hud/cross/path"), 0xff, 0x00, 0xff, GL_NEAREST);
-	hud_selected_block[0] = -1;
-	hud_selected_block[1] = -1;
-	hud_selected_block[2] = -1;
+	hud_has_selection = 0;
 }
 STARTUP_PROC(hud, 3, hud_init)
 
@@ -320,14 +319,11 @@ hud_draw_selection_cross(void){
 	hud_draw_tile(x, y, 33, 33, cross_tile);
 }
 
+/* World block coordinate of the block at v along an axis. Blocks are 
+ * two units wide */
 static int
-get_block_relative_to_chunk(double v){
-	long tmp;
-	tmp = lround(v) % (2 * CHUNK_SIZE);
-	int t = (int) lround((tmp + 0.5) / 2);	
-	if(t >= CHUNK_SIZE)
-		t = CHUNK_SIZE - 1;
-	return t;
+get_block_at(double v){
+	return (int) floor((lround(v) + 1) / 2.0);
 }
 
 static double 
@@ -349,22 +345,20 @@ shoot_ray(int *out_x, int *out_y, int *out_z, chunk_t **out_c){
 	v[2] = camera->eye[2];
 
 	while(len_to_eye(v) < 15){
-		int c_ix = v[0] / (2 * CHUNK_SIZE);
-		int c_iy = v[1] / (2 * CHUNK_SIZE);
-		int c_iz = v[2] / (2 * CHUNK_SIZE);
-		int b_x  = get_block_relative_to_chunk(v[0]);
-		int b_y  = get_block_relative_to_chunk(v[1]);
-		int b_z  = get_block_relative_to_chunk(v[2]);
-		if(b_x >= 0 && b_y >= 0 && b_z >= 0){
-			chunk_t *chunk = chunkmanager_get_chunk(c_ix, c_iy, c_iz);
-			if(chunk != NULL && block_isactive(chunk->blocks[b_x][b_y][b_z])){
-				*out_x = c_ix * CHUNK_SIZE + b_x;
-				*out_y = c_iy * CHUNK_SIZE + b_y;
-				*out_z = c_iz * CHUNK_SIZE + b_z;
-				*out_c = chunk;
-				//printf("selected %d %d %d\n", *world_x, *world_y, *world_z);
-				return 1;
-			}
+		int w_x = get_block_at(v[0]);
+		int w_y = get_block_at(v[1]);
+		int w_z = get_block_at(v[2]);
+		int b_x = chunk_block_offset(w_x);
+		int b_y = chunk_block_offset(w_y);
+		int b_z = chunk_block_offset(w_z);
+		chunk_t *chunk = chunkmanager_get_chunk(chunk_index_of_block(w_x), chunk_index_of_block(w_y), chunk_index_of_block(w_z));
+		if(chunk != NULL && block_isactive(chunk_get_block(chunk, b_x, b_y, b_z))){
+			*out_x = w_x;
+			*out_y = w_y;
+			*out_z = w_z;
+			*out_c = chunk;
+			//printf("selected %d %d %d\n", *world_x, *world_y, *world_z);
+			return 1;
 		}
 
 		/* Advance */
@@ -388,6 +382,7 @@ hud_draw_selection_cube(void){
 	int x, y, z;
 	chunk_t *c;
 	int r = shoot_ray(&x, &y, &z, &c);
+	hud_has_selection = r;
 	if(r){
 		/* Store in global variables */
 		hud_selected_chunk = c;
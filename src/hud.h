@@ -53,6 +53,8 @@ void hud_cleanup(void);
 void hud_draw_selection_cross(void);
 void hud_draw_selection_cube(void);
 
+/* Set while a block is selected, in world block coordinates */
+extern int hud_has_selection;
 extern int hud_selected_block[3];
 extern chunk_t *hud_selected_chunk;
 
@@ -29,6 +29,7 @@ static int user_pressed_quit;
 static event_handler_t *quit_handler;
 static event_handler_t *mouse_down_handler;
 static Uint32 last_fps = 0;
+static world_file_t *world;
 
 void load_world(void);
 
@@ -170,8 +171,13 @@ quit_callback(SDL_Event *e){
 int
 mouse_callback(SDL_Event *e){
 	if(e->button.type == SDL_MOUSEBUTTONDOWN && e->button.button == SDL_BUTTON_RIGHT){
-		if(hud_selected_block[0] != -1)
-			chunk_remove_block(hud_selected_chunk, hud_selected_block[0], hud_selected_block[1], hud_selected_block[2]);
+		if(hud_has_selection){
+			/* The selected chunk may have been unloaded since the selection was made */
+			chunk_t *c = chunkmanager_get_chunk(chunk_index_of_block(hud_selected_block[0]), 
+					chunk_index_of_block(hud_selected_block[1]), chunk_index_of_block(hud_selected_block[2]));
+			if(c != NULL)
+				chunk_remove_block(c, hud_selected_block[0], hud_selected_block[1], hud_selected_block[2]);
+		}
 	}
 	return 0;
 }
@@ -206,6 +212,13 @@ draw_debug_info(void){
 	memset(buff, 0, 100);
 	snprintf(buff, 100, "chunks:%d blocks:%d trigs:%d", chunkmanager_nchunks(), chunkmanager_activeblocks(), chunkmanager_ntrigs());
 	hud_draw_string(5, 550, 12, 16, buff);
+	memset(buff, 0, 100);
+	snprintf(buff, 100, "dirty:%d meshing:%d rebuilds:%d", chunkmanager_ndirty(), chunkmanager_nqueued(), chunkmanager_frame_rebuilds());
+	hud_draw_string(5, 535, 12, 16, buff);
+	memset(buff, 0, 100);
+	snprintf(buff, 100, "culled frustum:%d caves:%d occluded:%d", chunkmanager_frustum_culled(), chunkmanager_cave_culled(), 
+			chunkmanager_occlusion_culled());
+	hud_draw_string(5, 520, 12, 16, buff);
 }
 
 void
@@ -240,8 +253,8 @@ draw_frame(void){
 	chunk_render(chunk1);
 	chunk_render(chunk2);
 	*/
-	skybox_render();
 	chunkmanager_render_world();
+	skybox_render();
 	//renderblock(0, 0, 5);
 	draw_hud();
 }
@@ -294,6 +307,8 @@ game_loop(void){
 	}
 
 	chunkmanager_free();
+	world_close(world);
+	free(world);
 	cleanup_graphics();
 	cleanup_event_handlers();
 	hud_cleanup();
@@ -303,8 +318,9 @@ game_loop(void){
 
 void
 load_world(void){
-	world_file_t *world = malloc(sizeof(world_file_t));
+	world = malloc(sizeof(world_file_t));
 	world->path = "data/big.wrl";
+	world->mmap = util_settings_pollb("world/mmap");
 	if(world_open(world) < 0)
 		FATAL_ERROR("Couldnt open world file");
 	chunkmanager_init(world);
@@ -0,0 +1,221 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+
+#include <float.h>
+#include <math.h>
+
+#include "occlusion.h"
+#include "simd.h"
+
+/* Occluders and boxes with a corner projected further than this many 
+ * pixels off the buffer are taken as crossing the near plane. Keeps the 
+ * edge functions well within float precision */
+#define OCCLUSION_MAX_COORD 4096.0
+
+void
+occlusion_begin(occlusion_buffer_t *o, double m[16], double znear){
+	for(int i = 0; i < 16; i++)
+		o->m[i] = m[i];
+	o->znear = znear;
+	for(int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++)
+		o->depth[i] = FLT_MAX;
+}
+
+/* Project the corners of the box lo to hi to buffer pixels x, y with 
+ * their depth between min_w and max_w. Returns 0 if a corner is closer 
+ * than the near plane */
+static int
+occlusion_project(occlusion_buffer_t *o, float lo[3], float hi[3], double x[8], double y[8], float *min_w, float *max_w){
+	double *m = o->m;
+	*min_w = FLT_MAX;
+	*max_w = 0;
+	for(int i = 0; i < 8; i++){
+		double p[3] = { i & 1 ? hi[0] : lo[0], i & 2 ? hi[1] : lo[1], i & 4 ? hi[2] : lo[2] };
+		double c[4];
+		for(int r = 0; r < 4; r++)
+			c[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+		if(c[3] < o->znear)
+			return 0;
+		x[i] = (c[0] / c[3] + 1) * 0.5 * OCCLUSION_WIDTH;
+		y[i] = (c[1] / c[3] + 1) * 0.5 * OCCLUSION_HEIGHT;
+		if(fabs(x[i]) > OCCLUSION_MAX_COORD || fabs(y[i]) > OCCLUSION_MAX_COORD)
+			return 0;
+		*min_w = fminf(*min_w, c[3]);
+		*max_w = fmaxf(*max_w, c[3]);
+	}
+	return 1;
+}
+
+/* Pixels x0 to x1 and y0 to y1 touched by the n points x, y, clipped to 
+ * the buffer. Returns 0 if there are none */
+static int
+occlusion_rect(double *x, double *y, int n, int *x0, int *x1, int *y0, int *y1){
+	double min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+	for(int i = 1; i < n; i++){
+		min_x = fmin(min_x, x[i]);
+		max_x = fmax(max_x, x[i]);
+		min_y = fmin(min_y, y[i]);
+		max_y = fmax(max_y, y[i]);
+	}
+	*x0 = min_x > 0 ? (int) min_x : 0;
+	*y0 = min_y > 0 ? (int) min_y : 0;
+	*x1 = max_x < OCCLUSION_WIDTH ? (int) ceil(max_x) - 1 : OCCLUSION_WIDTH - 1;
+	*y1 = max_y < OCCLUSION_HEIGHT ? (int) ceil(max_y) - 1 : OCCLUSION_HEIGHT - 1;
+	return *x0 <= *x1 && *y0 <= *y1;
+}
+
+static double
+occlusion_cross(double *x, double *y, int o, int a, int b){
+	return (x[a] - x[o]) * (y[b] - y[o]) - (y[a] - y[o]) * (x[b] - x[o]);
+}
+
+/* Convex hull of the eight projected corners x, y, counter clockwise 
+ * with y up and the first corner repeated at the end. The outline of the 
+ * box on screen, the union of its front faces. Returns the number of 
+ * corners on it */
+static int
+occlusion_hull(double *x, double *y, int hull[17]){
+	int order[8];
+	for(int i = 0; i < 8; i++){
+		int j = i;
+		for(; j > 0 && (x[order[j - 1]] > x[i] || (x[order[j - 1]] == x[i] && y[order[j - 1]] > y[i])); j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	/* Lower half left to right, then the upper half back */
+	int n = 0;
+	for(int i = 0; i < 8; i++){
+		while(n >= 2 && occlusion_cross(x, y, hull[n - 2], hull[n - 1], order[i]) <= 0)
+			n--;
+		hull[n++] = order[i];
+	}
+	for(int i = 6, lower = n + 1; i >= 0; i--){
+		while(n >= lower && occlusion_cross(x, y, hull[n - 2], hull[n - 1], order[i]) <= 0)
+			n--;
+		hull[n++] = order[i];
+	}
+	return n - 1;
+}
+
+/* Every pixel fully inside the outline takes the furthest depth of the 
+ * box, unless something nearer covers it already. The outline is taken 
+ * whole so the faces leave no seams between them */
+void
+occlusion_add_box(occlusion_buffer_t *o, float lo[3], float hi[3]){
+	double x[8], y[8];
+	float min_w, max_w;
+	if(!occlusion_project(o, lo, hi, x, y, &min_w, &max_w))
+		return;
+	int x0, x1, y0, y1;
+	if(!occlusion_rect(x, y, 8, &x0, &x1, &y0, &y1))
+		return;
+	int hull[17];
+	int n = occlusion_hull(x, y, hull);
+	if(n < 3)
+		return;
+
+	/* Edge k is a[k] * px + b[k] * py + c[k] with the distance in pixels 
+	 * from the pixel centre px, py to the edge. Inside when it is at 
+	 * least half a pixel along both axes */
+	float a[8], b[8], c[8];
+	int n_edges = 0;
+	for(int k = 0; k < n; k++){
+		int i = hull[k], j = hull[k + 1];
+		double ea = y[i] - y[j];
+		double eb = x[j] - x[i];
+		double len = fabs(ea) + fabs(eb);
+		if(len == 0)
+			continue;
+		a[n_edges] = ea / len;
+		b[n_edges] = eb / len;
+		c[n_edges] = (x[i] * y[j] - x[j] * y[i]) / len - 0.5;
+		n_edges++;
+	}
+
+	x0 -= x0 % SIMD_WIDTH;
+#if SIMD_WIDTH > 1
+	float lanes[SIMD_WIDTH];
+	for(int l = 0; l < SIMD_WIDTH; l++)
+		lanes[l] = l + 0.5f;
+	simd_t lane_x = simd_load(lanes);
+	simd_t zero = simd_set1(0);
+	simd_t depth = simd_set1(max_w);
+	simd_t a_v[8];
+	for(int k = 0; k < n_edges; k++)
+		a_v[k] = simd_set1(a[k]);
+#endif
+	for(int py = y0; py <= y1; py++){
+		float *row = o->depth + py * OCCLUSION_WIDTH;
+		float cy = py + 0.5f;
+#if SIMD_WIDTH > 1
+		simd_t base[8];
+		for(int k = 0; k < n_edges; k++)
+			base[k] = simd_set1(b[k] * cy + c[k]);
+		for(int px = x0; px <= x1; px += SIMD_WIDTH){
+			simd_t cx = simd_add(simd_set1(px), lane_x);
+			simd_t inside = simd_ge(simd_add(simd_mul(a_v[0], cx), base[0]), zero);
+			for(int k = 1; k < n_edges; k++)
+				inside = simd_and(inside, simd_ge(simd_add(simd_mul(a_v[k], cx), base[k]), zero));
+			if(simd_mask(inside) == 0)
+				continue;
+			simd_t d = simd_load(row + px);
+			simd_store(row + px, simd_or(simd_and(inside, simd_min(d, depth)), simd_andnot(inside, d)));
+		}
+#else
+		for(int px = x0; px <= x1; px++){
+			float cx = px + 0.5f;
+			int inside = 1;
+			for(int k = 0; k < n_edges && inside; k++)
+				inside = a[k] * cx + b[k] * cy + c[k] >= 0;
+			if(inside)
+				row[px] = fminf(row[px], max_w);
+		}
+#endif
+	}
+}
+
+/* Every pixel the box touches is tested against its nearest depth, a 
+ * few more where the span is rounded out to whole vectors */
+int
+occlusion_is_box_hidden(occlusion_buffer_t *o, float lo[3], float hi[3]){
+	double x[8], y[8];
+	float min_w, max_w;
+	if(!occlusion_project(o, lo, hi, x, y, &min_w, &max_w))
+		return 0;
+	int x0, x1, y0, y1;
+	/* Off the screen, that is for frustum culling to say */
+	if(!occlusion_rect(x, y, 8, &x0, &x1, &y0, &y1))
+		return 0;
+
+	x0 -= x0 % SIMD_WIDTH;
+#if SIMD_WIDTH > 1
+	simd_t depth = simd_set1(min_w);
+#endif
+	for(int py = y0; py <= y1; py++){
+		float *row = o->depth + py * OCCLUSION_WIDTH;
+		for(int px = x0; px <= x1; px += SIMD_WIDTH){
+#if SIMD_WIDTH > 1
+			if(simd_mask(simd_lt(simd_load(row + px), depth)) != SIMD_ALL)
+				return 0;
+#else
+			if(!(row[px] < min_w))
+				return 0;
+#endif
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,47 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __OCCLUSION_H__
+#define __OCCLUSION_H__
+
+/* A multiple of SIMD_WIDTH */
+#define OCCLUSION_WIDTH 160
+#define OCCLUSION_HEIGHT 120
+
+/* A small depth buffer drawn on the CPU with boxes known to be solid, to 
+ * test the boxes of what is about to be drawn against. A pixel holds the 
+ * depth of the furthest point of the occluder covering it, and only 
+ * counts as covered if one occluder covers all of it. A box deeper than 
+ * every pixel it touches is hidden for sure. Depth is the w of clip 
+ * coordinates, the distance in front of the camera */
+typedef struct occlusion_buffer_s {
+	/* Rows from the bottom of the screen up */
+	float depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+	/* Projection times modelview */
+	double m[16];
+	double znear;
+} occlusion_buffer_t;
+
+/* Clear the buffer for a view with the matrix m, projection times 
+ * modelview, and near plane znear */
+void occlusion_begin(occlusion_buffer_t *o, double m[16], double znear);
+/* Draw the box lo to hi in world coordinates as an occluder. Boxes 
+ * reaching in front of the near plane are left out */
+void occlusion_add_box(occlusion_buffer_t *o, float lo[3], float hi[3]);
+/* 1 if the box lo to hi is behind the occluders drawn since 
+ * occlusion_begin wherever it is on screen */
+int occlusion_is_box_hidden(occlusion_buffer_t *o, float lo[3], float hi[3]);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Draws walls into an occlusion buffer and checks which boxes come out 
+ * hidden behind them. The camera is at the origin looking down -z */
+
+#include <stdio.h>
+#include <SDL/SDL.h>
+
+#include "util.h"
+#include "occlusion.h"
+
+static int n_failed = 0;
+
+static void
+check_box(occlusion_buffer_t *o, float lo[3], float hi[3], int hidden, char *what){
+	if(occlusion_is_box_hidden(o, lo, hi) != hidden){
+		printf("%s is %s\n", what, hidden ? "visible" : "hidden");
+		n_failed++;
+	}
+}
+
+int
+main(void){
+	static occlusion_buffer_t o;
+	double eye[3] = { 0, 0, 0 };
+	double center[3] = { 0, 0, -1 };
+	double up[3] = { 0, 1, 0 };
+	double proj[16], view[16], m[16];
+	mat_perspective(proj, 60, (double) WINDOW_WIDTH / WINDOW_HEIGHT, 0.1, 1000);
+	mat_lookat(view, eye, center, up);
+	mat_mult(m, proj, view);
+
+	float behind_lo[3] = { -2, -2, -40 }, behind_hi[3] = { 2, 2, -36 };
+	occlusion_begin(&o, m, 0.1);
+	check_box(&o, behind_lo, behind_hi, 0, "a box with nothing in front");
+
+	float wall_lo[3] = { -10, -10, -21 }, wall_hi[3] = { 10, 10, -20 };
+	occlusion_add_box(&o, wall_lo, wall_hi);
+	check_box(&o, behind_lo, behind_hi, 1, "a box behind the wall");
+	float beside_lo[3] = { 25, -2, -40 }, beside_hi[3] = { 29, 2, -36 };
+	check_box(&o, beside_lo, beside_hi, 0, "a box beside the wall");
+	float front_lo[3] = { -2, -2, -15 }, front_hi[3] = { 2, 2, -11 };
+	check_box(&o, front_lo, front_hi, 0, "a box in front of the wall");
+	float inside_lo[3] = { -2, -2, -20.8 }, inside_hi[3] = { 2, 2, -20.2 };
+	check_box(&o, inside_lo, inside_hi, 0, "a box inside the wall");
+	float near_lo[3] = { -2, -2, -40 }, near_hi[3] = { 2, 2, 1 };
+	check_box(&o, near_lo, near_hi, 0, "a box through the near plane");
+
+	/* Walls crossing the near plane don't hide anything */
+	occlusion_begin(&o, m, 0.1);
+	float close_lo[3] = { -10, -10, -21 }, close_hi[3] = { 10, 10, 1 };
+	occlusion_add_box(&o, close_lo, close_hi);
+	check_box(&o, behind_lo, behind_hi, 0, "a box behind a wall through the near plane");
+
+	/* Two walls with a gap of a few pixels, and then less than a pixel 
+	 * between them */
+	float gaps[2] = { 0.5, 0.02 };
+	for(int i = 0; i < 2; i++){
+		occlusion_begin(&o, m, 0.1);
+		float left_lo[3] = { -10, -10, -21 }, left_hi[3] = { -gaps[i], 10, -20 };
+		float right_lo[3] = { gaps[i], -10, -21 }, right_hi[3] = { 10, 10, -20 };
+		occlusion_add_box(&o, left_lo, left_hi);
+		occlusion_add_box(&o, right_lo, right_hi);
+		float gap_lo[3] = { -0.01, -2, -40 }, gap_hi[3] = { 0.01, 2, -36 };
+		check_box(&o, gap_lo, gap_hi, 0, i == 0 ? "a box behind a gap" : "a box behind a gap under a pixel");
+		float left_box_lo[3] = { -8, -2, -40 }, left_box_hi[3] = { -4, 2, -36 };
+		check_box(&o, left_box_lo, left_box_hi, 1, "a box behind the left wall");
+	}
+
+	printf("%s\n", n_failed == 0 ? "occlusiontest passed" : "occlusiontest failed");
+	return n_failed != 0;
+}
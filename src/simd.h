@@ -0,0 +1,67 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+/* Vectors of SIMD_WIDTH floats, with AVX or SSE where the compiler 
+ * targets them. Comparisons give a mask with every bit of a lane set 
+ * where they hold, simd_mask takes a bit per lane of it. Without either 
+ * SIMD_WIDTH is 1 and the users fall back to plain floats */
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+typedef __m256 simd_t;
+#define simd_load(p) _mm256_loadu_ps(p)
+#define simd_store(p, a) _mm256_storeu_ps(p, a)
+#define simd_set1(x) _mm256_set1_ps(x)
+#define simd_add(a, b) _mm256_add_ps(a, b)
+#define simd_sub(a, b) _mm256_sub_ps(a, b)
+#define simd_mul(a, b) _mm256_mul_ps(a, b)
+#define simd_min(a, b) _mm256_min_ps(a, b)
+#define simd_max(a, b) _mm256_max_ps(a, b)
+#define simd_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define simd_ge(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define simd_and(a, b) _mm256_and_ps(a, b)
+/* a is the one inverted */
+#define simd_andnot(a, b) _mm256_andnot_ps(a, b)
+#define simd_or(a, b) _mm256_or_ps(a, b)
+#define simd_mask(a) _mm256_movemask_ps(a)
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define SIMD_WIDTH 4
+typedef __m128 simd_t;
+#define simd_load(p) _mm_loadu_ps(p)
+#define simd_store(p, a) _mm_storeu_ps(p, a)
+#define simd_set1(x) _mm_set1_ps(x)
+#define simd_add(a, b) _mm_add_ps(a, b)
+#define simd_sub(a, b) _mm_sub_ps(a, b)
+#define simd_mul(a, b) _mm_mul_ps(a, b)
+#define simd_min(a, b) _mm_min_ps(a, b)
+#define simd_max(a, b) _mm_max_ps(a, b)
+#define simd_lt(a, b) _mm_cmplt_ps(a, b)
+#define simd_ge(a, b) _mm_cmpge_ps(a, b)
+#define simd_and(a, b) _mm_and_ps(a, b)
+#define simd_andnot(a, b) _mm_andnot_ps(a, b)
+#define simd_or(a, b) _mm_or_ps(a, b)
+#define simd_mask(a) _mm_movemask_ps(a)
+#else
+#define SIMD_WIDTH 1
+#endif
+
+/* simd_mask of a vector true in every lane */
+#define SIMD_ALL ((1 << SIMD_WIDTH) - 1)
+
+#endif
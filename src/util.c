@@ -548,6 +548,67 @@ deg2radians(double deg){
 	return deg * PI / 180;
 }
 
+/* Like gluPerspective */
+void
+mat_perspective(double m[16], double fovy, double aspect, double znear, double zfar){
+	double f = 1 / tan(deg2radians(fovy) / 2);
+	memset(m, 0, 16 * sizeof(double));
+	m[0] = f / aspect;
+	m[5] = f;
+	m[10] = (zfar + znear) / (znear - zfar);
+	m[11] = -1;
+	m[14] = 2 * zfar * znear / (znear - zfar);
+}
+
+/* Like gluLookAt */
+void
+mat_lookat(double m[16], double eye[3], double center[3], double up[3]){
+	double f[3], s[3], u[3];
+	vec_diff(f, center, eye);
+	normalize(f);
+	crossproduct(s, f, up);
+	normalize(s);
+	crossproduct(u, s, f);
+
+	for(int i = 0; i < 3; i++){
+		m[4 * i] = s[i];
+		m[4 * i + 1] = u[i];
+		m[4 * i + 2] = -f[i];
+		m[4 * i + 3] = 0;
+	}
+	m[12] = -dotproduct(s, eye);
+	m[13] = -dotproduct(u, eye);
+	m[14] = dotproduct(f, eye);
+	m[15] = 1;
+}
+
+void
+mat_mult(double res[16], double a[16], double b[16]){
+	double tmp[16];
+	for(int col = 0; col < 4; col++)
+		for(int row = 0; row < 4; row++){
+			tmp[4 * col + row] = 0;
+			for(int k = 0; k < 4; k++)
+				tmp[4 * col + row] += a[4 * k + row] * b[4 * col + k];
+		}
+	memcpy(res, tmp, sizeof(tmp));
+}
+
+/* Each plane is the sum or difference of the last row of the matrix and 
+ * one of the others, where that clip coordinate reaches w */
+void
+mat_frustum_planes(double planes[6][4], double m[16]){
+	for(int i = 0; i < 6; i++){
+		int row = i / 2;
+		double sign = i % 2 == 0 ? 1 : -1;
+		for(int j = 0; j < 4; j++)
+			planes[i][j] = m[4 * j + 3] + sign * m[4 * j + row];
+		double len = length(planes[i]);
+		for(int j = 0; j < 4; j++)
+			planes[i][j] /= len;
+	}
+}
+
 /* Java's method of calculating String hashes */
 static unsigned int
 hashfunction(char *key, int key_len){
@@ -678,6 +739,118 @@ util_hashtable_remove(hashtable_t *ht, char *key, int key_len){
 	return util_list_remove(bucket, match);
 }
 
+/* Priority queue */
+
+pqueue_t*
+util_pqueue_create(void){
+	pqueue_t *q = malloc(sizeof(pqueue_t));
+	q->size = 0;
+	q->capacity = 16;
+	q->heap = malloc(q->capacity * sizeof(pqueue_elm_t));
+	return q;
+}
+
+void
+util_pqueue_free(pqueue_t *q){
+	free(q->heap);
+	free(q);
+}
+
+static void
+pqueue_swap(pqueue_t *q, int a, int b){
+	pqueue_elm_t tmp = q->heap[a];
+	q->heap[a] = q->heap[b];
+	q->heap[b] = tmp;
+}
+
+/* Move element i up until its parent has a lower priority */
+static void
+pqueue_sift_up(pqueue_t *q, int i){
+	while(i > 0){
+		int parent = (i - 1) / 2;
+		if(q->heap[parent].priority <= q->heap[i].priority)
+			break;
+		pqueue_swap(q, i, parent);
+		i = parent;
+	}
+}
+
+/* Move element i down until both children have higher priorities */
+static void
+pqueue_sift_down(pqueue_t *q, int i){
+	for(;;){
+		int smallest = i;
+		int l = 2 * i + 1;
+		int r = 2 * i + 2;
+		if(l < q->size && q->heap[l].priority < q->heap[smallest].priority)
+			smallest = l;
+		if(r < q->size && q->heap[r].priority < q->heap[smallest].priority)
+			smallest = r;
+		if(smallest == i)
+			break;
+		pqueue_swap(q, i, smallest);
+		i = smallest;
+	}
+}
+
+void
+util_pqueue_push(pqueue_t *q, void *data, double priority){
+	if(q->size == q->capacity){
+		q->capacity *= 2;
+		q->heap = realloc(q->heap, q->capacity * sizeof(pqueue_elm_t));
+		if(q->heap == NULL)
+			FATAL_ERROR("Out of memory");
+	}
+
+	int i = q->size++;
+	q->heap[i].data = data;
+	q->heap[i].priority = priority;
+	pqueue_sift_up(q, i);
+}
+
+void*
+util_pqueue_pop(pqueue_t *q){
+	if(q->size == 0)
+		return NULL;
+
+	void *data = q->heap[0].data;
+	q->heap[0] = q->heap[--q->size];
+	pqueue_sift_down(q, 0);
+	return data;
+}
+
+int
+util_pqueue_remove(pqueue_t *q, void *data){
+	for(int i = 0; i < q->size; i++){
+		if(q->heap[i].data != data)
+			continue;
+
+		/* Fill the hole with the last element and restore the heap */
+		q->heap[i] = q->heap[--q->size];
+		if(i < q->size){
+			pqueue_sift_up(q, i);
+			pqueue_sift_down(q, i);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void*
+util_pqueue_peek(pqueue_t *q){
+	return q->size > 0 ? q->heap[0].data : NULL;
+}
+
+double
+util_pqueue_peek_priority(pqueue_t *q){
+	return q->size > 0 ? q->heap[0].priority : 0;
+}
+
+int
+util_pqueue_size(pqueue_t *q){
+	return q->size;
+}
+
 
 int
 util_settings_remove(char *prop){
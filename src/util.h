@@ -76,6 +76,14 @@ void vec_diff(double res[3], double a[3], double b[3]);
 void vec_cpy(double d[3], double s[3]);
 void vec_add(double u[3], double v[3]);
 double deg2radians(double deg);
+/* 4x4 matrices, column major like OpenGL wants them */
+void mat_perspective(double m[16], double fovy, double aspect, double znear, double zfar);
+void mat_lookat(double m[16], double eye[3], double center[3], double up[3]);
+void mat_mult(double res[16], double a[16], double b[16]);
+/* The planes of the view frustum of the projection m as (a, b, c, d), 
+ * a x + b y + c z + d >= 0 inside, with (a, b, c) of unit length. Left, 
+ * right, bottom, top, near and far */
+void mat_frustum_planes(double planes[6][4], double m[16]);
 
 typedef struct quaternion_s {
 	double x, y, z, w;
@@ -119,6 +127,28 @@ int util_hashtable_get(hashtable_t* ht, char *key, int key_len, void **out_data)
 void util_hashtable_insert(hashtable_t* ht, char *key, int key_len, void *data);
 int util_hashtable_remove(hashtable_t *ht, char *key, int key_len);
 
+/* Priority queue. A binary heap where the element with the lowest priority is popped first */
+
+typedef struct pqueue_elm_s {
+	void *data;
+	double priority;
+} pqueue_elm_t;
+
+typedef struct pqueue_s {
+	int size;
+	int capacity;
+	pqueue_elm_t *heap;
+} pqueue_t;
+
+pqueue_t* util_pqueue_create(void);
+void util_pqueue_free(pqueue_t *q);
+void util_pqueue_push(pqueue_t *q, void *data, double priority);
+void* util_pqueue_pop(pqueue_t *q); /* NULL if the queue is empty */
+int util_pqueue_remove(pqueue_t *q, void *data); /* Linear search. Returns 0 if data isn't queued */
+void* util_pqueue_peek(pqueue_t *q);
+double util_pqueue_peek_priority(pqueue_t *q); /* Of the element util_pqueue_peek returns */
+int util_pqueue_size(pqueue_t *q);
+
 /* Settings manager */
 
 void util_settings_load_default_files(void);
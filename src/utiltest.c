@@ -102,5 +102,28 @@ main(int argc, char *argv[]){
 			printf("i = %d not found", i);
 	} 
 
+	pqueue_t *pq = util_pqueue_create();
+
+	for(int i = 0; i < 100; i++)
+		util_pqueue_push(pq, &buf[i], buf[i]);
+
+	for(int i = 0; i < 100; i += 10)
+		if(!util_pqueue_remove(pq, &buf[i]))
+			printf("pqueue lost %d\n", buf[i]);
+	if(util_pqueue_size(pq) != 90)
+		puts("pqueue has wrong size after remove");
+
+	int prev = -1;
+	while(util_pqueue_size(pq) > 0){
+		int *d = util_pqueue_pop(pq);
+		if(*d < prev)
+			printf("pqueue popped %d after %d\n", *d, prev);
+		prev = *d;
+	}
+	if(util_pqueue_pop(pq) != NULL)
+		puts("pqueue not empty");
+
+	util_pqueue_free(pq);
+
 	return 0;
 }
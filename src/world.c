@@ -14,6 +14,7 @@
  */
 
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <SDL/SDL.h>
 #include <GLee.h>
@@ -21,25 +22,72 @@
 #include "util.h"
 #include "world.h"
 #include "camera.h"
+#include "cull.h"
+#include "occlusion.h"
+#include "console.h"
 #include "startup.h"
 
 #define BLOCK_LENGTH 500.0f
 #define BLOCK_HEIGHT 500.0f
 #define BLOCK_WIDTH 500.0f
 
+/* Loaded chunks hashed on (ix, iy, iz). Open addressing with linear probing */
+typedef struct chunk_grid_s {
+	/* Power of two */
+	int capacity;
+	int size;
+	chunk_t **slots;
+} chunk_grid_t;
+
 typedef struct chunkmanager_s {
-	linked_list_t *visible_chunks;
-	linked_list_t *render_chunks;
+	chunk_grid_t grid;
+	/* Chunks queued on the I/O thread, not in grid until they are loaded */
+	chunk_grid_t loading;
+	/* Bounds and counts of the loaded chunks for culling, chunk c at 
+	 * c->cull_index */
+	cull_table_t cull;
+	/* The chunks to draw are cull.handles[cull.visible[i]] for i below 
+	 * n_render, nearest first. Made by chunkmanager_update */
+	int n_render;
 	linked_list_t *loaded_chunks;
+	/* Edited chunks waiting to be rebuilt, each chunk at most once */
+	linked_list_t *dirty_chunks;
+	/* Edited chunks waiting to be written back, each chunk at most once */
+	linked_list_t *modified_chunks;
+	/* Blocks waiting to be written back and when the oldest edit was made */
+	int n_modified;
+	Uint32 modified_since;
+	/* Set by edits made since the last save started */
+	int unsaved;
+	/* A version 3 world, without edges and saved as it is edited. Kept 
+	 * here since a save can change the version of the world file */
+	int regions;
 
 	int active_blocks;
 	int n_trigs;
+	int n_dirty;
+	/* Chunks rebuilt by the last chunkmanager_update */
+	int frame_rebuilds;
+	/* Chunks left out of the last render list by frustum culling */
+	int frustum_culled;
+	/* And by cave culling */
+	int cave_culled;
+	/* And by occlusion culling */
+	int occlusion_culled;
 
 	world_file_t *world;
 } chunkmanager_t;
 
 static chunkmanager_t *chunkmanager = NULL;
 
+static console_command_t *meshstats_cmd;
+static console_command_t *editbench_cmd;
+static console_command_t *memstats_cmd;
+static console_command_t *iobench_cmd;
+static console_command_t *occlusionbench_cmd;
+static console_command_t *save_cmd;
+static console_command_t *saveas_cmd;
+
 static skybox_t *world_skybox;
 
 /* NB: Overwritten by values from settings system */
@@ -59,7 +107,12 @@ typedef struct textureset_s {
 	int atlas_h;
 	int n_subtextures;
 	int n_w, n_h;
+	/* One repeating texture per sub texture */
+	GLuint *tile_textureIds;
 	linked_list_t *block_type_mappings;
+	/* Baked by textureset_init, indexed by block type index */
+	int texture_index[BLOCK_TYPES][6];
+	GLshort uvs[BLOCK_TYPES][6][4][2];
 } textureset_t;
 
 static textureset_t textureset_current;
@@ -101,6 +154,8 @@ load_block_type_mappings(char *path){
 								(int*)&top, (int*)&bottom, (int*)&left, (int*)&right);
 		if(items =! 7)
 			FATAL_ERROR("Error parsing block type mapping file %s. Error at line %d", path, line);
+		if(block_type >= BLOCK_TYPES)
+			FATAL_ERROR("Error parsing block type mapping file %s. Block type %d at line %d is too large", path, block_type, line);
 		
 		/* Add to list */
 		block_type_textures_t *block_tex = malloc(sizeof(block_type_textures_t));
@@ -118,6 +173,46 @@ load_block_type_mappings(char *path){
 	}
 }
 
+/* Split the atlas into one texture per sub texture. These can use GL_REPEAT 
+ * without bleeding into the neighbouring sub textures */
+static void
+textureset_load_tile_textures(SDL_Surface *atlas, int size){
+	int n = textureset_current.n_subtextures;
+	textureset_current.tile_textureIds = malloc(n * sizeof(GLuint));
+	glGenTextures(n, textureset_current.tile_textureIds);
+
+	SDL_Surface *tile = SDL_CreateRGBSurface(SDL_SWSURFACE, size, size, 32, 
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+					    0x000000FF, 
+					    0x0000FF00, 
+					    0x00FF0000, 
+					    0xFF000000
+#else
+					    0xFF000000,
+					    0x00FF0000, 
+					    0x0000FF00, 
+					    0x000000FF
+#endif
+					);				    
+	for(int i = 0; i < n; i++){
+		SDL_Rect src;
+		src.x = (i % textureset_current.n_w) * size;
+		src.y = (i / textureset_current.n_w) * size;
+		src.w = size;
+		src.h = size;
+		SDL_BlitSurface(atlas, &src, tile, NULL);
+
+		glBindTexture(GL_TEXTURE_2D, textureset_current.tile_textureIds[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, tile->pixels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	}
+
+	SDL_FreeSurface(tile);
+}
+
 static void
 textureset_load_texture_atlas(char *path, int size){
 	GLuint textureId;
@@ -159,6 +254,8 @@ textureset_load_texture_atlas(char *path, int size){
 					);				    
 	SDL_BlitSurface(image, NULL, tmp, NULL);
 
+	textureset_load_tile_textures(tmp, size);
+
 	glGenTextures(1, &textureId);
 	glBindTexture(GL_TEXTURE_2D, textureId);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tmp->w, tmp->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, tmp->pixels);
@@ -179,12 +276,29 @@ textureset_current_atlas(void){
 	return textureset_current.textureId;
 }
 
-GLfloat*
+int
+textureset_texture_index(Uint32 block_type, int face){
+	return textureset_current.texture_index[block_type_index(block_type)][face];
+}
+
+int
+textureset_ntextures(void){
+	return textureset_current.n_subtextures;
+}
+
+GLuint
+textureset_tile_texture(int tex_ind){
+	return textureset_current.tile_textureIds[tex_ind];
+}
+
+GLshort*
 textureset_texcoords(Uint32 block_type, int face, int vert){
-	block_type_textures_t *btt = get_block_type_textures(block_type);
-	if(btt == NULL)
-		FATAL_ERROR("Could not find block type texture mappings for block type = %d. Aborting", block_type);
-	int tex_ind = btt->texture_indicies[face];
+	return textureset_current.uvs[block_type_index(block_type)][face][vert];
+}
+
+/* Atlas texel coordinates of corner vert of a face showing sub texture tex_ind */
+static void
+compute_texcoords(GLshort uv[2], int tex_ind, int face, int vert){
 	/* Convert linear index to (x, y) sub texture index */
 	int n_y = tex_ind / textureset_current.n_w;
 	int n_x = tex_ind % textureset_current.n_w;
@@ -192,63 +306,75 @@ textureset_texcoords(Uint32 block_type, int face, int vert){
 	int y = n_y * textureset_size;
 	int x = n_x * textureset_size;
 
-	//printf("%d\n", textureset_current.atlas_w);
-
-	GLfloat *uv = malloc(sizeof(GLfloat) * 2);
-
 	if(face == 0 || face == 1){
 		if(vert == 0){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 (y + textureset_size); 
 		}else if(vert == 1){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 (y + textureset_size); 
 		}else if(vert == 2){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 y; 
 		}else if(vert == 3){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 y; 
 		}else{
 			FATAL_ERROR("Invalid input to function. Should not happend.");
 		}
 	}else if(face == 5 || face == 4){
 		if(vert == 0){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 (y + textureset_size); 
 		}else if(vert == 1){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 y; 
 		}else if(vert == 2){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 (y + textureset_size); 
 		}else if(vert == 3){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 y; 
 		}else{
 			FATAL_ERROR("Invalid input to function. Should not happend.");
 		}
 	}else{
 		if(vert == 0){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 y; 
 		}else if(vert == 1){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 y / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 y; 
 		}else if(vert == 2){
-			uv[0] =  (x + textureset_size) / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  (x + textureset_size);
+			uv[1] =	 (y + textureset_size); 
 		}else if(vert == 3){
-			uv[0] =  x / (float)textureset_current.atlas_w;
-			uv[1] =	 (y + textureset_size) / (float)textureset_current.atlas_h; 
+			uv[0] =  x;
+			uv[1] =	 (y + textureset_size); 
 		}else{
 			FATAL_ERROR("Invalid input to function. Should not happend.");
 		}
 	}
-	
-	//printf("u=%f,v=%f\n", uv[0],uv[1]);
+}
 
-	return uv;
+/* Fill the texture index and texture coordinate tables for every block type */
+static void
+textureset_bake_uvs(void){
+	for(int type = 0; type < BLOCK_TYPES; type++){
+		block_type_textures_t *btt = get_block_type_textures(type);
+		if(btt == NULL)
+			LOG_DEBUG("No texture mappings for block type %d. Using sub texture 0", type);
+
+		for(int face = 0; face < 6; face++){
+			int tex_ind = btt != NULL ? (int)btt->texture_indicies[face] : 0;
+			if(tex_ind >= textureset_current.n_subtextures)
+				FATAL_ERROR("Block type %d uses sub texture %d but the texture set only has %d", type, tex_ind, textureset_current.n_subtextures);
+
+			textureset_current.texture_index[type][face] = tex_ind;
+			for(int vert = 0; vert < 4; vert++)
+				compute_texcoords(textureset_current.uvs[type][face][vert], tex_ind, face, vert);
+		}
+	}
 }
 
 void
@@ -261,6 +387,7 @@ textureset_init(void){
 	textureset_current.block_type_mappings = util_list_create();
 	load_block_type_mappings(textureset_mapping_path);
 	textureset_load_texture_atlas(textureset_atlas_path, textureset_size); 
+	textureset_bake_uvs();
 }
 STARTUP_PROC(textureset, 4, textureset_init)
 
@@ -268,18 +395,40 @@ void
 textureset_free(void){
 	util_list_free_data(textureset_current.block_type_mappings);
 	glDeleteTextures(1, &textureset_current.textureId);
+	glDeleteTextures(textureset_current.n_subtextures, textureset_current.tile_textureIds);
+	free(textureset_current.tile_textureIds);
 	textureset_current.textureId = 0;
 	textureset_current.n_subtextures = 0;
 }
 
+/* Texture coordinates are given in texels. Scale them to [0, 1] with the texture matrix */
+static void
+textureset_load_texel_scale(int w, int h){
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	glScalef(1.0f / w, 1.0f / h, 1.0f);
+	glMatrixMode(GL_MODELVIEW);
+}
+
 void
 textureset_bind(void){
 	glEnable(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, textureset_current.textureId);
+	textureset_load_texel_scale(textureset_current.atlas_w, textureset_current.atlas_h);
+}
+
+void
+textureset_bind_tile(int tex_ind){
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, textureset_current.tile_textureIds[tex_ind]);
+	textureset_load_texel_scale(textureset_size, textureset_size);
 }
 
 void
 textureset_unbind(void){
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
 	glDisable(GL_TEXTURE_2D);	
 }
 
@@ -445,703 +594,3085 @@ renderblock_with_textures(int x, int y, int z, GLuint texture){
 	glPopMatrix();
 }	
 
-void
-add_block_to_mesh(int i, int j, int k, chunk_t *chunk){
-	mesh_t *mesh = chunk->mesh;
-	int x = 2 * i; int y = 2 * j; int z = 2 * k;
-	
-	float p1[3] = { x - 1.0, y - 1.0, z + 1.0 };		
-	float p2[3] = { x + 1.0, y - 1.0, z + 1.0};
-	float p3[3] = { x + 1.0, y + 1.0, z + 1.0};
-	float p4[3] = { x - 1.0, y + 1.0, z + 1.0};
-
-	float p5[3] = { x + 1.0, y - 1.0, z - 1.0 };
-	float p6[3] = { x - 1.0, y - 1.0, z - 1.0 };
-	float p7[3] = { x - 1.0, y + 1.0, z - 1.0 };
-	float p8[3] = { x + 1.0, y + 1.0, z - 1.0 };
-
-	/* Color. To be used to control lightning */
-	float c[3] = { 1.0f, 1.0f, 1.0f };
-
-	/* Normals */
-	float n1[3] = { 0.0f, 0.0f, 1.0f };
-	float n2[3] = { 0.0f, 0.0f, -1.0f };
-	float n3[3] = { 0.0f, 1.0f, 0.0f };
-	float n4[3] = { 0.0f, -1.0f, 0.0f };
-	float n5[3] = { -1.0f, 0.0f, 0.0f };
-	float n6[3] = { 1.0f, 0.0f, 0.0f };
-
-	int i1, i2, i3, i4, i5, i6, i7, i8;
-	GLfloat* uv;
-	
-	/* Front */
-	int is_front_obscured = k + 1 < CHUNK_SIZE && block_isactive(chunk->blocks[i][j][k+1]);
-	if(!is_front_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 0, 0);
-		i1 = mesh_add_vertex(mesh, p1, c, n1, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 0, 1);
-		i2 = mesh_add_vertex(mesh, p2, c, n1, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 0, 2);
-		i3 = mesh_add_vertex(mesh, p3, c, n1, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 0, 3);
-		i4 = mesh_add_vertex(mesh, p4, c, n1, uv);
-		free(uv);
-		mesh_add_trig(mesh, i1, i2, i3);
-		mesh_add_trig(mesh, i1, i3, i4);
-	}
-
-	/* Back */
-	int is_back_obscured = k - 1 >= 0 && block_isactive(chunk->blocks[i][j][k-1]);
-	if(!is_back_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 1, 0);
-		i5 = mesh_add_vertex(mesh, p5, c, n2, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 1, 1);
-		i6 = mesh_add_vertex(mesh, p6, c, n2, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 1, 2);
-		i7 = mesh_add_vertex(mesh, p7, c, n2, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 1, 3);
-		i8 = mesh_add_vertex(mesh, p8, c, n2, uv);
-		free(uv);
-		mesh_add_trig(mesh, i5, i6, i7);
-		mesh_add_trig(mesh, i5, i7, i8);
-	}
-
-	/* Top */
-	int is_top_obscured = j + 1 < CHUNK_SIZE && block_isactive(chunk->blocks[i][j+1][k]);
-	if(!is_top_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 2, 0);
-		i3 = mesh_add_vertex(mesh, p3, c, n3, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 2, 1);
-		i4 = mesh_add_vertex(mesh, p4, c, n3, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 2, 2);
-		i7 = mesh_add_vertex(mesh, p7, c, n3, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 2, 3);
-		i8 = mesh_add_vertex(mesh, p8, c, n3, uv);
-		free(uv);
-		mesh_add_trig(mesh, i4, i3, i8);
-		mesh_add_trig(mesh, i4, i8, i7);
-	}
-
-	/* Bottom */
-	int is_bottom_obscured = j - 1 >= 0 && block_isactive(chunk->blocks[i][j-1][k]);
-	if(!is_bottom_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 3, 0);
-		i1 = mesh_add_vertex(mesh, p1, c, n4, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 3, 1);
-		i2 = mesh_add_vertex(mesh, p2, c, n4, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 3, 2);
-		i5 = mesh_add_vertex(mesh, p5, c, n4, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 3, 3);
-		i6 = mesh_add_vertex(mesh, p6, c, n4, uv);
-		free(uv);
-		mesh_add_trig(mesh, i6, i5, i2);
-		mesh_add_trig(mesh, i6, i2, i1);
-	}
-
-	/* Left */
-	int is_left_obscured = i - 1 >= 0 && block_isactive(chunk->blocks[i-1][j][k]);
-	if(!is_left_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 4, 0);
-		i1 = mesh_add_vertex(mesh, p1, c, n5, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 4, 1);
-		i4 = mesh_add_vertex(mesh, p4, c, n5, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 4, 2);
-		i6 = mesh_add_vertex(mesh, p6, c, n5, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 4, 3);
-		i7 = mesh_add_vertex(mesh, p7, c, n5, uv);
-		free(uv);
-		mesh_add_trig(mesh, i6, i1, i4);
-		mesh_add_trig(mesh, i6, i4, i7);
-	}
-
-	/* Right */
-	int is_right_obscured = i + 1 < CHUNK_SIZE && block_isactive(chunk->blocks[i+1][j][k]);
-	if(!is_right_obscured){
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 5, 0);
-		i2 = mesh_add_vertex(mesh, p2, c, n6, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 5, 1);
-		i3 = mesh_add_vertex(mesh, p3, c, n6, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 5, 2);
-		i5 = mesh_add_vertex(mesh, p5, c, n6, uv);
-		free(uv);
-		uv = textureset_texcoords(block_type(chunk->blocks[i][j][k]), 5, 3);
-		i8 = mesh_add_vertex(mesh, p8, c, n6, uv);
-		free(uv);
-		mesh_add_trig(mesh, i2, i5, i8);
-		mesh_add_trig(mesh, i2, i8, i3);
+/* Faces are numbered front, back, top, bottom, left, right. The same order is used by the textureset */
+enum {
+	FACE_FRONT,
+	FACE_BACK,
+	FACE_TOP,
+	FACE_BOTTOM,
+	FACE_LEFT,
+	FACE_RIGHT
+};
+
+/* Normal of each face, scaled to fit a signed byte */
+static GLbyte face_normals[6][3] = { 
+	{ 0, 0, 127 },
+	{ 0, 0, -127 },
+	{ 0, 127, 0 },
+	{ 0, -127, 0 },
+	{ -127, 0, 0 },
+	{ 127, 0, 0 }
+};
+
+/* The axis a face is perpendicular to and the direction it is facing */
+static int face_axis[6] = { 2, 2, 1, 1, 0, 0 };
+static int face_dir[6] = { 1, -1, 1, -1, -1, 1 };
+/* Every face, as a face_links mask */
+#define FACE_LINKS_ALL 0x3f
+
+/* Corners of each face in the order they are added to the mesh. 
+ * Indexes into the box corners p1..p8, see box_corners */
+static int face_corners[6][4] = {
+	{ 0, 1, 2, 3 },
+	{ 4, 5, 6, 7 },
+	{ 2, 3, 6, 7 },
+	{ 0, 1, 4, 5 },
+	{ 0, 3, 5, 6 },
+	{ 1, 2, 4, 7 }
+};
+
+/* Order in which the face corners are stored in a quad. Indexes into 
+ * face_corners. Quads are drawn as the triangles (0, 1, 2) and (0, 2, 3) */
+static int face_quad_order[6][4] = {
+	{ 0, 1, 2, 3 },
+	{ 0, 1, 2, 3 },
+	{ 1, 0, 3, 2 },
+	{ 3, 2, 1, 0 },
+	{ 2, 0, 1, 3 },
+	{ 0, 2, 3, 1 }
+};
+
+/* Computes the corners of the box covering the blocks lo to hi (inclusive) */
+static void
+box_corners(int p[8][3], int lo[3], int hi[3]){
+	int x0 = 2 * lo[0] - 1; int x1 = 2 * hi[0] + 1;
+	int y0 = 2 * lo[1] - 1; int y1 = 2 * hi[1] + 1;
+	int z0 = 2 * lo[2] - 1; int z1 = 2 * hi[2] + 1;
+
+	p[0][0] = x0; p[0][1] = y0; p[0][2] = z1;
+	p[1][0] = x1; p[1][1] = y0; p[1][2] = z1;
+	p[2][0] = x1; p[2][1] = y1; p[2][2] = z1;
+	p[3][0] = x0; p[3][1] = y1; p[3][2] = z1;
+
+	p[4][0] = x1; p[4][1] = y0; p[4][2] = z0;
+	p[5][0] = x0; p[5][1] = y0; p[5][2] = z0;
+	p[6][0] = x0; p[6][1] = y1; p[6][2] = z0;
+	p[7][0] = x1; p[7][1] = y1; p[7][2] = z0;
+}
+
+/* Texture coordinates of a face corner in whole texture repeats. A box 
+ * spanning several blocks repeats the texture once per block, oriented
+ * the same way as a single block face. */
+static void
+face_tile_texcoords(int uv[2], int face, int p[3], int p_min[3], int p_max[3]){
+	switch(face){
+	case FACE_FRONT:
+		uv[0] = (p_max[0] - p[0]) / 2; uv[1] = (p_max[1] - p[1]) / 2; break;
+	case FACE_BACK:
+		uv[0] = (p[0] - p_min[0]) / 2; uv[1] = (p_max[1] - p[1]) / 2; break;
+	case FACE_TOP:
+		uv[0] = (p_max[0] - p[0]) / 2; uv[1] = (p_max[2] - p[2]) / 2; break;
+	case FACE_BOTTOM:
+		uv[0] = (p[0] - p_min[0]) / 2; uv[1] = (p_max[2] - p[2]) / 2; break;
+	default:
+		uv[0] = (p_max[2] - p[2]) / 2; uv[1] = (p_max[1] - p[1]) / 2; break;
 	}
 }
 
+/* Grow the box lo to hi to cover block (i, j, k) */
+static void
+box_include(int lo[3], int hi[3], int i, int j, int k){
+	int ind[3] = { i, j, k };
+	for(int a = 0; a < 3; a++){
+		if(ind[a] < lo[a])
+			lo[a] = ind[a];
+		if(ind[a] > hi[a])
+			hi[a] = ind[a];
+	}
+}
 
-void
-chunk_build_mesh(chunk_t *chunk){
+/* What meshing finds out about the blocks of a chunk besides the mesh, 
+ * handed to the chunk with it. The fields are as in chunk_t */
+typedef struct mesh_summary_s {
+	int active_blocks;
+	int box_lo[3];
+	int box_hi[3];
+	Uint8 face_links[6];
+	int occluder_lo[3][3];
+	int occluder_hi[3][3];
+} mesh_summary_t;
+
+/* What the mesher reads: a copy of the chunk's blocks and which blocks 
+ * around it are solid. solid is indexed with an offset of one so it covers 
+ * the border slabs of the six neighbouring chunks. Being a snapshot it can 
+ * be meshed on another thread while the chunk keeps changing */
+typedef struct mesh_source_s {
+	block_t blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	Uint8 solid[CHUNK_SIZE + 2][CHUNK_SIZE + 2][CHUNK_SIZE + 2];
+	mesh_summary_t summary;
+} mesh_source_t;
+
+/* Flood fill each pocket of air in the snapshot and join the faces of 
+ * the chunk it touches */
+static void
+mesh_source_link_faces(mesh_source_t *src){
+	mesh_summary_t *s = &src->summary;
+	for(int face = 0; face < 6; face++)
+		s->face_links[face] = s->active_blocks == 0 ? FACE_LINKS_ALL : 0;
+	if(s->active_blocks == 0)
+		return;
+
+	/* Blocks are numbered (i * CHUNK_SIZE + j) * CHUNK_SIZE + k. Solid 
+	 * blocks start out as seen */
+	static const int step[6] = { 1, -1, CHUNK_SIZE, -CHUNK_SIZE, -CHUNK_SIZE * CHUNK_SIZE, CHUNK_SIZE * CHUNK_SIZE };
+	Uint8 seen[MAX_ACTIVE_BLOCKS];
+	Uint16 stack[MAX_ACTIVE_BLOCKS];
 	for(int i = 0; i < CHUNK_SIZE; i++)
 		for(int j = 0; j < CHUNK_SIZE; j++)
 			for(int k = 0; k < CHUNK_SIZE; k++)
-				if(block_isactive(chunk->blocks[i][j][k])){
-					chunk->active_blocks++;
-					add_block_to_mesh(i, j, k, chunk);
+				seen[(i * CHUNK_SIZE + j) * CHUNK_SIZE + k] = src->solid[i + 1][j + 1][k + 1];
+
+	for(int start = 0; start < MAX_ACTIVE_BLOCKS; start++){
+		if(seen[start])
+			continue;
+
+		int faces = 0, n = 0;
+		seen[start] = 1;
+		stack[n++] = start;
+		while(n > 0){
+			int ind = stack[--n];
+			int p[3] = { ind / (CHUNK_SIZE * CHUNK_SIZE), ind / CHUNK_SIZE % CHUNK_SIZE, ind % CHUNK_SIZE };
+			for(int face = 0; face < 6; face++){
+				if(p[face_axis[face]] == (face_dir[face] > 0 ? CHUNK_SIZE - 1 : 0)){
+					faces |= 1 << face;
+					continue;
 				}
-			
-}
+				int q = ind + step[face];
+				if(!seen[q]){
+					seen[q] = 1;
+					stack[n++] = q;
+				}
+			}
+		}
 
-void
-chunk_rebuild(chunk_t *chunk){
-	if(chunk->mesh->n_trigs != 0){
-		mesh_free(chunk->mesh);
-		chunk->mesh = mesh_create();
+		for(int face = 0; face < 6; face++)
+			if(faces & (1 << face))
+				s->face_links[face] |= faces;
 	}
-	chunk->active_blocks = 0;
-	chunk_build_mesh(chunk);
-	mesh_rebuild(chunk->mesh);
 }
 
-mesh_t*
-mesh_create(void){
-	mesh_t *tmp = malloc(sizeof(mesh_t));
-	tmp->vertex_list = util_list_create();
-	tmp->n_verticies = 0;
-	tmp->trig_list = util_list_create();
-	tmp->n_trigs = 0;
-	tmp->elementId = 0;
-	tmp->vertexId = 0;
-	return tmp;
+/* Largest rectangle of set bits in rows, bit v of rows[u] for row u and 
+ * column v. For each first row the rows below are and-ed in one by one, 
+ * the longest run of bits left is the widest rectangle down to there. 
+ * Returns its area with the rows and columns in lo and hi */
+static int
+largest_rectangle(Uint16 rows[CHUNK_SIZE], int lo[2], int hi[2]){
+	int best = 0;
+	for(int first = 0; first < CHUNK_SIZE && (CHUNK_SIZE - first) * CHUNK_SIZE > best; first++){
+		unsigned int bits = 0xffff;
+		for(int u = first; u < CHUNK_SIZE; u++){
+			bits &= rows[u];
+			if(bits == 0)
+				break;
+			/* Each step clears the last bit of every run */
+			int run = 0;
+			unsigned int end = bits;
+			for(unsigned int b = bits; b != 0; b &= b >> 1){
+				end = b;
+				run++;
+			}
+			int area = run * (u - first + 1);
+			if(area <= best)
+				continue;
+			best = area;
+			/* The lowest bit of end is the start of a longest run */
+			int start = 0;
+			while(!(end & (1 << start)))
+				start++;
+			lo[0] = first;
+			hi[0] = u;
+			lo[1] = start;
+			hi[1] = start + run - 1;
+		}
+	}
+	return best;
 }
 
-void
-mesh_free(void *p){
-	mesh_t *m = p;
-	if(m->elementId != 0)
-		glDeleteBuffers(1, &m->elementId);
-	if(m->vertexId != 0)
-		glDeleteBuffers(1, &m->vertexId);
-	util_list_free_data(m->vertex_list);
-	util_list_free_data(m->trig_list);
-	free(m);
-}
+/* For each axis the largest rectangle of solid blocks in a layer across 
+ * it, a slab a block thick. Occlusion culling draws them to stand in for 
+ * the chunk, whichever way it is seen one of them faces the camera */
+static void
+mesh_source_find_occluders(mesh_source_t *src){
+	mesh_summary_t *s = &src->summary;
+	for(int a = 0; a < 3; a++)
+		for(int b = 0; b < 3; b++){
+			s->occluder_lo[a][b] = CHUNK_SIZE;
+			s->occluder_hi[a][b] = -1;
+		}
+	if(s->active_blocks == 0)
+		return;
+
+	/* The layers across axis a as bits, rows on axis a + 1 and columns 
+	 * on axis a + 2, and the solid blocks in each */
+	Uint16 layers[3][CHUNK_SIZE][CHUNK_SIZE];
+	int counts[3][CHUNK_SIZE];
+	memset(layers, 0, sizeof(layers));
+	memset(counts, 0, sizeof(counts));
+	for(int i = 0; i < CHUNK_SIZE; i++)
+		for(int j = 0; j < CHUNK_SIZE; j++)
+			for(int k = 0; k < CHUNK_SIZE; k++){
+				int solid = src->solid[i + 1][j + 1][k + 1];
+				layers[0][i][j] |= solid << k;
+				layers[1][j][k] |= solid << i;
+				layers[2][k][i] |= solid << j;
+				counts[0][i] += solid;
+				counts[1][j] += solid;
+				counts[2][k] += solid;
+			}
 
-int
-mesh_add_vertex(mesh_t *m, float p[3], float c[3], float n[3], float t[2]){
-	float *vert = malloc(sizeof(float) * 11);
-	memcpy(vert, p, 3 * sizeof(float));
-	memcpy(vert + 3, c, 3 * sizeof(float));
-	memcpy(vert + 6, n, 3 * sizeof(float));
-	memcpy(vert + 9, t, 2 * sizeof(float));
-	util_list_add(m->vertex_list, vert);
-	return m->n_verticies++;
+	for(int a = 0; a < 3; a++){
+		int u = (a + 1) % 3, v = (a + 2) % 3;
+		int best = 0;
+		for(int l = 0; l < CHUNK_SIZE; l++){
+			/* Can't hold a larger one */
+			if(counts[a][l] <= best)
+				continue;
+			int lo[2], hi[2];
+			int area = largest_rectangle(layers[a][l], lo, hi);
+			if(area <= best)
+				continue;
+			best = area;
+			s->occluder_lo[a][a] = s->occluder_hi[a][a] = l;
+			s->occluder_lo[a][u] = lo[0];
+			s->occluder_hi[a][u] = hi[0];
+			s->occluder_lo[a][v] = lo[1];
+			s->occluder_hi[a][v] = hi[1];
+		}
+	}
 }
 
-void
-mesh_add_trig(mesh_t *m, GLuint ind1, GLuint ind2, GLuint ind3){
-	GLuint *trig = malloc(sizeof(GLuint) * 3);
-
-	/* Copy the indicies */
-	GLuint *p = trig;
-	*p++ = ind1;
-	*p++ = ind2;
-	*p++ = ind3;
-
-	util_list_add(m->trig_list, trig);
-	m->n_trigs++;
+/* Block (i, j, k) of the chunk next to c in direction face. i, j, k 
+ * may be one step outside the chunk on the axis of the face */
+static int
+is_neighbour_block_active(chunk_t *neighbour, int face, int i, int j, int k){
+	if(neighbour == NULL)
+		return 0;
+	int ind[3] = { i, j, k };
+	ind[face_axis[face]] -= face_dir[face] * CHUNK_SIZE;
+	return block_isactive(chunk_get_block(neighbour, ind[0], ind[1], ind[2]));
 }
 
 static void
-copy_vertex_data(float *data, mesh_t *m){
-	float *p = data;
+mesh_source_fill(mesh_source_t *src, chunk_t *chunk){
+	block_storage_unpack(&chunk->blocks, &src->blocks[0][0][0]);
+	memset(src->solid, 0, sizeof(src->solid));
+	mesh_summary_t *s = &src->summary;
+	s->active_blocks = 0;
+	for(int a = 0; a < 3; a++){
+		s->box_lo[a] = CHUNK_SIZE;
+		s->box_hi[a] = -1;
+	}
 
-	linked_list_elm_t *elm;
-	elm = m->vertex_list->head;
-	while(elm != NULL){
-		float *vert = elm->data;
-		/* Position */
-		*p++ = vert[0];
-		*p++ = vert[1];
-		*p++ = vert[2];
-
-		/* Color */
-		*p++ = vert[3];
-		*p++ = vert[4];
-		*p++ = vert[5];
-
-		/* Normal */
-		*p++ = vert[6];
-		*p++ = vert[7];
-		*p++ = vert[8];
-
-		/* Texure coords */
-		*p++ = vert[9];
-		*p++ = vert[10];
+	for(int i = 0; i < CHUNK_SIZE; i++)
+		for(int j = 0; j < CHUNK_SIZE; j++)
+			for(int k = 0; k < CHUNK_SIZE; k++){
+				int active = block_isactive(src->blocks[i][j][k]);
+				src->solid[i + 1][j + 1][k + 1] = active;
+				s->active_blocks += active;
+				if(active)
+					box_include(s->box_lo, s->box_hi, i, j, k);
+			}
+	mesh_source_link_faces(src);
+	mesh_source_find_occluders(src);
+
+	/* Nothing to mesh, the neighbours don't matter */
+	if(s->active_blocks == 0)
+		return;
+
+	/* Border slabs of the neighbours. Missing neighbours count as air */
+	for(int face = 0; face < 6; face++){
+		int n = face_axis[face];
+		int a = (n + 1) % 3;
+		int b = (n + 2) % 3;
+		int ind[3];
+		ind[n] = face_dir[face] > 0 ? CHUNK_SIZE : -1;
+
+		chunk_t *neighbour = chunk->neighbours[face];
+		if(neighbour == NULL)
+			continue;
 
-		elm = elm->next;
+		for(int u = 0; u < CHUNK_SIZE; u++)
+			for(int v = 0; v < CHUNK_SIZE; v++){
+				ind[a] = u; ind[b] = v;
+				src->solid[ind[0] + 1][ind[1] + 1][ind[2] + 1] = is_neighbour_block_active(neighbour, face, ind[0], ind[1], ind[2]);
+			}
 	}
 }
 
+static int
+is_face_obscured(mesh_source_t *src, int face, int i, int j, int k){
+	int ind[3] = { i + 1, j + 1, k + 1 };
+	ind[face_axis[face]] += face_dir[face];
+	return src->solid[ind[0]][ind[1]][ind[2]];
+}
+
+/* Add a face of the box lo to hi to the mesh. If tile_uv is set the
+ * texture coordinates are for a repeating sub texture, otherwise they 
+ * are texture atlas coordinates */
 static void
-copy_index_data(GLuint *data, mesh_t *m){
-	GLuint *p = data;
+add_face_to_mesh(mesh_t *mesh, int face, Uint32 block_type, int lo[3], int hi[3], int tile_uv){
+	int p[8][3];
+	box_corners(p, lo, hi);
+
+	mesh_vertex_t *quad = mesh_add_quad(mesh);
+	for(int q = 0; q < 4; q++){
+		int v = face_quad_order[face][q];
+		int *corner = p[face_corners[face][v]];
+		mesh_vertex_t *vert = &quad[q];
+
+		vert->pos[0] = corner[0];
+		vert->pos[1] = corner[1];
+		vert->pos[2] = corner[2];
+
+		if(tile_uv){
+			int uv[2];
+			face_tile_texcoords(uv, face, corner, p[5], p[2]);
+			vert->uv[0] = uv[0] * textureset_size;
+			vert->uv[1] = uv[1] * textureset_size;
+		}else{
+			GLshort *uv = textureset_texcoords(block_type, face, v);
+			vert->uv[0] = uv[0];
+			vert->uv[1] = uv[1];
+		}
 
-	linked_list_elm_t *elm;
-	elm = m->trig_list->head;
-	while(elm != NULL){
-		GLuint *trig = elm->data;
-		*p++ = trig[0];
-		*p++ = trig[1];
-		*p++ = trig[2];
-		elm = elm->next;
+		vert->normal[0] = face_normals[face][0];
+		vert->normal[1] = face_normals[face][1];
+		vert->normal[2] = face_normals[face][2];
+
+		/* Color. To be used to control lightning */
+		vert->color[0] = 255;
+		vert->color[1] = 255;
+		vert->color[2] = 255;
 	}
 }
 
-void
-mesh_rebuild(mesh_t *m){
-	/* Delete buffers if present */
-	if(m->elementId != 0)
-		glDeleteBuffers(1, &m->elementId);
-	if(m->vertexId != 0)
-		glDeleteBuffers(1, &m->vertexId);
+static void
+add_block_to_mesh(mesh_source_t *src, mesh_t *mesh, int i, int j, int k){
+	int ind[3] = { i, j, k };
+	Uint32 type = block_type(src->blocks[i][j][k]);
 
-	/* Fill vertex buffer */
-	int size = m->n_verticies * 11 * sizeof(float);
-	float *vertex_data = malloc(size);
-	if(vertex_data == NULL)
-		FATAL_ERROR("Out of memory");
-	copy_vertex_data(vertex_data, m);
-	glGenBuffers(1, &m->vertexId);
-	glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
-	glBufferData(GL_ARRAY_BUFFER, size, vertex_data, GL_STATIC_DRAW);
-	free(vertex_data);
+	for(int face = 0; face < 6; face++)
+		if(!is_face_obscured(src, face, i, j, k))
+			add_face_to_mesh(mesh, face, type, ind, ind, 0);
+}
 
-	/* Fill indicies buffer */
-	size = m->n_trigs * 3 * sizeof(GLuint);
-	GLuint *index_data = malloc(size);
-	if(index_data == NULL)
-		FATAL_ERROR("Out of memory");
-	copy_index_data(index_data, m);
-	glGenBuffers(1, &m->elementId);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->elementId);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, index_data, GL_STATIC_DRAW);
-	free(index_data);
+static void
+chunk_build_mesh_naive(mesh_source_t *src, mesh_t *mesh){
+	for(int i = 0; i < CHUNK_SIZE; i++)
+		for(int j = 0; j < CHUNK_SIZE; j++)
+			for(int k = 0; k < CHUNK_SIZE; k++)
+				if(block_isactive(src->blocks[i][j][k]))
+					add_block_to_mesh(src, mesh, i, j, k);
 }
 
-void 
-mesh_render(mesh_t *m){
-	//printf("mesh render, vertexId=%d, elementId=%d\n", m->vertexId, m->elementId);
-	glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
+/* A merged face produced by the greedy mesher */
+typedef struct greedy_quad_s {
+	int face;
+	Uint32 block_type;
+	int tex_ind;
+	Uint8 lo[3], hi[3];
+} greedy_quad_t;
 
-	glEnableClientState(GL_VERTEX_ARRAY);
-	glVertexPointer(3, GL_FLOAT, 11 * sizeof(float), NULL);
+/* Upper bound of the number of faces in a chunk */
+#define MAX_CHUNK_FACES (6 * MAX_ACTIVE_BLOCKS)
 
-	glEnableClientState(GL_COLOR_ARRAY);
-	glColorPointer(3, GL_FLOAT, 11 * sizeof(float), (void*) (3 * sizeof(float))); 
+static int
+greedy_quad_cmp(const void *a, const void *b){
+	const greedy_quad_t *q1 = a;
+	const greedy_quad_t *q2 = b;
+	return q1->tex_ind - q2->tex_ind;
+}
 
-	glEnableClientState(GL_NORMAL_ARRAY);
-	glNormalPointer(GL_FLOAT, 11 * sizeof(float), (void*) (6 * sizeof(float)));
+/* Merge the exposed faces of one slice of the chunk into as few quads
+ * as possible. Only faces of the same block type are merged */
+static int
+greedy_merge_slice(mesh_source_t *src, int face, int slice, greedy_quad_t *out){
+	int n = face_axis[face];
+	int a = (n + 1) % 3;
+	int b = (n + 2) % 3;
+	/* Block type + 1 of the exposed faces in the slice, 0 if there is no face */
+	Uint32 mask[CHUNK_SIZE][CHUNK_SIZE];
+	int n_quads = 0;
+
+	for(int u = 0; u < CHUNK_SIZE; u++)
+		for(int v = 0; v < CHUNK_SIZE; v++){
+			int ind[3];
+			ind[n] = slice; ind[a] = u; ind[b] = v;
+			Uint32 block = src->blocks[ind[0]][ind[1]][ind[2]];
+			if(block_isactive(block) && !is_face_obscured(src, face, ind[0], ind[1], ind[2]))
+				mask[u][v] = block_type_index(block) + 1;
+			else
+				mask[u][v] = 0;
+		}
 
-	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-	glTexCoordPointer(2, GL_FLOAT, 11 * sizeof(float), (void*) (9 * sizeof(float)));
+	for(int u = 0; u < CHUNK_SIZE; u++)
+		for(int v = 0; v < CHUNK_SIZE; ){
+			Uint32 key = mask[u][v];
+			if(key == 0){
+				v++;
+				continue;
+			}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->elementId);	
+			/* Grow along v, then along u while whole rows match */
+			int w = 1;
+			while(v + w < CHUNK_SIZE && mask[u][v + w] == key)
+				w++;
+			int h = 1;
+			while(u + h < CHUNK_SIZE){
+				int row_matches = 1;
+				for(int t = 0; t < w; t++)
+					if(mask[u + h][v + t] != key){
+						row_matches = 0;
+						break;
+					}
+				if(!row_matches)
+					break;
+				h++;
+			}
 
-	textureset_bind();
-	glDrawElements(
-			GL_TRIANGLES, 
-			m->n_trigs * 3,
-			GL_UNSIGNED_INT,
-			NULL
-		      );
+			for(int s = 0; s < h; s++)
+				for(int t = 0; t < w; t++)
+					mask[u + s][v + t] = 0;
 
-	textureset_unbind();
+			greedy_quad_t *q = &out[n_quads++];
+			q->face = face;
+			q->block_type = (key - 1) << 28;
+			q->tex_ind = textureset_texture_index(q->block_type, face);
+			q->lo[n] = slice; q->lo[a] = u; q->lo[b] = v;
+			q->hi[n] = slice; q->hi[a] = u + h - 1; q->hi[b] = v + w - 1;
 
-	glDisableClientState(GL_COLOR_ARRAY);
-	glDisableClientState(GL_VERTEX_ARRAY);
-	glDisableClientState(GL_NORMAL_ARRAY);
-	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+			v += w;
+		}
 
+	return n_quads;
 }
 
-void
-chunk_render(chunk_t *c){
-	//printf("chunk_render. pos =(%f %f %f)\n", c->pos[0], c->pos[1], c->pos[2]);
-	glPushMatrix();
-	glTranslated(c->pos[0], c->pos[1], c->pos[2]);
-	mesh_render(c->mesh);
-	glPopMatrix();
+/* greedy_quads is scratch space for MAX_CHUNK_FACES quads */
+static void
+chunk_build_mesh_greedy(mesh_source_t *src, mesh_t *mesh, greedy_quad_t *greedy_quads){
+	int n_quads = 0;
+	for(int face = 0; face < 6; face++)
+		for(int slice = 0; slice < CHUNK_SIZE; slice++)
+			n_quads += greedy_merge_slice(src, face, slice, greedy_quads + n_quads);
+
+	/* Sort quads by texture so every texture is drawn in a single batch */
+	qsort(greedy_quads, n_quads, sizeof(greedy_quad_t), greedy_quad_cmp);
+
+	int batch_tex = -1;
+	for(int i = 0; i < n_quads; i++){
+		greedy_quad_t *q = &greedy_quads[i];
+		if(q->tex_ind != batch_tex){
+			batch_tex = q->tex_ind;
+			mesh_begin_batch(mesh, batch_tex);
+		}
+		int lo[3] = { q->lo[0], q->lo[1], q->lo[2] };
+		int hi[3] = { q->hi[0], q->hi[1], q->hi[2] };
+		add_face_to_mesh(mesh, q->face, q->block_type, lo, hi, 1);
+	}
 }
 
-chunk_t*
-chunk_create(void){
-	chunk_t *tmp = malloc(sizeof(chunk_t));
-	tmp->pos[0] = 0; tmp->pos[1] = 0; tmp->pos[2] = 0;
-	tmp->ix = 0; tmp->iy = 0; tmp->iz = 0;
-	memset(tmp->blocks, 0, CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE * sizeof(Uint32));
-	tmp->mesh = mesh_create();
-	tmp->modified = 0;
-	tmp->modified_list = util_list_create();
-	tmp->active_blocks = 0;
-	return tmp;
-}
+/* Use the greedy mesher. Read from the settings system */
+static int mesher_greedy = 0;
 
-void
-chunk_free(void *p){
-	chunk_t *chunk = p;
-	mesh_free(chunk->mesh);
-	util_list_free_data(chunk->modified_list);
-	free(chunk);
+static void
+mesh_source_build(mesh_source_t *src, mesh_t *mesh, greedy_quad_t *greedy_quads){
+	/* Nothing to mesh */
+	if(src->summary.active_blocks == 0)
+		return;
+
+	if(mesher_greedy)
+		chunk_build_mesh_greedy(src, mesh, greedy_quads);
+	else
+		chunk_build_mesh_naive(src, mesh);
 }
 
-void 
-chunk_add_modified_block(chunk_t *c, int x, int y, int z){
-	if(!c->modified) c->modified = 1;
-	int *block_ind = malloc(sizeof(int) * 3);
-	block_ind[0] = x;
-	block_ind[1] = y;
-	block_ind[2] = z;
-	util_list_add(c->modified_list, block_ind);
-}
+/* Chunks are meshed by a pool of mesher threads. The main thread takes 
+ * a snapshot of the chunk and queues a job, closest to the camera first. 
+ * A mesher thread builds the vertex data and hands the job back. The main 
+ * thread uploads finished meshes, at most mesher_upload_budget bytes per 
+ * frame. The chunk keeps drawing its old mesh until then */
+typedef struct mesh_job_s {
+	chunk_t *chunk;
+	/* Value of chunk->mesh_generation when the job was queued */
+	int generation;
+	mesh_source_t *src;
+	/* CPU side result, swapped into the chunk's mesh on upload */
+	mesh_t *mesh;
+} mesh_job_t;
+
+typedef struct mesher_s {
+	SDL_mutex *lock;
+	/* Signaled when jobs are queued or the threads should quit */
+	SDL_cond *work_available;
+	/* Signaled when a job is finished */
+	SDL_cond *job_done;
+	pqueue_t *pending;
+	linked_list_t *finished;
+	/* Jobs that are being meshed right now */
+	int n_busy;
+	int quit;
+	/* Unused jobs, only touched by the main thread */
+	linked_list_t *free_jobs;
+	int n_threads;
+	SDL_Thread **threads;
+} mesher_t;
+
+static mesher_t mesher;
+
+/* Read from the settings system */
+static int mesher_threads = 2;
+static int mesher_upload_budget = 256 * 1024;
+
+/* Guards mesh_n_allocations, meshes are built on several threads */
+static SDL_mutex *mesh_allocations_lock = NULL;
 
-void
-chunk_remove_block(chunk_t *c, int w_x, int w_y, int w_z){
-	int x, y, z;
-	x = w_x % CHUNK_SIZE;
-	y = w_y % CHUNK_SIZE;
-	z = w_z % CHUNK_SIZE;
-	c->blocks[x][y][z] = 0;
-	chunk_add_modified_block(c, x, y, z);
-	/* Todo: Do this later */
-	chunk_rebuild(c);
-}
+static int
+mesher_thread(void *data){
+	(void) data;
+	greedy_quad_t *greedy_quads = malloc(MAX_CHUNK_FACES * sizeof(greedy_quad_t));
+	if(greedy_quads == NULL)
+		FATAL_ERROR("Out of memory");
 
-void
-chunk_add_block(chunk_t *c, Uint32 block_type, int w_x, int w_y, int w_z){
-	int x, y, z;
-	x = w_x % CHUNK_SIZE;
-	y = w_y % CHUNK_SIZE;
-	z = w_z % CHUNK_SIZE;
-	c->blocks[x][y][z] = block_type;
-	chunk_add_modified_block(c, x, y, z);
-	/* Todo: Do this later */
-	chunk_rebuild(c);
-}
+	SDL_LockMutex(mesher.lock);
+	for(;;){
+		while(!mesher.quit && util_pqueue_size(mesher.pending) == 0)
+			SDL_CondWait(mesher.work_available, mesher.lock);
+		if(mesher.quit)
+			break;
 
-int 
-world_open(world_file_t *f){
-	f->file = fopen(f->path, "rb+");
-	if(f->file == NULL){
-		LOG_DEBUG("Could not open file %s", f->path);
-		return -1;
-	}
-	Uint32 first;
-	int r = fread(&first, sizeof(Uint32), 1, f->file);
-	if(r != 1){
-		LOG_DEBUG("Could not read magic number from file %s", f->path);
-		return -1;
-	}
-	if(first != WORLD_FILE_MAGIC_NUMBER){
-		LOG_DEBUG("File %s doesn't have correct magic number. Is it a world file?", f->path);
-		return -1;
-	}
-	
-	/* We probably have a world file. Read the world size */
-	r = fread(&f->size, sizeof(Uint32), 3, f->file);
-	if(r != 3){
-		LOG_DEBUG("Could not read world size from file %s", f->path);
-		return -1;
-	}
-	if(f->size[0] % CHUNK_SIZE != 0){
-		LOG_DEBUG("Aborting. World length must be multiple of CHUNK_SIZE=%d", CHUNK_SIZE);
-		return -1;
-	}
-	if((f->size[1] % CHUNK_SIZE) != 0){
-		LOG_DEBUG("Aborting. World height must be multiple of CHUNK_SIZE=%d", CHUNK_SIZE);
-		return -1;
-	}
-	if((f->size[2] % CHUNK_SIZE) != 0){
-		LOG_DEBUG("Aborting. World width must be multiple of CHUNK_SIZE=%d", CHUNK_SIZE);
-		return -1;
+		mesh_job_t *job = util_pqueue_pop(mesher.pending);
+		job->chunk->pending_job = NULL;
+		job->chunk->meshing++;
+		mesher.n_busy++;
+		SDL_UnlockMutex(mesher.lock);
+
+		mesh_clear(job->mesh);
+		mesh_source_build(job->src, job->mesh, greedy_quads);
+
+		SDL_LockMutex(mesher.lock);
+		job->chunk->meshing--;
+		util_list_add(mesher.finished, job);
+		mesher.n_busy--;
+		SDL_CondSignal(mesher.job_done);
 	}
+	SDL_UnlockMutex(mesher.lock);
 
+	free(greedy_quads);
 	return 0;
 }
 
-int
-world_read_chunk(world_file_t *f, int x, int y, int z, chunk_t *c){
-	int chunk_linear_size = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
-	int chunk_ind = z + y * f->size[2] / CHUNK_SIZE + x * f->size[2] / CHUNK_SIZE * f->size[1] / CHUNK_SIZE;
-	int byte_offset = (4 + chunk_ind * chunk_linear_size) * sizeof(Uint32);
-	if(fseek(f->file, byte_offset, SEEK_SET) < 0){
-		LOG_DEBUG("Couldnt seek to read chunk (%d %d %d)", x, y, z);
-		return -1;
+static mesh_job_t*
+mesher_get_free_job(void){
+	linked_list_elm_t *elm = mesher.free_jobs->head;
+	if(elm != NULL){
+		mesh_job_t *job = elm->data;
+		util_list_remove(mesher.free_jobs, job);
+		return job;
 	}
 
-	int r = fread(c->blocks, sizeof(Uint32), chunk_linear_size, f->file); 	
-	if(r != chunk_linear_size){
-		LOG_DEBUG("Could not read chunk (%d %d %d)", x, y, z);
-		return -1;
+	mesh_job_t *job = malloc(sizeof(mesh_job_t));
+	job->src = malloc(sizeof(mesh_source_t));
+	job->mesh = mesh_create();
+	return job;
+}
+
+static void
+mesh_job_free(void *p){
+	mesh_job_t *job = p;
+	free(job->src);
+	mesh_free(job->mesh);
+	free(job);
+}
+
+static void
+mesher_init(void){
+	util_settings_geti("mesher/threads", &mesher_threads);
+	util_settings_geti("mesher/upload_budget", &mesher_upload_budget);
+	if(mesher_threads < 1)
+		mesher_threads = 1;
+
+	mesh_allocations_lock = SDL_CreateMutex();
+	mesher.lock = SDL_CreateMutex();
+	mesher.work_available = SDL_CreateCond();
+	mesher.job_done = SDL_CreateCond();
+	mesher.pending = util_pqueue_create();
+	mesher.finished = util_list_create();
+	mesher.free_jobs = util_list_create();
+	mesher.n_busy = 0;
+	mesher.quit = 0;
+
+	mesher.n_threads = mesher_threads;
+	mesher.threads = malloc(mesher.n_threads * sizeof(SDL_Thread*));
+	for(int i = 0; i < mesher.n_threads; i++){
+		mesher.threads[i] = SDL_CreateThread(mesher_thread, NULL);
+		if(mesher.threads[i] == NULL)
+			FATAL_ERROR("Could not create mesher thread");
 	}
+	LOG_DEBUG("Started %d mesher threads", mesher.n_threads);
+}
 
-	c->ix = x;
-	c->iy = y;
-	c->iz = z;
+static void
+mesher_free(void){
+	SDL_LockMutex(mesher.lock);
+	mesher.quit = 1;
+	SDL_CondBroadcast(mesher.work_available);
+	SDL_UnlockMutex(mesher.lock);
+
+	for(int i = 0; i < mesher.n_threads; i++)
+		SDL_WaitThread(mesher.threads[i], NULL);
+	free(mesher.threads);
+
+	mesh_job_t *job;
+	while((job = util_pqueue_pop(mesher.pending)) != NULL)
+		mesh_job_free(job);
+	util_pqueue_free(mesher.pending);
+	util_list_free_custom(mesher.finished, mesh_job_free);
+	util_list_free_custom(mesher.free_jobs, mesh_job_free);
+
+	SDL_DestroyCond(mesher.work_available);
+	SDL_DestroyCond(mesher.job_done);
+	SDL_DestroyMutex(mesher.lock);
+	SDL_DestroyMutex(mesh_allocations_lock);
+	mesh_allocations_lock = NULL;
+}
 
-	c->pos[0] = x * (2 * CHUNK_SIZE);
-	c->pos[1] = y * (2 * CHUNK_SIZE);
-	c->pos[2] = z * (2 * CHUNK_SIZE);
+static double
+chunk_distance2_to_camera(chunk_t *c){
+	double d2 = 0;
+	for(int i = 0; i < 3; i++){
+		double d = c->pos[i] + CHUNK_SIZE - camera->eye[i];
+		d2 += d * d;
+	}
+	return d2;
+}
 
-	return 0;
+/* A uniform solid chunk whose six neighbours are uniform solid too has no visible faces */
+static int
+is_chunk_enclosed(chunk_t *c){
+	for(int face = 0; face < 6; face++){
+		chunk_t *n = c->neighbours[face];
+		if(n == NULL || n->blocks.bits != 0 || !block_isactive(n->blocks.uniform))
+			return 0;
+	}
+	return 1;
 }
 
+static int mesher_cancel(chunk_t *c);
+static int chunk_take_mesh(chunk_t *c, int generation, mesh_summary_t *s, mesh_t *built);
+static void cull_update_chunk(chunk_t *c);
+static void cull_update_around(chunk_t *c);
+
+/* Queue the chunk for meshing. The snapshot is taken now */
 void
-world_update_chunk(world_file_t *f, chunk_t *chunk){
-	int chunk_linear_size = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
-	int chunk_ind = chunk->iz + chunk->iy * f->size[2] / CHUNK_SIZE + chunk->ix * f->size[2] / CHUNK_SIZE * f->size[1] / CHUNK_SIZE;
-	int chunk_byte_offset = (4 + chunk_ind * chunk_linear_size) * sizeof(Uint32);
+chunk_rebuild(chunk_t *chunk){
+	/* Uniform chunks that are empty or can't be seen are done right away */
+	if(chunk->blocks.bits == 0){
+		int solid = block_isactive(chunk->blocks.uniform);
+		if(!solid || is_chunk_enclosed(chunk)){
+			mesh_summary_t s;
+			s.active_blocks = solid ? MAX_ACTIVE_BLOCKS : 0;
+			for(int a = 0; a < 3; a++){
+				s.box_lo[a] = solid ? 0 : CHUNK_SIZE;
+				s.box_hi[a] = CHUNK_SIZE - 1;
+				/* A whole layer across each axis */
+				for(int b = 0; b < 3; b++){
+					s.occluder_lo[a][b] = solid ? 0 : CHUNK_SIZE;
+					s.occluder_hi[a][b] = a == b ? 0 : CHUNK_SIZE - 1;
+				}
+			}
+			for(int face = 0; face < 6; face++)
+				s.face_links[face] = solid ? 0 : FACE_LINKS_ALL;
+			mesher_cancel(chunk);
+			chunk_take_mesh(chunk, ++chunk->mesh_generation, &s, NULL);
+			return;
+		}
+	}
 
-	linked_list_elm_t *elm;
-	elm = chunk->modified_list->head;
-	while(elm != NULL){ 
-		int *block_ind = elm->data;
-		long block_byte_offset = (block_ind[2] + block_ind[1] * CHUNK_SIZE + block_ind[0] * CHUNK_SIZE * CHUNK_SIZE) * sizeof(Uint32);
-		//printf("%d\n", block_byte_offset + chunk_byte_offset);
-
-		if(fseek(f->file, chunk_byte_offset + block_byte_offset, SEEK_SET) < 0)
-			FATAL_ERROR("Could not update chunk to file. fseek failed");
-
-		int n = fwrite(&chunk->blocks[block_ind[0]][block_ind[1]][block_ind[2]], sizeof(Uint32), 1, f->file);
-		if(n != 1)
-			FATAL_ERROR("Couldn't write block %d %d %d in chunk %d %d %d", block_ind[0], block_ind[1], block_ind[2], chunk->ix, chunk->iy, chunk->iz);
-		elm = elm->next;
+	mesh_job_t *job = mesher_get_free_job();
+	mesh_source_fill(job->src, chunk);
+	job->chunk = chunk;
+	job->generation = ++chunk->mesh_generation;
+
+	SDL_LockMutex(mesher.lock);
+	mesh_job_t *pending = chunk->pending_job;
+	if(pending != NULL){
+		/* Not started yet. Give it the new snapshot instead of queueing another job */
+		mesh_source_t *tmp = pending->src;
+		pending->src = job->src;
+		job->src = tmp;
+		pending->generation = job->generation;
+	}else{
+		chunk->pending_job = job;
+		util_pqueue_push(mesher.pending, job, chunk_distance2_to_camera(chunk));
+		SDL_CondSignal(mesher.work_available);
 	}
+	SDL_UnlockMutex(mesher.lock);
 
-	/* Clean up and create new list */
-	util_list_free_data(chunk->modified_list);	
-	chunk->modified = 0;
-	chunk->modified_list = util_list_create();  
+	if(pending != NULL)
+		util_list_add(mesher.free_jobs, job);
 }
 
-/* TODO: Figure out a better data structure for looking up chunks by (ix,iy,iz) */
-chunk_t*
-chunkmanager_get_chunk(int ix, int iy, int iz){
-	linked_list_elm_t *elm;
+/* Drop the mesh jobs of chunk c so it can be freed. Returns 0 if a 
+ * mesher thread is working on the chunk right now */
+static int
+mesher_cancel(chunk_t *c){
+	SDL_LockMutex(mesher.lock);
+	if(c->meshing > 0){
+		SDL_UnlockMutex(mesher.lock);
+		return 0;
+	}
 
-	elm = chunkmanager->loaded_chunks->head;
+	mesh_job_t *pending = c->pending_job;
+	if(pending != NULL){
+		util_pqueue_remove(mesher.pending, pending);
+		c->pending_job = NULL;
+	}
+
+	linked_list_elm_t *elm = mesher.finished->head;
 	while(elm != NULL){
-		chunk_t *c = elm->data;
-		if(c->ix == ix && c->iy == iy && c->iz == iz)
-			return c;
+		mesh_job_t *job = elm->data;
+		if(job->chunk == c)
+			job->chunk = NULL;
 		elm = elm->next;
 	}
-	return NULL;
+	SDL_UnlockMutex(mesher.lock);
+
+	if(pending != NULL)
+		util_list_add(mesher.free_jobs, pending);
+	return 1;
 }
 
-void
-chunkmanager_init(world_file_t *world){
-	chunkmanager = malloc(sizeof(chunkmanager_t));
-	chunkmanager->visible_chunks = util_list_create();
-	chunkmanager->render_chunks = util_list_create();
-	chunkmanager->loaded_chunks = util_list_create();
-	chunkmanager->active_blocks = 0;
-	chunkmanager->n_trigs = 0;
-	
-	chunkmanager->world = world;
-	
-	for(int i = 0; i < (int)world->size[0] / CHUNK_SIZE; i++)
-		for(int j = 0; j < (int)world->size[1] / CHUNK_SIZE; j++)
-			for(int k = 0; k < (int)world->size[2] / CHUNK_SIZE; k++){
-				chunk_t *c = chunk_create();
-				world_read_chunk(world, i, j, k, c);
-				util_list_add(chunkmanager->loaded_chunks, c);
-			}
+
+/* Swap the freshly built vertex data into the chunk's mesh and upload it */
+static int
+mesher_upload_job(mesh_job_t *job){
+	chunk_t *c = job->chunk;
+	/* The chunk was unloaded or a newer job for it is on its way */
+	if(c == NULL || job->generation != c->mesh_generation)
+		return 0;
+
+	return chunk_take_mesh(c, job->generation, &job->src->summary, job->mesh);
+}
+
+/* Make chunk c show built, the mesh of snapshot generation with the 
+ * blocks summed up by s. built is NULL for an empty mesh. Returns the 
+ * number of bytes uploaded */
+static int
+chunk_take_mesh(chunk_t *c, int generation, mesh_summary_t *s, mesh_t *built){
+	int old_quads = c->mesh != NULL ? c->mesh->n_quads : 0;
+	int new_quads = built != NULL ? built->n_quads : 0;
+	chunkmanager->active_blocks += s->active_blocks - c->active_blocks;
+	chunkmanager->n_trigs += 2 * (new_quads - old_quads);
+	c->active_blocks = s->active_blocks;
+	for(int a = 0; a < 3; a++){
+		c->box_lo[a] = s->box_lo[a];
+		c->box_hi[a] = s->box_hi[a];
+		for(int b = 0; b < 3; b++){
+			c->occluder_lo[a][b] = s->occluder_lo[a][b];
+			c->occluder_hi[a][b] = s->occluder_hi[a][b];
+		}
+	}
+	for(int face = 0; face < 6; face++)
+		c->face_links[face] = s->face_links[face];
+	cull_update_around(c);
+
+	/* The patch index describes the old mesh */
+	free(c->patch);
+	c->patch = NULL;
+	c->mesh_uploaded_generation = generation;
+
+	/* Nothing to draw, don't keep a mesh around */
+	if(new_quads == 0){
+		if(c->mesh != NULL)
+			mesh_free(c->mesh);
+		c->mesh = NULL;
+		return 0;
+	}
+	if(c->mesh == NULL)
+		c->mesh = mesh_create();
+
+	mesh_t *m = c->mesh;
+	mesh_t tmp = *m;
+	*m = *built;
+	*built = tmp;
+	/* The GL buffer stays with the chunk */
+	built->vertexId = m->vertexId;
+	built->gl_quads = m->gl_quads;
+	m->vertexId = tmp.vertexId;
+	m->gl_quads = tmp.gl_quads;
+
+	mesh_rebuild(m);
+	return m->n_quads * 4 * sizeof(mesh_vertex_t);
+}
+
+/* Upload finished meshes until budget bytes have been uploaded. At 
+ * least one mesh is uploaded if there is one. Negative budget means no limit */
+static int
+mesher_upload(int budget){
+	int uploaded = 0;
+	int n_meshes = 0;
+	while(budget < 0 || uploaded < budget){
+		SDL_LockMutex(mesher.lock);
+		linked_list_elm_t *elm = mesher.finished->head;
+		mesh_job_t *job = elm != NULL ? elm->data : NULL;
+		if(job != NULL)
+			util_list_remove(mesher.finished, job);
+		SDL_UnlockMutex(mesher.lock);
+
+		if(job == NULL)
+			break;
+
+		uploaded += mesher_upload_job(job);
+		n_meshes++;
+		util_list_add(mesher.free_jobs, job);
+	}
+	return n_meshes;
+}
+
+/* Time chunkmanager_update may spend rebuilding dirty chunks. Read from the settings system */
+static int rebuild_budget_ms = 2;
+
+/* Rebuild dirty chunks in the order they were edited until budget_ms 
+ * milliseconds have passed. At least one chunk is rebuilt if there is 
+ * one. Negative budget means no limit */
+static int
+rebuild_dirty_chunks(int budget_ms){
+	Uint32 start = SDL_GetTicks();
+	int n_rebuilt = 0;
+	linked_list_elm_t *elm;
+	while((elm = chunkmanager->dirty_chunks->head) != NULL){
+		if(budget_ms >= 0 && n_rebuilt > 0 && (int)(SDL_GetTicks() - start) >= budget_ms)
+			break;
+		chunk_t *c = elm->data;
+		util_list_remove(chunkmanager->dirty_chunks, c);
+		chunkmanager->n_dirty--;
+		c->dirty = 0;
+		chunk_rebuild(c);
+		n_rebuilt++;
+	}
+	return n_rebuilt;
+}
+
+/* Block until every dirty and queued chunk is meshed and uploaded */
+void
+chunkmanager_finish_meshing(void){
+	rebuild_dirty_chunks(-1);
+
+	SDL_LockMutex(mesher.lock);
+	while(util_pqueue_size(mesher.pending) > 0 || mesher.n_busy > 0)
+		SDL_CondWait(mesher.job_done, mesher.lock);
+	SDL_UnlockMutex(mesher.lock);
+
+	mesher_upload(-1);
+}
+
+/* Single block edits patch the uploaded mesh in place instead of 
+ * rebuilding the chunk. Only done for naive meshes, where every quad is 
+ * one face of one block. The index maps block faces to quads and back */
+typedef struct mesh_patch_s {
+	/* Quad of face f of block (i, j, k), -1 if the face isn't in the mesh */
+	Sint16 face_quad[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE][6];
+	/* Block and face of each quad, as ((i * CHUNK_SIZE + j) * CHUNK_SIZE + k) * 6 + f */
+	Uint16 quad_face[MESH_MAX_QUADS];
+	/* Quads changed by the current edit */
+	int touched[32];
+	int n_touched;
+} mesh_patch_t;
+
+/* Opposite of each face */
+static int face_opposite[6] = { 1, 0, 3, 2, 5, 4 };
+
+static int
+face_from_normal(GLbyte normal[3]){
+	for(int face = 0; face < 6; face++)
+		if(face_normals[face][0] == normal[0] && 
+		   face_normals[face][1] == normal[1] &&
+		   face_normals[face][2] == normal[2])
+			return face;
+	FATAL_ERROR("Invalid normal in mesh");
+	return -1;
+}
+
+/* Recover the block face of every quad from the vertex data */
+static mesh_patch_t*
+mesh_patch_create(mesh_t *m){
+	mesh_patch_t *patch = malloc(sizeof(mesh_patch_t));
+	if(patch == NULL)
+		FATAL_ERROR("Out of memory");
+	memset(patch->face_quad, -1, sizeof(patch->face_quad));
+	patch->n_touched = 0;
+
+	for(int q = 0; q < m->n_quads; q++){
+		mesh_vertex_t *quad = m->verticies + 4 * q;
+		int face = face_from_normal(quad[0].normal);
+		int ind[3];
+		for(int a = 0; a < 3; a++){
+			int lo = quad[0].pos[a];
+			for(int v = 1; v < 4; v++)
+				if(quad[v].pos[a] < lo)
+					lo = quad[v].pos[a];
+			/* Block i covers 2i - 1 to 2i + 1 */
+			if(a == face_axis[face])
+				ind[a] = (lo - face_dir[face]) / 2;
+			else
+				ind[a] = (lo + 1) / 2;
+		}
+		patch->face_quad[ind[0]][ind[1]][ind[2]][face] = q;
+		patch->quad_face[q] = ((ind[0] * CHUNK_SIZE + ind[1]) * CHUNK_SIZE + ind[2]) * 6 + face;
+	}
+	return patch;
+}
+
+static void
+mesh_patch_touch(mesh_patch_t *patch, int q){
+	for(int i = 0; i < patch->n_touched; i++)
+		if(patch->touched[i] == q)
+			return;
+	if(patch->n_touched == (int)(sizeof(patch->touched) / sizeof(int)))
+		FATAL_ERROR("Too many quads touched by one edit");
+	patch->touched[patch->n_touched++] = q;
+}
+
+/* Is the block (i, j, k) of chunk c active. Coordinates one step outside 
+ * the chunk are looked up in the neighbours. Missing chunks count as air */
+static int
+is_block_active(chunk_t *c, int i, int j, int k){
+	int ind[3] = { i, j, k };
+	for(int face = 0; face < 6; face++){
+		int a = face_axis[face];
+		if(ind[a] == (face_dir[face] > 0 ? CHUNK_SIZE : -1)){
+			c = c->neighbours[face];
+			if(c == NULL)
+				return 0;
+			ind[a] -= face_dir[face] * CHUNK_SIZE;
+		}
+	}
+	return block_isactive(chunk_get_block(c, ind[0], ind[1], ind[2]));
+}
+
+/* Remove quad q by moving the last quad into its place */
+static void
+mesh_patch_remove_quad(mesh_patch_t *patch, mesh_t *m, int q){
+	int last = m->n_quads - 1;
+	int f = patch->quad_face[q];
+	((Sint16*) patch->face_quad)[f] = -1;
+
+	if(q != last){
+		memcpy(m->verticies + 4 * q, m->verticies + 4 * last, 4 * sizeof(mesh_vertex_t));
+		int moved = patch->quad_face[last];
+		patch->quad_face[q] = moved;
+		((Sint16*) patch->face_quad)[moved] = q;
+		mesh_patch_touch(patch, q);
+	}
+	m->n_quads--;
+}
+
+/* Bring face of block (i, j, k) in line with the blocks. If rewrite is 
+ * set an existing quad is rewritten, in case the block type changed */
+static void
+mesh_patch_face(chunk_t *c, int i, int j, int k, int face, int rewrite){
+	mesh_patch_t *patch = c->patch;
+	mesh_t *m = c->mesh;
+	block_t block = chunk_get_block(c, i, j, k);
+	int ind[3] = { i, j, k };
+	int n[3] = { i, j, k };
+	n[face_axis[face]] += face_dir[face];
+
+	int visible = block_isactive(block) && !is_block_active(c, n[0], n[1], n[2]);
+	int q = patch->face_quad[i][j][k][face];
+
+	if(q >= 0 && (!visible || rewrite)){
+		mesh_patch_remove_quad(patch, m, q);
+		q = -1;
+	}
+	if(q < 0 && visible){
+		add_face_to_mesh(m, face, block_type(block), ind, ind, 0);
+		q = m->n_quads - 1;
+		patch->face_quad[i][j][k][face] = q;
+		patch->quad_face[q] = ((i * CHUNK_SIZE + j) * CHUNK_SIZE + k) * 6 + face;
+		mesh_patch_touch(patch, q);
+	}
+}
+
+/* The uploaded mesh is up to date with the chunk's blocks */
+static int
+is_chunk_patchable(chunk_t *c){
+	return !mesher_greedy && !c->dirty && c->pending_job == NULL && 
+		c->mesh_uploaded_generation == c->mesh_generation;
+}
+
+/* Upload the quads touched by the current edit */
+static void
+mesh_patch_upload(chunk_t *c){
+	mesh_patch_t *patch = c->patch;
+	for(int i = 0; i < patch->n_touched; i++)
+		if(patch->touched[i] < c->mesh->n_quads)
+			mesh_update_quads(c->mesh, patch->touched[i], 1);
+	patch->n_touched = 0;
+}
+
+/* Patch the meshes around block (x, y, z) of chunk c after it changed. 
+ * Returns 0 without touching anything if a mesh is out of date */
+static int
+chunk_patch_block(chunk_t *c, int x, int y, int z){
+	/* The chunk and the neighbours sharing a face with the block */
+	chunk_t *chunks[7];
+	int n_chunks = 0;
+	chunks[n_chunks++] = c;
+	int ind[3] = { x, y, z };
+	for(int face = 0; face < 6; face++){
+		int n = ind[face_axis[face]] + face_dir[face];
+		if(n >= 0 && n < CHUNK_SIZE)
+			continue;
+		chunk_t *neighbour = c->neighbours[face];
+		if(neighbour != NULL)
+			chunks[n_chunks++] = neighbour;
+	}
+
+	for(int i = 0; i < n_chunks; i++)
+		if(!is_chunk_patchable(chunks[i]))
+			return 0;
+
+	int quads_before[7];
+	for(int i = 0; i < n_chunks; i++){
+		if(chunks[i]->mesh == NULL)
+			chunks[i]->mesh = mesh_create();
+		if(chunks[i]->patch == NULL)
+			chunks[i]->patch = mesh_patch_create(chunks[i]->mesh);
+		quads_before[i] = chunks[i]->mesh->n_quads;
+	}
+
+	for(int face = 0; face < 6; face++){
+		mesh_patch_face(c, x, y, z, face, 1);
+
+		/* The face of the neighbouring block facing this one */
+		int n[3] = { x, y, z };
+		int a = face_axis[face];
+		n[a] += face_dir[face];
+		chunk_t *nc = c;
+		if(n[a] < 0 || n[a] >= CHUNK_SIZE){
+			nc = c->neighbours[face];
+			n[a] -= face_dir[face] * CHUNK_SIZE;
+		}
+		if(nc != NULL)
+			mesh_patch_face(nc, n[0], n[1], n[2], face_opposite[face], 0);
+	}
+
+	for(int i = 0; i < n_chunks; i++){
+		mesh_patch_upload(chunks[i]);
+		chunkmanager->n_trigs += 2 * (chunks[i]->mesh->n_quads - quads_before[i]);
+	}
+
+	return 1;
+}
+
+/* Initial number of quads a mesh has room for */
+#define MESH_INITIAL_CAPACITY 64
+
+static int mesh_n_allocations = 0;
+
+/* Index buffer shared by all meshes. Holds the triangles (0, 1, 2) and 
+ * (0, 2, 3) of every quad a mesh can hold */
+static GLuint mesh_quad_indicies = 0;
+
+static void*
+mesh_grow(void *data, int *capacity, int elm_size){
+	int new_capacity = *capacity == 0 ? MESH_INITIAL_CAPACITY : 2 * *capacity;
+	void *tmp = realloc(data, new_capacity * elm_size);
+	if(tmp == NULL)
+		FATAL_ERROR("Out of memory");
+	if(mesh_allocations_lock != NULL)
+		SDL_LockMutex(mesh_allocations_lock);
+	mesh_n_allocations++;
+	if(mesh_allocations_lock != NULL)
+		SDL_UnlockMutex(mesh_allocations_lock);
+	*capacity = new_capacity;
+	return tmp;
+}
+
+int
+mesh_allocations(void){
+	return mesh_n_allocations;
+}
+
+static void
+mesh_create_quad_indicies(void){
+	int size = MESH_MAX_QUADS * 6 * sizeof(GLushort);
+	GLushort *data = malloc(size);
+	if(data == NULL)
+		FATAL_ERROR("Out of memory");
+
+	GLushort *p = data;
+	for(int q = 0; q < MESH_MAX_QUADS; q++){
+		GLushort base = q * 4;
+		*p++ = base;
+		*p++ = base + 1;
+		*p++ = base + 2;
+		*p++ = base;
+		*p++ = base + 2;
+		*p++ = base + 3;
+	}
+
+	glGenBuffers(1, &mesh_quad_indicies);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_quad_indicies);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+	free(data);
+}
+
+void
+mesh_cleanup(void){
+	if(mesh_quad_indicies != 0)
+		glDeleteBuffers(1, &mesh_quad_indicies);
+	mesh_quad_indicies = 0;
+}
+
+mesh_t*
+mesh_create(void){
+	mesh_t *tmp = malloc(sizeof(mesh_t));
+	tmp->verticies = NULL;
+	tmp->n_quads = 0;
+	tmp->quad_capacity = 0;
+	tmp->batches = NULL;
+	tmp->n_batches = 0;
+	tmp->batch_capacity = 0;
+	tmp->vertexId = 0;
+	tmp->gl_quads = 0;
+	return tmp;
+}
+
+void
+mesh_clear(mesh_t *m){
+	m->n_quads = 0;
+	m->n_batches = 0;
+}
+
+void
+mesh_free(void *p){
+	mesh_t *m = p;
+	if(m->vertexId != 0)
+		glDeleteBuffers(1, &m->vertexId);
+	free(m->verticies);
+	free(m->batches);
+	free(m);
+}
+
+mesh_vertex_t*
+mesh_add_quad(mesh_t *m){
+	if(m->n_quads == MESH_MAX_QUADS)
+		FATAL_ERROR("Mesh has more than %d quads", MESH_MAX_QUADS);
+	if(m->n_quads == m->quad_capacity)
+		m->verticies = mesh_grow(m->verticies, &m->quad_capacity, 4 * sizeof(mesh_vertex_t));
+
+	return m->verticies + 4 * m->n_quads++;
+}
+
+void
+mesh_begin_batch(mesh_t *m, int tex_ind){
+	if(m->n_batches == m->batch_capacity)
+		m->batches = mesh_grow(m->batches, &m->batch_capacity, sizeof(mesh_batch_t));
+
+	mesh_batch_t *b = &m->batches[m->n_batches++];
+	b->tex_ind = tex_ind;
+	b->first_quad = m->n_quads;
+}
+
+void
+mesh_rebuild(mesh_t *m){
+	if(mesh_quad_indicies == 0)
+		mesh_create_quad_indicies();
+
+	/* Reuse the buffer if present. glBufferData reallocates its storage */
+	if(m->vertexId == 0)
+		glGenBuffers(1, &m->vertexId);
+
+	/* Upload straight from the mesh storage */
+	glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
+	glBufferData(GL_ARRAY_BUFFER, m->n_quads * 4 * sizeof(mesh_vertex_t), m->verticies, GL_STATIC_DRAW);
+	m->gl_quads = m->n_quads;
+}
+
+void
+mesh_update_quads(mesh_t *m, int first_quad, int n_quads){
+	if(first_quad + n_quads > m->gl_quads){
+		/* Out of room. Upload everything with space to grow into */
+		if(mesh_quad_indicies == 0)
+			mesh_create_quad_indicies();
+		if(m->vertexId == 0)
+			glGenBuffers(1, &m->vertexId);
+		glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
+		glBufferData(GL_ARRAY_BUFFER, m->quad_capacity * 4 * sizeof(mesh_vertex_t), m->verticies, GL_STATIC_DRAW);
+		m->gl_quads = m->quad_capacity;
+		return;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
+	glBufferSubData(GL_ARRAY_BUFFER, 
+			first_quad * 4 * sizeof(mesh_vertex_t), 
+			n_quads * 4 * sizeof(mesh_vertex_t), 
+			m->verticies + 4 * first_quad);
+}
+
+static void
+mesh_draw_quads(int first_quad, int n_quads){
+	glDrawElements(
+			GL_TRIANGLES, 
+			n_quads * 6,
+			GL_UNSIGNED_SHORT,
+			(void*) (first_quad * 6 * sizeof(GLushort))
+		      );
+}
+
+void 
+mesh_render(mesh_t *m){
+	glBindBuffer(GL_ARRAY_BUFFER, m->vertexId);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_SHORT, sizeof(mesh_vertex_t), (void*) offsetof(mesh_vertex_t, pos));
+
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(mesh_vertex_t), (void*) offsetof(mesh_vertex_t, color)); 
+
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_BYTE, sizeof(mesh_vertex_t), (void*) offsetof(mesh_vertex_t, normal));
+
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_SHORT, sizeof(mesh_vertex_t), (void*) offsetof(mesh_vertex_t, uv));
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_quad_indicies);	
+
+	if(m->n_batches == 0){
+		textureset_bind();
+		mesh_draw_quads(0, m->n_quads);
+	}else{
+		for(int i = 0; i < m->n_batches; i++){
+			mesh_batch_t *b = &m->batches[i];
+			int last_quad = i + 1 < m->n_batches ? m->batches[i + 1].first_quad : m->n_quads;
+			textureset_bind_tile(b->tex_ind);
+			mesh_draw_quads(b->first_quad, last_quad - b->first_quad);
+		}
+	}
+
+	textureset_unbind();
+
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+}
+
+/* Smallest index size that can address n_values palette entries */
+static int
+block_storage_bits_for(int n_values){
+	if(n_values <= 1)
+		return 0;
+	if(n_values <= 2)
+		return 1;
+	if(n_values <= 4)
+		return 2;
+	if(n_values <= 16)
+		return 4;
+	if(n_values <= 256)
+		return 8;
+	return BLOCK_STORAGE_FULL;
+}
+
+static void
+block_storage_alloc(block_storage_t *s, int bits){
+	s->bits = bits;
+	s->palette_size = 0;
+	s->palette = NULL;
+	s->data = NULL;
+	/* A uniform chunk keeps its value in s->uniform */
+	if(bits == 0)
+		return;
+
+	if(bits != BLOCK_STORAGE_FULL){
+		s->palette = malloc((1 << bits) * sizeof(block_t));
+		if(s->palette == NULL)
+			FATAL_ERROR("Out of memory");
+	}
+	s->data = calloc(MAX_ACTIVE_BLOCKS * bits / 32, sizeof(Uint32));
+	if(s->data == NULL)
+		FATAL_ERROR("Out of memory");
+}
+
+void
+block_storage_init(block_storage_t *s){
+	/* All air */
+	block_storage_alloc(s, 0);
+	s->uniform = 0;
+	s->palette_size = 1;
+	s->shared = NULL;
+}
+
+/* Leave the palette and data to the save sharing them. With copy s 
+ * keeps copies, otherwise it is left without */
+static void
+block_storage_unshare(block_storage_t *s, int copy){
+	if(s->shared == NULL)
+		return;
+	*s->shared = 1;
+	s->shared = NULL;
+	block_t *palette = s->palette;
+	Uint32 *data = s->data;
+	s->palette = NULL;
+	s->data = NULL;
+	if(!copy)
+		return;
+
+	if(palette != NULL){
+		s->palette = malloc((1 << s->bits) * sizeof(block_t));
+		if(s->palette == NULL)
+			FATAL_ERROR("Out of memory");
+		memcpy(s->palette, palette, s->palette_size * sizeof(block_t));
+	}
+	s->data = malloc(MAX_ACTIVE_BLOCKS * s->bits / 32 * sizeof(Uint32));
+	if(s->data == NULL)
+		FATAL_ERROR("Out of memory");
+	memcpy(s->data, data, MAX_ACTIVE_BLOCKS * s->bits / 32 * sizeof(Uint32));
+}
+
+void
+block_storage_free(block_storage_t *s){
+	block_storage_unshare(s, 0);
+	free(s->palette);
+	free(s->data);
+}
+
+void
+block_storage_share(block_storage_t *s, block_storage_t *copy, int *owned){
+	*copy = *s;
+	copy->shared = NULL;
+	*owned = 0;
+	/* Nothing allocated to share */
+	if(s->bits != 0)
+		s->shared = owned;
+}
+
+static int
+block_storage_find(block_storage_t *s, block_t block){
+	if(s->bits == 0)
+		return s->uniform == block ? 0 : -1;
+	for(int i = 0; i < s->palette_size; i++)
+		if(s->palette[i] == block)
+			return i;
+	return -1;
+}
+
+static void
+block_storage_put_index(block_storage_t *s, int i, Uint32 ind){
+	int bit = i * s->bits;
+	Uint32 mask = ((1u << s->bits) - 1) << (bit & 31);
+	s->data[bit >> 5] = (s->data[bit >> 5] & ~mask) | (ind << (bit & 31));
+}
+
+/* Replace the contents of s with the MAX_ACTIVE_BLOCKS blocks in blocks, 
+ * choosing the smallest index size that leaves room for n_spare more 
+ * palette entries */
+void
+block_storage_pack(block_storage_t *s, const block_t *blocks, int n_spare){
+	block_t palette[256];
+	int n_values = 0;
+	for(int i = 0; i < MAX_ACTIVE_BLOCKS && n_values <= 256; i++){
+		int found = 0;
+		for(int v = 0; v < n_values && !found; v++)
+			found = palette[v] == blocks[i];
+		if(!found && n_values++ < 256)
+			palette[n_values - 1] = blocks[i];
+	}
+
+	block_storage_free(s);
+	block_storage_alloc(s, block_storage_bits_for(n_values + n_spare));
+	if(s->bits == BLOCK_STORAGE_FULL){
+		memcpy(s->data, blocks, MAX_ACTIVE_BLOCKS * sizeof(block_t));
+		return;
+	}
+	if(s->bits == 0){
+		s->uniform = blocks[0];
+		s->palette_size = 1;
+		return;
+	}
+
+	memcpy(s->palette, palette, n_values * sizeof(block_t));
+	s->palette_size = n_values;
+	for(int i = 0; i < MAX_ACTIVE_BLOCKS; i++)
+		block_storage_put_index(s, i, block_storage_find(s, blocks[i]));
+}
+
+void
+block_storage_unpack(block_storage_t *s, block_t *out){
+	if(s->bits == 0){
+		for(int i = 0; i < MAX_ACTIVE_BLOCKS; i++)
+			out[i] = s->uniform;
+		return;
+	}
+	if(s->bits == BLOCK_STORAGE_FULL){
+		memcpy(out, s->data, MAX_ACTIVE_BLOCKS * sizeof(block_t));
+		return;
+	}
+
+	Uint32 mask = (1u << s->bits) - 1;
+	int per_word = 32 / s->bits;
+	for(int w = 0; w < MAX_ACTIVE_BLOCKS / per_word; w++){
+		Uint32 word = s->data[w];
+		for(int i = 0; i < per_word; i++){
+			*out++ = s->palette[word & mask];
+			word >>= s->bits;
+		}
+	}
+}
+
+block_t
+block_storage_get(block_storage_t *s, int i){
+	if(s->bits == 0)
+		return s->uniform;
+	if(s->bits == BLOCK_STORAGE_FULL)
+		return s->data[i];
+	int bit = i * s->bits;
+	return s->palette[(s->data[bit >> 5] >> (bit & 31)) & ((1u << s->bits) - 1)];
+}
+
+void
+block_storage_set(block_storage_t *s, int i, block_t block){
+	block_storage_unshare(s, 1);
+	if(s->bits == BLOCK_STORAGE_FULL){
+		s->data[i] = block;
+		return;
+	}
+
+	int ind = block_storage_find(s, block);
+	if(ind < 0){
+		if(s->palette_size == 1 << s->bits){
+			/* Palette full, or a uniform chunk. Repack, dropping unused 
+			 * entries, with room for the new value */
+			block_t blocks[MAX_ACTIVE_BLOCKS];
+			block_storage_unpack(s, blocks);
+			blocks[i] = block;
+			block_storage_pack(s, blocks, 1);
+			return;
+		}
+		ind = s->palette_size++;
+		s->palette[ind] = block;
+	}
+	if(s->bits > 0)
+		block_storage_put_index(s, i, ind);
+}
+
+/* Bytes used by the block storage */
+int
+block_storage_size(block_storage_t *s){
+	int size = MAX_ACTIVE_BLOCKS * s->bits / 8;
+	if(s->bits != BLOCK_STORAGE_FULL && s->bits != 0)
+		size += (1 << s->bits) * sizeof(block_t);
+	return size;
+}
+
+block_t
+chunk_get_block(chunk_t *c, int x, int y, int z){
+	return block_storage_get(&c->blocks, (x * CHUNK_SIZE + y) * CHUNK_SIZE + z);
+}
+
+void
+chunk_set_block(chunk_t *c, int x, int y, int z, block_t block){
+	block_storage_set(&c->blocks, (x * CHUNK_SIZE + y) * CHUNK_SIZE + z, block);
+}
+
+void
+chunk_render(chunk_t *c){
+	//printf("chunk_render. pos =(%f %f %f)\n", c->pos[0], c->pos[1], c->pos[2]);
+	if(c->mesh == NULL)
+		return;
+	glPushMatrix();
+	glTranslated(c->pos[0], c->pos[1], c->pos[2]);
+	mesh_render(c->mesh);
+	glPopMatrix();
+}
+
+chunk_t*
+chunk_create(void){
+	chunk_t *tmp = malloc(sizeof(chunk_t));
+	tmp->pos[0] = 0; tmp->pos[1] = 0; tmp->pos[2] = 0;
+	tmp->ix = 0; tmp->iy = 0; tmp->iz = 0;
+	block_storage_init(&tmp->blocks);
+	/* Created when there is something to draw */
+	tmp->mesh = NULL;
+	tmp->modified = 0;
+	tmp->modified_bits = NULL;
+	tmp->active_blocks = 0;
+	for(int a = 0; a < 3; a++){
+		tmp->box_lo[a] = CHUNK_SIZE;
+		tmp->box_hi[a] = -1;
+		for(int b = 0; b < 3; b++){
+			tmp->occluder_lo[a][b] = CHUNK_SIZE;
+			tmp->occluder_hi[a][b] = -1;
+		}
+	}
+	tmp->cull_index = -1;
+	for(int face = 0; face < 6; face++)
+		tmp->face_links[face] = FACE_LINKS_ALL;
+	tmp->dirty = 0;
+	tmp->mesh_generation = 0;
+	tmp->mesh_uploaded_generation = -1;
+	tmp->patch = NULL;
+	tmp->meshing = 0;
+	for(int face = 0; face < 6; face++)
+		tmp->neighbours[face] = NULL;
+	tmp->pending_job = NULL;
+	return tmp;
+}
+
+void
+chunk_free(void *p){
+	chunk_t *chunk = p;
+	block_storage_free(&chunk->blocks);
+	if(chunk->mesh != NULL)
+		mesh_free(chunk->mesh);
+	free(chunk->patch);
+	free(chunk->modified_bits);
+	free(chunk);
+}
+
+/* Edited blocks are written back by chunkmanager_update in batches, 
+ * each block once however often it was edited */
+void 
+chunk_add_modified_block(chunk_t *c, int x, int y, int z){
+	if(c->modified_bits == NULL)
+		c->modified_bits = calloc(MAX_ACTIVE_BLOCKS / 32, sizeof(Uint32));
+	int i = (x * CHUNK_SIZE + y) * CHUNK_SIZE + z;
+	Uint32 bit = 1u << (i % 32);
+	if(c->modified_bits[i / 32] & bit)
+		return;
+	c->modified_bits[i / 32] |= bit;
+
+	if(chunkmanager->n_modified == 0)
+		chunkmanager->modified_since = SDL_GetTicks();
+	chunkmanager->unsaved = 1;
+	if(c->modified == 0)
+		util_list_add(chunkmanager->modified_chunks, c);
+	c->modified++;
+	chunkmanager->n_modified++;
+}
+
+/* Edited chunks are rebuilt by chunkmanager_update, so a burst of edits
+ * to one chunk only costs one rebuild */
+void
+chunk_mark_dirty(chunk_t *c){
+	if(c->dirty)
+		return;
+	c->dirty = 1;
+	util_list_add(chunkmanager->dirty_chunks, c);
+	chunkmanager->n_dirty++;
+}
+
+/* Mark the chunk next to c in direction face dirty if it is loaded */
+static void
+mark_neighbour_dirty(chunk_t *c, int face){
+	chunk_t *n = c->neighbours[face];
+	if(n != NULL)
+		chunk_mark_dirty(n);
+}
+
+/* A block on the border of a chunk can hide or expose faces in the neighbouring chunk */
+static void
+mark_neighbours_dirty(chunk_t *c, int x, int y, int z){
+	if(x == 0) mark_neighbour_dirty(c, FACE_LEFT);
+	if(x == CHUNK_SIZE - 1) mark_neighbour_dirty(c, FACE_RIGHT);
+	if(y == 0) mark_neighbour_dirty(c, FACE_BOTTOM);
+	if(y == CHUNK_SIZE - 1) mark_neighbour_dirty(c, FACE_TOP);
+	if(z == 0) mark_neighbour_dirty(c, FACE_BACK);
+	if(z == CHUNK_SIZE - 1) mark_neighbour_dirty(c, FACE_FRONT);
+}
+
+/* Sum up the blocks of chunk c again as meshing does, for a chunk whose 
+ * mesh was patched instead of rebuilt */
+static void
+chunk_summarize(chunk_t *c){
+	mesh_source_t *src = malloc(sizeof(mesh_source_t));
+	if(src == NULL)
+		FATAL_ERROR("Out of memory");
+	mesh_source_fill(src, c);
+	mesh_summary_t *s = &src->summary;
+	for(int a = 0; a < 3; a++){
+		c->box_lo[a] = s->box_lo[a];
+		c->box_hi[a] = s->box_hi[a];
+		for(int b = 0; b < 3; b++){
+			c->occluder_lo[a][b] = s->occluder_lo[a][b];
+			c->occluder_hi[a][b] = s->occluder_hi[a][b];
+		}
+	}
+	for(int face = 0; face < 6; face++)
+		c->face_links[face] = s->face_links[face];
+	free(src);
+}
+
+/* Change block (x, y, z) of chunk c. The meshes are patched right away 
+ * if possible, otherwise the chunks are rebuilt on the next update. 
+ * Returns 1 if the meshes were patched */
+static int
+chunk_edit_block(chunk_t *c, int x, int y, int z, block_t block){
+	int was_active = block_isactive(chunk_get_block(c, x, y, z));
+	chunk_set_block(c, x, y, z, block);
+
+	if(chunk_patch_block(c, x, y, z)){
+		int delta = block_isactive(block) - was_active;
+		c->active_blocks += delta;
+		chunkmanager->active_blocks += delta;
+		if(block_isactive(block))
+			box_include(c->box_lo, c->box_hi, x, y, z);
+		/* A removed block may open a way through or split an occluder. 
+		 * Added blocks leave the old summary true */
+		if(was_active && !block_isactive(block))
+			chunk_summarize(c);
+		cull_update_around(c);
+		return 1;
+	}
+
+	chunk_mark_dirty(c);
+	mark_neighbours_dirty(c, x, y, z);
+	return 0;
+}
+
+int
+chunk_index_of_block(int w){
+	return w >= 0 ? w / CHUNK_SIZE : -((-w - 1) / CHUNK_SIZE) - 1;
+}
+
+int
+chunk_block_offset(int w){
+	return w - chunk_index_of_block(w) * CHUNK_SIZE;
+}
+
+void
+chunk_remove_block(chunk_t *c, int w_x, int w_y, int w_z){
+	int x, y, z;
+	x = chunk_block_offset(w_x);
+	y = chunk_block_offset(w_y);
+	z = chunk_block_offset(w_z);
+	chunk_edit_block(c, x, y, z, 0);
+	chunk_add_modified_block(c, x, y, z);
+}
+
+void
+chunk_add_block(chunk_t *c, Uint32 block_type, int w_x, int w_y, int w_z){
+	int x, y, z;
+	x = chunk_block_offset(w_x);
+	y = chunk_block_offset(w_y);
+	z = chunk_block_offset(w_z);
+	chunk_edit_block(c, x, y, z, block_type);
+	chunk_add_modified_block(c, x, y, z);
+}
+
+/* Chunk loads and stores run on the I/O thread, so a slow disk never 
+ * stalls a frame. Stores are done first and in the order they were 
+ * queued, so a chunk that is loaded again sees its own edits. Loads are 
+ * done closest to the camera first, and the loaded chunks are handed 
+ * back to the main thread by io_complete */
+
+/* What an io_store_t asks of the I/O thread */
+#define IO_STORE 0
+/* Commit the stores queued before */
+#define IO_COMMIT 1
+/* Freeze the world file and start the save thread */
+#define IO_SAVE_BEGIN 2
+/* Put the saved world in place and thaw the world file */
+#define IO_SAVE_END 3
+
+/* Loads the OS is asked to read in ahead of the I/O thread */
+#define IO_PREFETCH_CHUNKS 32
+
+typedef struct io_store_s {
+	int type;
+	int x, y, z;
+	/* The blocks of a store */
+	Uint32 *mask;
+	block_t *blocks;
+} io_store_t;
+
+typedef struct io_s {
+	SDL_mutex *lock;
+	/* Signaled when requests are queued or the thread should quit */
+	SDL_cond *work_available;
+	/* Signaled when a request is done */
+	SDL_cond *request_done;
+	linked_list_t *stores;
+	/* Chunks to load, with ix, iy and iz set */
+	pqueue_t *loads;
+	/* Chunks that were loaded or couldn't be read */
+	linked_list_t *loaded;
+	linked_list_t *failed;
+	/* Chunk being loaded right now. Freed by the I/O thread if the load is cancelled meanwhile */
+	chunk_t *busy;
+	int busy_cancelled;
+	/* Loads at the front of the queue that were prefetched */
+	int n_prefetched;
+	int commit_failed;
+	int quit;
+	/* Added to every load and commit to see how a slow disk shows up in 
+	 * the frame times. Read from the settings system */
+	int latency_ms;
+	/* Stores queued since the last commit, only touched by the main thread */
+	int n_uncommitted;
+	world_file_t *world;
+	SDL_Thread *thread;
+} io_t;
+
+static io_t io;
+
+/* Wait for a frame's worth of loads every frame, like reading on the 
+ * main thread did. Only used by the main thread */
+static int io_sync = 0;
+
+static double chunk_distance_to(int ix, int iy, int iz, double p[3]);
+static void save_begin(void);
+static void save_end(void);
+
+/* Fill the blocks of c. Everything else in c belongs to the main thread */
+static int
+io_read_blocks(chunk_t *c){
+	block_t buf[MAX_ACTIVE_BLOCKS];
+	const block_t *blocks = world_chunk_blocks(io.world, c->ix, c->iy, c->iz, buf);
+	if(blocks == NULL)
+		return -1;
+	block_storage_pack(&c->blocks, blocks, 0);
+	return 0;
+}
+
+/* Journal a store, commit the journal or take a save a step further. 
+ * Returns -1 if the commit failed */
+static int
+io_do_store(io_store_t *store, int latency_ms){
+	int ret = 0;
+	switch(store->type){
+	case IO_STORE:
+		world_journal_blocks(io.world, store->x, store->y, store->z, store->mask, store->blocks);
+		break;
+	case IO_COMMIT:
+		if(latency_ms > 0)
+			SDL_Delay(latency_ms);
+		ret = world_commit(io.world);
+		break;
+	case IO_SAVE_BEGIN:
+		save_begin();
+		break;
+	case IO_SAVE_END:
+		save_end();
+		break;
+	}
+	free(store->mask);
+	free(store->blocks);
+	free(store);
+	return ret;
+}
+
+/* Copy the chunk coordinates of the next n_max loads to pos without 
+ * taking them off the queue. Returns the number copied. The lock is held */
+static int
+io_next_loads(int pos[][3], int n_max){
+	chunk_t *chunks[IO_PREFETCH_CHUNKS];
+	double priorities[IO_PREFETCH_CHUNKS];
+	int n = 0;
+	while(n < n_max && n < IO_PREFETCH_CHUNKS && util_pqueue_size(io.loads) > 0){
+		priorities[n] = util_pqueue_peek_priority(io.loads);
+		chunks[n] = util_pqueue_pop(io.loads);
+		pos[n][0] = chunks[n]->ix;
+		pos[n][1] = chunks[n]->iy;
+		pos[n][2] = chunks[n]->iz;
+		n++;
+	}
+	for(int i = 0; i < n; i++)
+		util_pqueue_push(io.loads, chunks[i], priorities[i]);
+	return n;
+}
+
+static int
+io_thread(void *data){
+	(void) data;
+	SDL_LockMutex(io.lock);
+	for(;;){
+		while(!io.quit && io.stores->head == NULL && util_pqueue_size(io.loads) == 0)
+			SDL_CondWait(io.work_available, io.lock);
+
+		if(io.stores->head != NULL){
+			io_store_t *store = io.stores->head->data;
+			util_list_remove(io.stores, store);
+			int latency_ms = io.latency_ms;
+			SDL_UnlockMutex(io.lock);
+
+			int ret = io_do_store(store, latency_ms);
+
+			SDL_LockMutex(io.lock);
+			if(ret < 0)
+				io.commit_failed = 1;
+			SDL_CondSignal(io.request_done);
+			continue;
+		}
+		/* The stores are done before quitting, the loads are dropped */
+		if(io.quit)
+			break;
+
+		chunk_t *c = util_pqueue_pop(io.loads);
+		io.busy = c;
+		int latency_ms = io.latency_ms;
+		/* Have the OS read in the loads after this one while it is read. 
+		 * Asked again once those are done or the queue was reordered */
+		int prefetch[IO_PREFETCH_CHUNKS][3];
+		int n_prefetch = 0;
+		if(io.n_prefetched > 0){
+			io.n_prefetched--;
+		}else{
+			n_prefetch = io_next_loads(prefetch, IO_PREFETCH_CHUNKS);
+			io.n_prefetched = n_prefetch;
+		}
+		SDL_UnlockMutex(io.lock);
+
+		for(int i = 0; i < n_prefetch; i++)
+			world_prefetch_chunk(io.world, prefetch[i][0], prefetch[i][1], prefetch[i][2]);
+		if(latency_ms > 0)
+			SDL_Delay(latency_ms);
+		int ret = io_read_blocks(c);
+
+		SDL_LockMutex(io.lock);
+		io.busy = NULL;
+		if(io.busy_cancelled){
+			io.busy_cancelled = 0;
+			chunk_free(c);
+		}else{
+			util_list_add(ret < 0 ? io.failed : io.loaded, c);
+		}
+		SDL_CondSignal(io.request_done);
+	}
+	SDL_UnlockMutex(io.lock);
+	return 0;
+}
+
+static void
+io_init(world_file_t *world){
+	io.latency_ms = 0;
+	util_settings_geti("world/io_latency_ms", &io.latency_ms);
+	util_settings_getb("world/io_sync", &io_sync);
+
+	io.lock = SDL_CreateMutex();
+	io.work_available = SDL_CreateCond();
+	io.request_done = SDL_CreateCond();
+	io.stores = util_list_create();
+	io.loads = util_pqueue_create();
+	io.loaded = util_list_create();
+	io.failed = util_list_create();
+	io.busy = NULL;
+	io.busy_cancelled = 0;
+	io.n_prefetched = 0;
+	io.commit_failed = 0;
+	io.quit = 0;
+	io.n_uncommitted = 0;
+	io.world = world;
+
+	io.thread = SDL_CreateThread(io_thread, NULL);
+	if(io.thread == NULL)
+		FATAL_ERROR("Could not create I/O thread");
+}
+
+/* Finish the queued stores, drop the loads and stop the thread */
+static void
+io_free(void){
+	SDL_LockMutex(io.lock);
+	io.quit = 1;
+	SDL_CondSignal(io.work_available);
+	SDL_UnlockMutex(io.lock);
+	SDL_WaitThread(io.thread, NULL);
+
+	if(io.commit_failed)
+		FATAL_ERROR("Could not save the edits to %s", io.world->path);
+
+	chunk_t *c;
+	while((c = util_pqueue_pop(io.loads)) != NULL)
+		chunk_free(c);
+	util_pqueue_free(io.loads);
+	util_list_free_custom(io.loaded, chunk_free);
+	util_list_free_custom(io.failed, chunk_free);
+	util_list_free(io.stores);
+
+	SDL_DestroyCond(io.work_available);
+	SDL_DestroyCond(io.request_done);
+	SDL_DestroyMutex(io.lock);
+}
+
+static void
+io_queue_store(io_store_t *store){
+	SDL_LockMutex(io.lock);
+	util_list_add(io.stores, store);
+	SDL_CondSignal(io.work_available);
+	SDL_UnlockMutex(io.lock);
+}
+
+/* Queue the modified blocks of chunk c to be journaled. The chunk can be 
+ * edited or freed right away. The caller takes it off the modified list */
+static void
+io_store_chunk(chunk_t *c){
+	io_store_t *store = malloc(sizeof(io_store_t));
+	store->type = IO_STORE;
+	store->x = c->ix;
+	store->y = c->iy;
+	store->z = c->iz;
+	store->mask = c->modified_bits;
+	store->blocks = malloc(MAX_ACTIVE_BLOCKS * sizeof(block_t));
+	if(store->blocks == NULL)
+		FATAL_ERROR("Out of memory");
+	block_storage_unpack(&c->blocks, store->blocks);
+
+	c->modified_bits = NULL;
+	c->modified = 0;
+	io_queue_store(store);
+	io.n_uncommitted++;
+}
+
+/* Queue a request without blocks */
+static void
+io_request(int type){
+	io_store_t *store = malloc(sizeof(io_store_t));
+	store->type = type;
+	store->mask = NULL;
+	store->blocks = NULL;
+	io_queue_store(store);
+}
+
+/* Queue a commit of the stores queued so far */
+static void
+io_commit(void){
+	if(io.n_uncommitted == 0)
+		return;
+	io_request(IO_COMMIT);
+	io.n_uncommitted = 0;
+}
+
+/* Queue chunk c to be loaded. Its ix, iy and iz say which one, and 
+ * only the main thread may change them */
+static void
+io_load(chunk_t *c, double priority){
+	SDL_LockMutex(io.lock);
+	util_pqueue_push(io.loads, c, priority);
+	SDL_CondSignal(io.work_available);
+	SDL_UnlockMutex(io.lock);
+}
+
+/* Drop the load of chunk c, which is freed now or when the I/O thread is done with it */
+static void
+io_cancel(chunk_t *c){
+	SDL_LockMutex(io.lock);
+	int found = util_pqueue_remove(io.loads, c) || util_list_remove(io.loaded, c) || 
+		util_list_remove(io.failed, c);
+	if(!found && io.busy == c)
+		io.busy_cancelled = 1;
+	SDL_UnlockMutex(io.lock);
+
+	if(found)
+		chunk_free(c);
+}
+
+/* Order the waiting loads by their distance to p */
+static void
+io_reprioritise(double p[3]){
+	SDL_LockMutex(io.lock);
+	int n = util_pqueue_size(io.loads);
+	chunk_t **chunks = malloc((n > 0 ? n : 1) * sizeof(chunk_t*));
+	for(int i = 0; i < n; i++)
+		chunks[i] = util_pqueue_pop(io.loads);
+	for(int i = 0; i < n; i++)
+		util_pqueue_push(io.loads, chunks[i], chunk_distance_to(chunks[i]->ix, chunks[i]->iy, chunks[i]->iz, p));
+	io.n_prefetched = 0;
+	SDL_UnlockMutex(io.lock);
+	free(chunks);
+}
+
+/* Block until every queued load and store is done */
+static void
+io_finish(void){
+	SDL_LockMutex(io.lock);
+	while(io.stores->head != NULL || util_pqueue_size(io.loads) > 0 || io.busy != NULL)
+		SDL_CondWait(io.request_done, io.lock);
+	SDL_UnlockMutex(io.lock);
+}
+
+/* Block until n loads are done or there are no more loads to wait for */
+static void
+io_wait_loads(int n){
+	SDL_LockMutex(io.lock);
+	while(util_list_size(io.loaded) + util_list_size(io.failed) < n && 
+			(util_pqueue_size(io.loads) > 0 || io.busy != NULL))
+		SDL_CondWait(io.request_done, io.lock);
+	SDL_UnlockMutex(io.lock);
+}
+
+static void
+io_set_latency(int latency_ms){
+	SDL_LockMutex(io.lock);
+	io.latency_ms = latency_ms;
+	SDL_UnlockMutex(io.lock);
+}
+
+/* Take a chunk the I/O thread is done with. Returns NULL if there is 
+ * none, and sets failed if it couldn't be read */
+static chunk_t*
+io_take_done(int *failed){
+	SDL_LockMutex(io.lock);
+	if(io.commit_failed)
+		FATAL_ERROR("Could not save the edits to %s", io.world->path);
+	chunk_t *c = NULL;
+	*failed = io.failed->head != NULL;
+	linked_list_t *lst = *failed ? io.failed : io.loaded;
+	if(lst->head != NULL){
+		c = lst->head->data;
+		util_list_remove(lst, c);
+	}
+	SDL_UnlockMutex(io.lock);
+	return c;
+}
+
+/* Worlds are saved in the background. Between two frames the loaded 
+ * chunks are snapshotted, sharing their blocks until they are edited, 
+ * and the I/O thread is asked to freeze the world file once the stores 
+ * queued before are committed, keeping the chunks that aren't loaded as 
+ * they were then too. The save thread writes them all to a new file 
+ * that is then moved into place by the I/O thread */
+
+/* A loaded chunk as it was when the save started */
+typedef struct save_chunk_s {
+	int x, y, z;
+	block_storage_t blocks;
+	/* The storage of the chunk, while it shares blocks with the save */
+	block_storage_t *source;
+	/* Set when the chunk stopped sharing. blocks are freed with the save */
+	int owned;
+} save_chunk_t;
+
+typedef struct save_s {
+	/* The chunks point at their entry, which can't move */
+	save_chunk_t *chunks;
+	int n_chunks;
+	/* Where the world goes, and where it is written first */
+	char *path;
+	char *tmp_path;
+	int failed;
+	/* Set by the I/O thread when the save is over. Guarded by the I/O lock */
+	int done;
+	Uint32 started;
+	SDL_Thread *thread;
+} save_t;
+
+/* The save in progress, NULL if there is none */
+static save_t *save = NULL;
+
+/* Seconds between saves of an edited world, 0 to only save when asked. 
+ * Read from the settings system */
+static int autosave_interval_s = 600;
+static Uint32 autosave_last = 0;
+
+/* A snapshot chunk with its place in the layout of the world */
+typedef struct save_order_s {
+	Uint64 code;
+	save_chunk_t *chunk;
+} save_order_t;
+
+static int
+save_order_cmp(const void *a, const void *b){
+	const save_order_t *oa = a, *ob = b;
+	if(oa->code != ob->code)
+		return oa->code < ob->code ? -1 : 1;
+	return 0;
 }
 
-void
-chunkmanager_rebuild(void){
-	linked_list_elm_t *elm;
+/* Write every chunk of the world to out in the layout of the world, the 
+ * loaded ones from the snapshot, which are given in the same order */
+static int
+save_write_chunks(world_file_t *out, save_order_t *order){
+	world_file_t *world = io.world;
+	block_t buf[MAX_ACTIVE_BLOCKS];
+	int next = 0;
+	Uint64 n_codes = world_layout_codes(world, world->layout);
+	for(Uint64 code = 0; code < n_codes; code++){
+		int c[3];
+		if(world_layout_chunk(world, world->layout, code, c) < 0)
+			continue;
+		const block_t *blocks;
+		if(next < save->n_chunks && order[next].code == code){
+			block_storage_unpack(&order[next].chunk->blocks, buf);
+			blocks = buf;
+			next++;
+		}else{
+			blocks = world_frozen_blocks(world, c[0], c[1], c[2], buf);
+		}
+		if(blocks == NULL || world_write_chunk(out, c[0] - world->min[0], 
+				c[1] - world->min[1], c[2] - world->min[2], blocks) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-	elm = chunkmanager->loaded_chunks->head;
-	while(elm != NULL){
-		chunk_t *c = elm->data;
-		chunk_rebuild(c);
-		chunkmanager->active_blocks += c->active_blocks;
-		chunkmanager->n_trigs += c->mesh->n_trigs;
-		elm = elm->next;
+static int
+save_thread(void *data){
+	(void) data;
+	world_file_t *world = io.world;
+	/* The entries stay where they are, shared blocks point at them */
+	save_order_t *order = malloc((save->n_chunks > 0 ? save->n_chunks : 1) * sizeof(save_order_t));
+	if(order == NULL)
+		FATAL_ERROR("Out of memory");
+	for(int i = 0; i < save->n_chunks; i++){
+		save_chunk_t *c = &save->chunks[i];
+		order[i].code = world_layout_code(world, world->layout, c->x, c->y, c->z);
+		order[i].chunk = c;
 	}
-}	
+	qsort(order, save->n_chunks, sizeof(save_order_t), save_order_cmp);
 
-void
-chunkmanager_render_world(void){
-	linked_list_elm_t *elm;
+	world_file_t out;
+	out.path = save->tmp_path;
+	out.mmap = 0;
+	if(world_create(&out, world->size, world->layout) < 0){
+		save->failed = 1;
+	}else{
+		save->failed = save_write_chunks(&out, order) < 0;
+		world_close(&out);
+	}
+	free(order);
+	io_request(IO_SAVE_END);
+	return 0;
+}
+
+/* On the I/O thread, with every store queued before the snapshot committed */
+static void
+save_begin(void){
+	if(world_freeze(io.world) < 0){
+		/* The file would miss the edits that are only in the journal */
+		save->failed = 1;
+		save_end();
+		return;
+	}
+	save->thread = SDL_CreateThread(save_thread, NULL);
+	if(save->thread == NULL)
+		FATAL_ERROR("Could not create save thread");
+}
+
+/* On the I/O thread. Loads wait meanwhile, so nothing reads the old file */
+static void
+save_end(void){
+	if(save->failed){
+		remove(save->tmp_path);
+	}else if(strcmp(save->path, io.world->path) == 0){
+		if(world_replace(io.world, save->tmp_path) < 0){
+			remove(save->tmp_path);
+			save->failed = 1;
+		}
+	}else{
+#ifdef WIN32
+		/* rename doesn't replace files here */
+		remove(save->path);
+#endif
+		if(rename(save->tmp_path, save->path) < 0){
+			remove(save->tmp_path);
+			save->failed = 1;
+		}
+	}
+	world_thaw(io.world);
+
+	SDL_LockMutex(io.lock);
+	save->done = 1;
+	SDL_UnlockMutex(io.lock);
+}
 
-	elm = chunkmanager->render_chunks->head;
+int
+world_write_file(char *path){
+	world_file_t *world = chunkmanager->world;
+	if(save != NULL){
+		LOG_WARN("A save is already in progress");
+		return -1;
+	}
+	if(chunkmanager->regions){
+		LOG_WARN("Region worlds are saved as they are edited");
+		return -1;
+	}
+	if(path == NULL)
+		path = world->path;
+
+	save = malloc(sizeof(save_t));
+	save->path = malloc(strlen(path) + 1);
+	strcpy(save->path, path);
+	save->tmp_path = malloc(strlen(path) + strlen(".save") + 1);
+	sprintf(save->tmp_path, "%s.save", path);
+	save->failed = 0;
+	save->done = 0;
+	save->started = SDL_GetTicks();
+	save->thread = NULL;
+
+	/* Only bookkeeping here, the blocks are shared */
+	save->n_chunks = util_list_size(chunkmanager->loaded_chunks);
+	save->chunks = malloc((save->n_chunks > 0 ? save->n_chunks : 1) * sizeof(save_chunk_t));
+	if(save->chunks == NULL)
+		FATAL_ERROR("Out of memory");
+	int i = 0;
+	linked_list_elm_t *elm = chunkmanager->loaded_chunks->head;
 	while(elm != NULL){
 		chunk_t *c = elm->data;
-		chunk_render(c);
+		save_chunk_t *sc = &save->chunks[i++];
+		sc->x = c->ix;
+		sc->y = c->iy;
+		sc->z = c->iz;
+		sc->source = &c->blocks;
+		block_storage_share(&c->blocks, &sc->blocks, &sc->owned);
 		elm = elm->next;
 	}
+
+	/* Stores of chunks that were unloaded must be in the frozen file */
+	io_commit();
+	io_request(IO_SAVE_BEGIN);
+	chunkmanager->unsaved = 0;
+	autosave_last = save->started;
+	return 0;
+}
+
+/* Hand the shared blocks back to the chunks and free the rest */
+static void
+save_free(void){
+	SDL_WaitThread(save->thread, NULL);
+	for(int i = 0; i < save->n_chunks; i++){
+		save_chunk_t *sc = &save->chunks[i];
+		if(sc->owned)
+			block_storage_free(&sc->blocks);
+		else if(sc->blocks.bits != 0)
+			sc->source->shared = NULL;
+	}
+	if(save->failed){
+		LOG_WARN("Could not save the world to %s", save->path);
+		/* Autosave tries again after the interval */
+		chunkmanager->unsaved = 1;
+	}else
+		LOG_DEBUG("Saved the world to %s in %u ms", save->path, SDL_GetTicks() - save->started);
+	free(save->chunks);
+	free(save->path);
+	free(save->tmp_path);
+	free(save);
+	save = NULL;
+}
+
+/* Finish a save that is done, or start one when it is time */
+static void
+save_update(void){
+	if(save != NULL){
+		SDL_LockMutex(io.lock);
+		int done = save->done;
+		SDL_UnlockMutex(io.lock);
+		if(done)
+			save_free();
+		return;
+	}
+	if(autosave_interval_s > 0 && chunkmanager->unsaved && 
+			SDL_GetTicks() - autosave_last >= (Uint32) autosave_interval_s * 1000 && 
+			!chunkmanager->regions)
+		world_write_file(NULL);
+}
+
+/* Block until the save in progress is over */
+static void
+save_finish(void){
+	if(save == NULL)
+		return;
+	SDL_LockMutex(io.lock);
+	while(!save->done)
+		SDL_CondWait(io.request_done, io.lock);
+	SDL_UnlockMutex(io.lock);
+	save_free();
+}
+
+static unsigned int
+chunk_grid_hash(int ix, int iy, int iz){
+	return (unsigned int) ix * 73856093u ^ (unsigned int) iy * 19349663u ^ (unsigned int) iz * 83492791u;
+}
+
+static void
+chunk_grid_init(chunk_grid_t *g){
+	g->capacity = 1024;
+	g->size = 0;
+	g->slots = calloc(g->capacity, sizeof(chunk_t*));
+}
+
+static void
+chunk_grid_free(chunk_grid_t *g){
+	free(g->slots);
+}
+
+/* Slot holding chunk (ix, iy, iz) or the empty slot where it would go */
+static int
+chunk_grid_find(chunk_grid_t *g, int ix, int iy, int iz){
+	int mask = g->capacity - 1;
+	int i = chunk_grid_hash(ix, iy, iz) & mask;
+	while(g->slots[i] != NULL){
+		chunk_t *c = g->slots[i];
+		if(c->ix == ix && c->iy == iy && c->iz == iz)
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
 }
 
-/* Check if the point p is behind the plane spanned by y-axis and camera->right */
-static int 
-is_point_behind_camera(double p[3]){
-	double diff[3];
-	double forward_v[3];
-	diff[0] = p[0] - camera->eye[0];
-	diff[1] = p[1] - camera->eye[1];
-	diff[2] = p[2] - camera->eye[2];
-	forward_v[0] = camera->forward.x;
-	forward_v[1] = camera->forward.y;
-	forward_v[2] = camera->forward.z;
+static void
+chunk_grid_insert(chunk_grid_t *g, chunk_t *c);
+
+static void
+chunk_grid_grow(chunk_grid_t *g){
+	chunk_t **old = g->slots;
+	int old_capacity = g->capacity;
+	g->capacity *= 2;
+	g->size = 0;
+	g->slots = calloc(g->capacity, sizeof(chunk_t*));
+	for(int i = 0; i < old_capacity; i++)
+		if(old[i] != NULL)
+			chunk_grid_insert(g, old[i]);
+	free(old);
+}
 
-	/* Project diff and forward_v onto xz-plane */
-	diff[1] = 0;
-	forward_v[1] = 0;
+static void
+chunk_grid_insert(chunk_grid_t *g, chunk_t *c){
+	/* Keep the load factor below one half */
+	if(2 * (g->size + 1) > g->capacity)
+		chunk_grid_grow(g);
+	int i = chunk_grid_find(g, c->ix, c->iy, c->iz);
+	if(g->slots[i] == NULL)
+		g->size++;
+	g->slots[i] = c;
+}
 
-	double d = dotproduct(forward_v, diff);
+static void
+chunk_grid_remove(chunk_grid_t *g, chunk_t *c){
+	int mask = g->capacity - 1;
+	int i = chunk_grid_find(g, c->ix, c->iy, c->iz);
+	if(g->slots[i] != c)
+		return;
+	g->slots[i] = NULL;
+	g->size--;
+
+	/* Move back chunks further along the probe sequence so lookups 
+	 * don't stop at the hole */
+	int j = i;
+	for(;;){
+		j = (j + 1) & mask;
+		chunk_t *n = g->slots[j];
+		if(n == NULL)
+			break;
+		int home = chunk_grid_hash(n->ix, n->iy, n->iz) & mask;
+		/* Can n move to the hole? Only if its home isn't cyclically in (i, j] */
+		if((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)){
+			g->slots[i] = n;
+			g->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
 
-	return d < 0;
+chunk_t*
+chunkmanager_get_chunk(int ix, int iy, int iz){
+	chunk_grid_t *g = &chunkmanager->grid;
+	return g->slots[chunk_grid_find(g, ix, iy, iz)];
 }
 
-/* Computes the determinate 
- * | x2-x1 x3-x1 |
- * | y2-y1 y3-y1 |
- * to determine which side ot the line (a, b) the point p is on */
-static int 
-is_point_left_of_line(double a[3], double b[3], double p[3]){
-	return ((b[0] - a[0]) * (p[2] - a[2])) - ((b[2] - a[2]) * (p[0] - a[0])) > 0;
+/* Make c findable and link it with its loaded neighbours */
+static void
+chunkmanager_add_chunk(chunk_t *c){
+	chunk_grid_insert(&chunkmanager->grid, c);
+	util_list_add(chunkmanager->loaded_chunks, c);
+	c->cull_index = cull_table_add(&chunkmanager->cull, c);
+
+	for(int face = 0; face < 6; face++){
+		int ind[3] = { c->ix, c->iy, c->iz };
+		ind[face_axis[face]] += face_dir[face];
+		chunk_t *n = chunkmanager_get_chunk(ind[0], ind[1], ind[2]);
+		c->neighbours[face] = n;
+		if(n != NULL)
+			n->neighbours[face_opposite[face]] = c;
+	}
+	cull_update_around(c);
 }
 
-static int 
-is_point_right_of_line(double a[3], double b[3], double p[3]){
-	return ((b[0] - a[0]) * (p[2] - a[2])) - ((b[2] - a[2]) * (p[0] - a[0])) < 0;
+/* Write back, unlink and free chunk c. The caller removes it from loaded_chunks */
+static void
+chunkmanager_remove_chunk(chunk_t *c){
+	if(c->modified){
+		chunkmanager->n_modified -= c->modified;
+		util_list_remove(chunkmanager->modified_chunks, c);
+		io_store_chunk(c);
+	}
+
+	/* The neighbours keep their meshes. They are beyond the unload 
+	 * radius and their faces towards c can't be seen from the camera */
+	for(int face = 0; face < 6; face++){
+		chunk_t *n = c->neighbours[face];
+		if(n != NULL){
+			n->neighbours[face_opposite[face]] = NULL;
+			cull_update_chunk(n);
+		}
+	}
+	chunk_grid_remove(&chunkmanager->grid, c);
+	chunk_t *moved = cull_table_remove(&chunkmanager->cull, c->cull_index);
+	if(moved != NULL)
+		moved->cull_index = c->cull_index;
+	c->cull_index = -1;
+
+	if(c->dirty){
+		util_list_remove(chunkmanager->dirty_chunks, c);
+		chunkmanager->n_dirty--;
+	}
+	chunkmanager->active_blocks -= c->active_blocks;
+	if(c->mesh != NULL)
+		chunkmanager->n_trigs -= 2 * c->mesh->n_quads;
+	chunk_free(c);
 }
 
-static int 
-is_point_outside_frustrum(double p[3]){
-	/* TODO: Move this to settings */
-	int fov = 60;
+/* Chunks are streamed in and out around the camera. Chunks closer than 
+ * stream_load_radius to the camera, or to the point stream_prefetch_distance 
+ * ahead of it along its last motion, are loaded. Chunks are unloaded when 
+ * they are further than stream_unload_radius from the camera and outside 
+ * the prefetch sphere. At most stream_loads_per_frame loaded chunks are 
+ * added to the world per frame. Read from the settings system */
+static int stream_load_radius = 160;
+static int stream_unload_radius = 224;
+static int stream_prefetch_distance = 64;
+static int stream_loads_per_frame = 32;
+
+/* Edits are written back once flush_blocks blocks are waiting or the 
+ * oldest is flush_interval_ms old. Read from the settings system */
+static int flush_interval_ms = 2000;
+static int flush_blocks = 4096;
+
+static double stream_last_eye[3];
+static double stream_direction[3];
+/* Chunks left to unload after the last stream_update */
+static int stream_backlog = 0;
+
+static double
+chunk_distance_to(int ix, int iy, int iz, double p[3]){
+	double diff[3] = { 
+		ix * (2 * CHUNK_SIZE) - p[0], 
+		iy * (2 * CHUNK_SIZE) - p[1], 
+		iz * (2 * CHUNK_SIZE) - p[2] 
+	};
+	return length(diff);
+}
 
-	double forward_v[3];
-	double up_v[3];
-	double left_v[3];
-	double right_v[3];
-	double rot_axis_v[3];
-	quaternion_t left;
-	quaternion_t right;
-	quaternion_t rot1;
-	quaternion_t rot2;
-	quaternion_t rot_axis;
+static int
+is_chunk_wanted(int ix, int iy, int iz, double eye[3], double ahead[3], double eye_radius){
+	return chunk_distance_to(ix, iy, iz, eye) < eye_radius || 
+		chunk_distance_to(ix, iy, iz, ahead) < stream_load_radius;
+}
 
-	/* Convert quaternion to vectors */
-	quad_cpyvec(forward_v, &camera->forward);
-	quad_cpyvec(up_v, &camera->up);
+/* Unload the chunks that are no longer wanted. Returns the number of 
+ * chunks that couldn't be unloaded yet and the number unloaded in n_unloaded */
+static int
+stream_unload(double eye[3], double ahead[3], int *n_unloaded){
+	linked_list_t *keep = util_list_create();
+	int n_busy = 0;
+	*n_unloaded = 0;
 
-	/* Rotate around camera up axis */
-	quad_fromvec(&rot_axis, up_v);
+	linked_list_elm_t *elm = chunkmanager->loaded_chunks->head;
+	while(elm != NULL){
+		chunk_t *c = elm->data;
+		elm = elm->next;
+		if(is_chunk_wanted(c->ix, c->iy, c->iz, eye, ahead, stream_unload_radius)){
+			util_list_add(keep, c);
+		}else if(!mesher_cancel(c)){
+			/* Try again next frame */
+			util_list_add(keep, c);
+			n_busy++;
+		}else{
+			chunkmanager_remove_chunk(c);
+			(*n_unloaded)++;
+		}
+	}
 
-	/* left and right represent the outer boundaries of the viewing frustrum */
-	left = camera->forward;
-	right = camera->forward;
+	util_list_free(chunkmanager->loaded_chunks);
+	chunkmanager->loaded_chunks = keep;
 
-	quad_rotate(&rot1, -deg2radians(fov / 2 + 5), &rot_axis);
-	quad_rotate(&rot2, deg2radians(fov / 2 + 5), &rot_axis);
+	/* Loads that are no longer wanted */
+	chunk_grid_t *g = &chunkmanager->loading;
+	linked_list_t *cancel = util_list_create();
+	for(int i = 0; i < g->capacity; i++){
+		chunk_t *c = g->slots[i];
+		if(c != NULL && !is_chunk_wanted(c->ix, c->iy, c->iz, eye, ahead, stream_unload_radius))
+			util_list_add(cancel, c);
+	}
+	for(elm = cancel->head; elm != NULL; elm = elm->next){
+		chunk_grid_remove(g, elm->data);
+		io_cancel(elm->data);
+	}
+	util_list_free(cancel);
 
-	quad_applyrotation(&left, &rot1);
-	quad_applyrotation(&right, &rot2);
+	return n_busy;
+}
 
-	/* Project onto xz-plane */
-	left.y  = 0;
-	right.y = 0;
+/* Add chunk c, loaded by the I/O thread, to the world */
+static void
+stream_add_chunk(chunk_t *c){
+	chunk_grid_remove(&chunkmanager->loading, c);
+	chunkmanager_add_chunk(c);
+
+	/* The neighbours were meshed as if this chunk was air */
+	chunk_mark_dirty(c);
+	for(int face = 0; face < 6; face++){
+		chunk_t *n = c->neighbours[face];
+		if(n != NULL && (n->active_blocks > 0 || n->mesh_uploaded_generation != n->mesh_generation))
+			chunk_mark_dirty(n);
+	}
+}
 
-	/* Convert to vectors */
-	quad_cpyvec(left_v, &left);
-	quad_cpyvec(right_v, &right);
+/* Queue the missing chunks to be loaded, closest to the camera first */
+static void
+stream_load(double eye[3], double ahead[3]){
+	world_file_t *world = chunkmanager->world;
+
+	/* Chunks covering both spheres, clamped to the world unless it has no edge */
+	int bounded = !chunkmanager->regions;
+	int lo[3], hi[3];
+	for(int a = 0; a < 3; a++){
+		double min = fmin(eye[a] - stream_load_radius, ahead[a] - stream_load_radius);
+		double max = fmax(eye[a] + stream_load_radius, ahead[a] + stream_load_radius);
+		lo[a] = (int) floor(min / (2 * CHUNK_SIZE));
+		hi[a] = (int) floor(max / (2 * CHUNK_SIZE));
+		if(bounded){
+			lo[a] = lo[a] > world->min[a] ? lo[a] : world->min[a];
+			hi[a] = hi[a] < world->max[a] - 1 ? hi[a] : world->max[a] - 1;
+		}
+	}
 
-	vec_add(left_v, camera->eye);
-	vec_add(right_v, camera->eye);
+	chunk_grid_t *loading = &chunkmanager->loading;
+	for(int ix = lo[0]; ix <= hi[0]; ix++)
+		for(int iy = lo[1]; iy <= hi[1]; iy++)
+			for(int iz = lo[2]; iz <= hi[2]; iz++){
+				if(!is_chunk_wanted(ix, iy, iz, eye, ahead, stream_load_radius))
+					continue;
+				if(chunkmanager_get_chunk(ix, iy, iz) != NULL)
+					continue;
+				if(loading->slots[chunk_grid_find(loading, ix, iy, iz)] != NULL)
+					continue;
+				chunk_t *c = chunk_create();
+				c->ix = ix; c->iy = iy; c->iz = iz;
+				c->pos[0] = ix * (2 * CHUNK_SIZE);
+				c->pos[1] = iy * (2 * CHUNK_SIZE);
+				c->pos[2] = iz * (2 * CHUNK_SIZE);
+				chunk_grid_insert(loading, c);
+				io_load(c, chunk_distance_to(ix, iy, iz, eye));
+			}
 
-	return is_point_left_of_line(camera->eye, left_v, p) || is_point_right_of_line(camera->eye, right_v, p);
+	/* Loads queued from further back */
+	io_reprioritise(eye);
 }
 
+/* Add up to max_loads chunks loaded by the I/O thread to the world. 
+ * Negative max_loads means no limit. Returns the number added */
 static int
-is_chunk_close_to_camera(chunk_t *chunk){
-	double diff[3];
-	vec_diff(diff, chunk->pos, camera->eye);
-	return length(diff) < (2 * CHUNK_SIZE + 5);
+stream_complete(int max_loads){
+	int n_loads = 0;
+	while(max_loads < 0 || n_loads < max_loads){
+		int failed;
+		chunk_t *c = io_take_done(&failed);
+		if(c == NULL)
+			break;
+		if(failed){
+			/* Tried again when the camera moves */
+			chunk_grid_remove(&chunkmanager->loading, c);
+			chunk_free(c);
+			continue;
+		}
+		stream_add_chunk(c);
+		n_loads++;
+	}
+	return n_loads;
 }
 
-/* Perform 2d frustrum culling */
+/* Unload the chunks around the camera that are no longer wanted and 
+ * queue the missing ones. Returns the number of chunks unloaded */
 static int
-is_chunk_outside_2d_frustrum(chunk_t *chunk){
-	/* Don't cull away chunks very close to the camera */
-	if(is_chunk_close_to_camera(chunk))
+stream_update(void){
+	double motion[3];
+	vec_diff(motion, camera->eye, stream_last_eye);
+	double moved = length(motion);
+	if(moved == 0 && stream_backlog == 0)
 		return 0;
 
-	double point[3];
-	/* Enumerate all corners of the chunk */
-	for(int i = 0; i < 6; i++){
-		int num = i;
-		int a = num % 2; num /= 2;
-		int b = num % 2; num /= 2;
-		int c = num % 2;
-		point[0] = chunk->pos[0] + a * 2 * CHUNK_SIZE;
-		point[1] = chunk->pos[1] + b * 2 * CHUNK_SIZE;
-		point[2] = chunk->pos[2] + c * 2 * CHUNK_SIZE;
-
-		/* One vertex is inside the frustrum */
-		if(!is_point_outside_frustrum(point))
-			return 0;
+	vec_cpy(stream_last_eye, camera->eye);
+	if(moved > 0)
+		for(int a = 0; a < 3; a++)
+			stream_direction[a] = motion[a] / moved;
+
+	double ahead[3];
+	for(int a = 0; a < 3; a++)
+		ahead[a] = camera->eye[a] + stream_direction[a] * stream_prefetch_distance;
+
+	int n_unloaded;
+	stream_backlog = stream_unload(camera->eye, ahead, &n_unloaded);
+	/* Edited chunks that were unloaded */
+	io_commit();
+	stream_load(camera->eye, ahead);
+	return n_unloaded;
+}
+
+/* Mesh every loaded chunk with both meshers and compare triangle counts and build times */
+static char*
+meshstats_execute(linked_list_t *args){
+	(void) args;
+	mesh_t *scratch = mesh_create();
+	mesh_source_t *src = malloc(sizeof(mesh_source_t));
+	greedy_quad_t *greedy_quads = malloc(MAX_CHUNK_FACES * sizeof(greedy_quad_t));
+	int trigs[2] = { 0, 0 };
+	Uint32 ticks[2] = { 0, 0 };
+	/* The scratch mesh is reused like a chunk's mesh is, so once it has 
+	 * grown a rebuild allocates nothing */
+	int allocs[2] = { 0, 0 };
+	int n_chunks = 0;
+
+	for(int greedy = 0; greedy < 2; greedy++){
+		Uint32 start = SDL_GetTicks();
+		int allocs_before = mesh_allocations();
+		linked_list_elm_t *elm = chunkmanager->loaded_chunks->head;
+		while(elm != NULL){
+			chunk_t *c = elm->data;
+			elm = elm->next;
+			if(c->active_blocks == 0)
+				continue;
+
+			mesh_clear(scratch);
+			mesh_source_fill(src, c);
+			if(greedy)
+				chunk_build_mesh_greedy(src, scratch, greedy_quads);
+			else
+				chunk_build_mesh_naive(src, scratch);
+			trigs[greedy] += 2 * scratch->n_quads;
+			if(!greedy)
+				n_chunks++;
+		}
+		ticks[greedy] = SDL_GetTicks() - start;
+		allocs[greedy] = mesh_allocations() - allocs_before;
 	}
+	mesh_free(scratch);
+	free(src);
+	free(greedy_quads);
+
+	/* Cost per emitted face, two triangles each */
+	double ns_per_face[2];
+	for(int i = 0; i < 2; i++)
+		ns_per_face[i] = trigs[i] > 0 ? ticks[i] * 1e6 / (trigs[i] / 2) : 0;
+
+	int n = n_chunks > 0 ? n_chunks : 1;
+	char *out = malloc(250);
+	snprintf(out, 250, "naive: %d trigs %u ms %.0f ns/face %.3f allocs/chunk greedy: %d trigs %u ms %.0f ns/face %.3f allocs/chunk", 
+			trigs[0], ticks[0], ns_per_face[0], (double) allocs[0] / n, trigs[1], ticks[1], ns_per_face[1], (double) allocs[1] / n);
+	return out;
+}
 
-	/* All verticies are outside the frustrum */
-	return 1;
+/* Toggle random blocks in the loaded chunks and back again, patching the 
+ * meshes. Compared with what rebuilding the chunk mesh would have cost */
+static char*
+editbench_execute(linked_list_t *args){
+	console_command_arg_t *arg = util_list_get(args, 0);
+	int n_edits = arg->intval;
+	char *out = malloc(200);
+
+	int n_chunks = 0;
+	chunk_t **chunks = malloc(util_list_size(chunkmanager->loaded_chunks) * sizeof(chunk_t*));
+	linked_list_elm_t *elm = chunkmanager->loaded_chunks->head;
+	while(elm != NULL){
+		chunk_t *c = elm->data;
+		if(c->active_blocks > 0)
+			chunks[n_chunks++] = c;
+		elm = elm->next;
+	}
+	if(n_chunks == 0 || n_edits <= 0){
+		free(chunks);
+		snprintf(out, 200, "Nothing to edit");
+		return out;
+	}
+
+	int n_patched = 0;
+	Uint32 start = SDL_GetTicks();
+	for(int e = 0; e < n_edits; e++){
+		chunk_t *c = chunks[rand() % n_chunks];
+		int x = rand() % CHUNK_SIZE;
+		int y = rand() % CHUNK_SIZE;
+		int z = rand() % CHUNK_SIZE;
+		block_t old = chunk_get_block(c, x, y, z);
+		block_t new = block_isactive(old) ? 0 : 0x80000000;
+		n_patched += chunk_edit_block(c, x, y, z, new);
+		n_patched += chunk_edit_block(c, x, y, z, old);
+	}
+	Uint32 patch_ticks = SDL_GetTicks() - start;
+
+	mesh_t *scratch = mesh_create();
+	mesh_source_t *src = malloc(sizeof(mesh_source_t));
+	start = SDL_GetTicks();
+	for(int e = 0; e < n_edits; e++){
+		chunk_t *c = chunks[rand() % n_chunks];
+		mesh_clear(scratch);
+		mesh_source_fill(src, c);
+		chunk_build_mesh_naive(src, scratch);
+	}
+	Uint32 rebuild_ticks = SDL_GetTicks() - start;
+	mesh_free(scratch);
+	free(src);
+	free(chunks);
+
+	snprintf(out, 200, "%d edits, %d patched: %.1f us/edit. Full rebuild: %.1f us/chunk",
+			2 * n_edits, n_patched, patch_ticks * 1e3 / (2 * n_edits), rebuild_ticks * 1e3 / n_edits);
+	return out;
 }
 
-static int
-is_chunk_behind_camera(chunk_t *chunk){
-	double point[3];
+/* Memory used by the loaded chunks' blocks and meshes */
+static char*
+memstats_execute(linked_list_t *args){
+	(void) args;
+	/* Chunks per index size: 1, 2, 4, 8 bits and full */
+	int n_bits[5] = { 0, 0, 0, 0, 0 };
+	int n_uniform = 0;
+	long storage = 0;
+	long mesh = 0;
+	int n_chunks = 0;
+
+	linked_list_elm_t *elm = chunkmanager->loaded_chunks->head;
+	while(elm != NULL){
+		chunk_t *c = elm->data;
+		elm = elm->next;
+		storage += block_storage_size(&c->blocks);
+		if(c->mesh != NULL)
+			mesh += (long) c->mesh->quad_capacity * 4 * sizeof(mesh_vertex_t);
+		switch(c->blocks.bits){
+		case 0: n_uniform++; break;
+		case 1: n_bits[0]++; break;
+		case 2: n_bits[1]++; break;
+		case 4: n_bits[2]++; break;
+		case 8: n_bits[3]++; break;
+		default: n_bits[4]++; break;
+		}
+		n_chunks++;
+	}
 
-	/* Enumerate all corners of the chunk */
-	for(int i = 0; i < 6; i++){
-		int num = i;
-		int a = num % 2; num /= 2;
-		int b = num % 2; num /= 2;
-		int c = num % 2;
-		point[0] = chunk->pos[0] + a * 2 * CHUNK_SIZE;
-		point[1] = chunk->pos[1] + b * 2 * CHUNK_SIZE;
-		point[2] = chunk->pos[2] + c * 2 * CHUNK_SIZE;
-
-		/* One vertex is in front of the camera */
-		if(!is_point_behind_camera(point))
-			return 0;
+	long flat = (long) n_chunks * MAX_ACTIVE_BLOCKS * sizeof(block_t);
+	char *out = malloc(200);
+	snprintf(out, 200, "%d chunks: blocks %ld KB (flat %ld KB) meshes %ld KB. uniform/1/2/4/8 bit/full: %d/%d/%d/%d/%d/%d",
+			n_chunks, storage / 1024, flat / 1024, mesh / 1024, n_uniform, n_bits[0], n_bits[1], n_bits[2], n_bits[3], n_bits[4]);
+	return out;
+}
+
+/* Fly along the x axis with every load and commit delayed by the given 
+ * number of milliseconds. The frames alternate in stretches between 
+ * loading on the I/O thread and waiting for each frame's loads, like 
+ * reading on the main thread did. Reports the frame times of both */
+static char*
+iobench_execute(linked_list_t *args){
+	console_command_arg_t *arg = util_list_get(args, 0);
+	int saved_latency = io.latency_ms;
+	int saved_sync = io_sync;
+	double saved_eye[3];
+	vec_cpy(saved_eye, camera->eye);
+
+	/* Away from the closer world edge, a new chunk every four frames */
+	double min_x = chunkmanager->world->min[0] * (2 * CHUNK_SIZE);
+	double max_x = chunkmanager->world->max[0] * (2 * CHUNK_SIZE);
+	double step = camera->eye[0] < (min_x + max_x) / 2 ? CHUNK_SIZE / 2.0 : -CHUNK_SIZE / 2.0;
+	double room = step > 0 ? max_x - camera->eye[0] : camera->eye[0] - min_x;
+	int n_frames = (int) fmin(240, room / fabs(step));
+
+	Uint32 total[2] = { 0, 0 };
+	Uint32 worst[2] = { 0, 0 };
+	int frames[2] = { 0, 0 };
+	io_set_latency(arg->intval);
+	for(int f = 0; f < n_frames; f++){
+		io_sync = f / 30 % 2;
+		camera->eye[0] += step;
+		Uint32 start = SDL_GetTicks();
+		chunkmanager_update();
+		Uint32 ms = SDL_GetTicks() - start;
+		total[io_sync] += ms;
+		if(ms > worst[io_sync])
+			worst[io_sync] = ms;
+		frames[io_sync]++;
 	}
+	io_set_latency(saved_latency);
+	io_sync = saved_sync;
+	vec_cpy(camera->eye, saved_eye);
+
+	char *out = malloc(200);
+	snprintf(out, 200, "%d ms latency, %d frames. I/O thread: avg %.1f max %u ms. Waiting for loads: avg %.1f max %u ms",
+			arg->intval, n_frames, frames[0] > 0 ? (double) total[0] / frames[0] : 0, worst[0], 
+			frames[1] > 0 ? (double) total[1] / frames[1] : 0, worst[1]);
+	return out;
+}
 
-	/* All verticies are behind the camera */
-	return 1;
+/* Leave out the chunks cut off from the camera by solid blocks, see 
+ * cave_cull. Read from the settings system */
+static int cave_culling = 1;
+/* Leave out the chunks hidden behind the solid blocks of nearer chunks, 
+ * see occlusion_cull. Read from the settings system */
+static int occlusion_culling = 1;
+
+static void update_render_list(void);
+
+/* Height of the top of the highest solid block at world position (x, z) */
+static double
+ground_height(double x, double z){
+	int bx = (int) floor(x / 2 + 0.5);
+	int bz = (int) floor(z / 2 + 0.5);
+	world_file_t *w = chunkmanager->world;
+	for(int by = w->max[1] * CHUNK_SIZE - 1; by >= w->min[1] * CHUNK_SIZE; by--){
+		chunk_t *c = chunkmanager_get_chunk(chunk_index_of_block(bx), chunk_index_of_block(by), chunk_index_of_block(bz));
+		if(c != NULL && block_isactive(chunk_get_block(c, chunk_block_offset(bx), chunk_block_offset(by), chunk_block_offset(bz))))
+			return 2 * by;
+	}
+	return 2 * w->min[1] * CHUNK_SIZE;
+}
+
+/* Fly the given number of frames from the camera along a fixed path, 
+ * two units above the ground and slowly turning, with everything on the 
+ * way loaded and meshed. Every frame the render list is made with 
+ * occlusion culling off and then on. Reports the chunks and triangles 
+ * drawn and the time update_render_list took, per frame */
+static char*
+occlusionbench_execute(linked_list_t *args){
+	console_command_arg_t *arg = util_list_get(args, 0);
+	int n_frames = arg->intval;
+	camera_t saved_camera = *camera;
+	int saved_occlusion = occlusion_culling;
+	double start[3];
+	vec_cpy(start, camera->eye);
+
+	double chunks[2] = { 0, 0 };
+	double trigs[2] = { 0, 0 };
+	double ms[2] = { 0, 0 };
+	for(int f = 0; f < n_frames; f++){
+		camera->eye[0] = start[0] + 1.5 * f;
+		camera->eye[2] = start[2] + 0.8 * f;
+		/* Clear of the blocks around the camera too */
+		double ground = 2 * chunkmanager->world->min[1] * CHUNK_SIZE;
+		for(int dx = -2; dx <= 2; dx++)
+			for(int dz = -2; dz <= 2; dz++)
+				ground = fmax(ground, ground_height(camera->eye[0] + 2 * dx, camera->eye[2] + 2 * dz));
+		camera->eye[1] = ground + 3;
+
+		double yaw = 0.02 * f, pitch = -0.1;
+		double forward[3] = { cos(yaw) * cos(pitch), sin(pitch), sin(yaw) * cos(pitch) };
+		double y[3] = { 0, 1, 0 };
+		double right[3], up[3];
+		crossproduct(right, forward, y);
+		normalize(right);
+		crossproduct(up, right, forward);
+		camera->forward.x = forward[0]; camera->forward.y = forward[1]; camera->forward.z = forward[2];
+		camera->up.x = up[0]; camera->up.y = up[1]; camera->up.z = up[2];
+
+		chunkmanager_update();
+		io_finish();
+		stream_complete(-1);
+		chunkmanager_finish_meshing();
+
+		for(int on = 0; on < 2; on++){
+			occlusion_culling = on;
+			/* Repeated, it takes well under a tick */
+			Uint32 begin = SDL_GetTicks();
+			for(int r = 0; r < 10; r++)
+				update_render_list();
+			ms[on] += (SDL_GetTicks() - begin) / 10.0;
+			cull_table_t *t = &chunkmanager->cull;
+			chunks[on] += chunkmanager->n_render;
+			for(int i = 0; i < chunkmanager->n_render; i++){
+				chunk_t *c = t->handles[t->visible[i]];
+				if(c->mesh != NULL)
+					trigs[on] += 2 * c->mesh->n_quads;
+			}
+		}
+	}
+	occlusion_culling = saved_occlusion;
+	*camera = saved_camera;
+
+	int n = n_frames > 0 ? n_frames : 1;
+	char *out = malloc(200);
+	snprintf(out, 200, "%d frames. Occlusion culling off: %.1f chunks %.0f triangles %.3f ms. On: %.1f chunks %.0f triangles %.3f ms",
+			n_frames, chunks[0] / n, trigs[0] / n, ms[0] / n, chunks[1] / n, trigs[1] / n, ms[1] / n);
+	return out;
+}
+
+static char*
+save_execute(linked_list_t *args){
+	(void) args;
+	char *out = malloc(200);
+	if(world_write_file(NULL) < 0)
+		snprintf(out, 200, "Could not start saving, see the log");
+	else
+		snprintf(out, 200, "Saving %s in the background", chunkmanager->world->path);
+	return out;
+}
+
+static char*
+saveas_execute(linked_list_t *args){
+	console_command_arg_t *arg = util_list_get(args, 0);
+	char *out = malloc(200);
+	if(world_write_file(arg->strval) < 0)
+		snprintf(out, 200, "Could not start saving, see the log");
+	else
+		snprintf(out, 200, "Saving a copy to %s in the background", arg->strval);
+	return out;
+}
+
+static void
+add_console_cmds(void){
+	meshstats_cmd = malloc(sizeof(console_command_t));
+	strcpy(meshstats_cmd->name, "meshstats");
+	meshstats_cmd->n_args = 0;
+	meshstats_cmd->execute = meshstats_execute;
+	console_add_command(meshstats_cmd);
+
+	editbench_cmd = malloc(sizeof(console_command_t));
+	strcpy(editbench_cmd->name, "editbench");
+	editbench_cmd->n_args = 1;
+	editbench_cmd->arg_types[0] = ARG_INT;
+	editbench_cmd->execute = editbench_execute;
+	console_add_command(editbench_cmd);
+
+	memstats_cmd = malloc(sizeof(console_command_t));
+	strcpy(memstats_cmd->name, "memstats");
+	memstats_cmd->n_args = 0;
+	memstats_cmd->execute = memstats_execute;
+	console_add_command(memstats_cmd);
+
+	iobench_cmd = malloc(sizeof(console_command_t));
+	strcpy(iobench_cmd->name, "iobench");
+	iobench_cmd->n_args = 1;
+	iobench_cmd->arg_types[0] = ARG_INT;
+	iobench_cmd->execute = iobench_execute;
+	console_add_command(iobench_cmd);
+
+	occlusionbench_cmd = malloc(sizeof(console_command_t));
+	strcpy(occlusionbench_cmd->name, "occlusionbench");
+	occlusionbench_cmd->n_args = 1;
+	occlusionbench_cmd->arg_types[0] = ARG_INT;
+	occlusionbench_cmd->execute = occlusionbench_execute;
+	console_add_command(occlusionbench_cmd);
+
+	save_cmd = malloc(sizeof(console_command_t));
+	strcpy(save_cmd->name, "save");
+	save_cmd->n_args = 0;
+	save_cmd->execute = save_execute;
+	console_add_command(save_cmd);
+
+	saveas_cmd = malloc(sizeof(console_command_t));
+	strcpy(saveas_cmd->name, "saveas");
+	saveas_cmd->n_args = 1;
+	saveas_cmd->arg_types[0] = ARG_STRING;
+	saveas_cmd->execute = saveas_execute;
+	console_add_command(saveas_cmd);
+}
+
+static void
+remove_console_cmds(void){
+	console_remove_command(meshstats_cmd);
+	free(meshstats_cmd);
+	console_remove_command(editbench_cmd);
+	free(editbench_cmd);
+	console_remove_command(memstats_cmd);
+	free(memstats_cmd);
+	console_remove_command(iobench_cmd);
+	free(iobench_cmd);
+	console_remove_command(occlusionbench_cmd);
+	free(occlusionbench_cmd);
+	console_remove_command(save_cmd);
+	free(save_cmd);
+	console_remove_command(saveas_cmd);
+	free(saveas_cmd);
+}
+
+void
+chunkmanager_init(world_file_t *world){
+	chunkmanager = malloc(sizeof(chunkmanager_t));
+	chunk_grid_init(&chunkmanager->grid);
+	chunk_grid_init(&chunkmanager->loading);
+	cull_table_init(&chunkmanager->cull);
+	chunkmanager->n_render = 0;
+	chunkmanager->loaded_chunks = util_list_create();
+	chunkmanager->dirty_chunks = util_list_create();
+	chunkmanager->modified_chunks = util_list_create();
+	chunkmanager->n_modified = 0;
+	chunkmanager->modified_since = 0;
+	chunkmanager->unsaved = 0;
+	chunkmanager->active_blocks = 0;
+	chunkmanager->n_trigs = 0;
+	chunkmanager->n_dirty = 0;
+	chunkmanager->frame_rebuilds = 0;
+	chunkmanager->frustum_culled = 0;
+	chunkmanager->cave_culled = 0;
+	chunkmanager->occlusion_culled = 0;
+	
+	chunkmanager->world = world;
+	chunkmanager->regions = world->version == WORLD_FILE_VERSION_REGIONS;
+
+	util_settings_getb("mesher/greedy", &mesher_greedy);
+	util_settings_getb("world/cave_culling", &cave_culling);
+	util_settings_getb("world/occlusion_culling", &occlusion_culling);
+	util_settings_geti("mesher/rebuild_budget_ms", &rebuild_budget_ms);
+	util_settings_geti("stream/load_radius", &stream_load_radius);
+	util_settings_geti("stream/unload_radius", &stream_unload_radius);
+	util_settings_geti("stream/prefetch_distance", &stream_prefetch_distance);
+	util_settings_geti("stream/loads_per_frame", &stream_loads_per_frame);
+	util_settings_geti("world/flush_interval_ms", &flush_interval_ms);
+	util_settings_geti("world/flush_blocks", &flush_blocks);
+	util_settings_geti("world/autosave_interval_s", &autosave_interval_s);
+	autosave_last = SDL_GetTicks();
+	if(stream_unload_radius < stream_load_radius)
+		stream_unload_radius = stream_load_radius;
+	mesher_init();
+	io_init(world);
+	add_console_cmds();
+
+	/* Everything around the camera is loaded up front, the rest is streamed in */
+	vec_cpy(stream_last_eye, camera->eye);
+	stream_direction[0] = 0; stream_direction[1] = 0; stream_direction[2] = 0;
+	stream_backlog = 1;
+	stream_update();
+	io_finish();
+	stream_complete(-1);
+	LOG_DEBUG("Loaded %d chunks around the camera", util_list_size(chunkmanager->loaded_chunks));
+}
+
+/* Queue every loaded chunk for meshing. The meshes show up over the next frames */
+void
+chunkmanager_rebuild(void){
+	linked_list_elm_t *elm;
+
+	elm = chunkmanager->loaded_chunks->head;
+	while(elm != NULL){
+		chunk_mark_dirty(elm->data);
+		elm = elm->next;
+	}
+
+	int n_queued = rebuild_dirty_chunks(-1);
+	LOG_DEBUG("Queued %d chunks for meshing", n_queued);
+}	
+
+void
+chunkmanager_render_world(void){
+	cull_table_t *t = &chunkmanager->cull;
+	for(int i = 0; i < chunkmanager->n_render; i++)
+		chunk_render(t->handles[t->visible[i]]);
 }
 
 static int
 is_chunk_surrounded(chunk_t *c){
-	chunk_t *front = chunkmanager_get_chunk(c->ix, c->iy, c->iz+1);
-	chunk_t *back = chunkmanager_get_chunk(c->ix, c->iy, c->iz-1);
-	chunk_t *top = chunkmanager_get_chunk(c->ix, c->iy+1, c->iz);
-	chunk_t *bottom = chunkmanager_get_chunk(c->ix, c->iy-1, c->iz);
-	chunk_t *left = chunkmanager_get_chunk(c->ix-1, c->iy, c->iz);
-	chunk_t *right = chunkmanager_get_chunk(c->ix+1, c->iy, c->iz);
+	chunk_t *front = c->neighbours[FACE_FRONT];
+	chunk_t *back = c->neighbours[FACE_BACK];
+	chunk_t *top = c->neighbours[FACE_TOP];
+	chunk_t *bottom = c->neighbours[FACE_BOTTOM];
+	chunk_t *left = c->neighbours[FACE_LEFT];
+	chunk_t *right = c->neighbours[FACE_RIGHT];
 
 	/* Don't render surrounded chunks */
 	int s = front != NULL && front->active_blocks == MAX_ACTIVE_BLOCKS &&
@@ -1156,107 +3687,306 @@ is_chunk_surrounded(chunk_t *c){
 	return 0;
 }
 
+/* Bring the cull table entry of c up to date. The box is taken from the 
+ * blocks, block i covering 2 i - 1 to 2 i + 1 */
+static void
+cull_update_chunk(chunk_t *c){
+	if(c->cull_index < 0)
+		return;
+	float min[3], max[3];
+	for(int a = 0; a < 3; a++){
+		min[a] = c->pos[a] + 2 * c->box_lo[a] - 1;
+		max[a] = c->pos[a] + 2 * c->box_hi[a] + 1;
+	}
+	int flags = is_chunk_surrounded(c) ? CULL_HIDDEN : 0;
+	cull_table_set(&chunkmanager->cull, c->cull_index, min, max, c->active_blocks, flags);
+}
+
+/* Update c and its neighbours, which may be hidden by c */
+static void
+cull_update_around(chunk_t *c){
+	cull_update_chunk(c);
+	for(int face = 0; face < 6; face++)
+		if(c->neighbours[face] != NULL)
+			cull_update_chunk(c->neighbours[face]);
+}
+
+/* Cave culling searches the chunks that can be seen breadth first from 
+ * the chunk of the camera, going from chunk to chunk through the faces 
+ * that air joins. A line of sight never turns back, so the search never 
+ * steps opposite to a step it took on the way. Where it can go from a 
+ * chunk depends on the face it came in through and the steps behind it, 
+ * so a chunk is searched again when it is reached through another face, 
+ * or by a path that rules out fewer directions. It skips chunks outside 
+ * the frustum or the radius. The chunks it doesn't reach are cut off by 
+ * solid blocks. Places without a loaded chunk count as air */
+typedef struct cave_step_s {
+	/* Index in cave_seen */
+	int cell;
+	/* Face the search came in through, -1 for the camera chunk */
+	int entry;
+} cave_step_t;
+
+/* Chunk not tested yet, in view and reached, or out of view */
+#define CAVE_UNTESTED 0
+#define CAVE_REACHED 1
+#define CAVE_OUT 2
+/* No path has come in through that face yet */
+#define CAVE_UNSEEN 0xff
+
+/* Chunks up to cave_reach chunks from the camera chunk on each axis are 
+ * searched, a cube of cave_side^3 with the camera chunk in the middle */
+static int cave_reach;
+static int cave_side;
+static int cave_origin[3];
+static Uint8 *cave_seen = NULL;
+/* For every chunk and entry face, 7 to a chunk with the camera chunk 
+ * first, the directions of the steps that every path in through it has 
+ * taken, a bit per face, and whether it is waiting in the queue */
+static Uint8 *cave_dirs = NULL;
+static Uint8 *cave_queued = NULL;
+/* A ring, each entry face of each chunk is in it once at most */
+static cave_step_t *cave_queue = NULL;
+
 static int
-should_chunk_be_rendered(chunk_t *c){
-	/* Don't render emtpy chunks */
-	if(c->active_blocks == 0)
+is_cave_cell_in_view(int cell[3], double planes[6][4]){
+	double lo[3], hi[3], d2 = 0;
+	for(int a = 0; a < 3; a++){
+		lo[a] = (cave_origin[a] + cell[a]) * (2 * CHUNK_SIZE) - 1;
+		hi[a] = lo[a] + 2 * CHUNK_SIZE;
+		double d = fmax(fmax(lo[a] - camera->eye[a], camera->eye[a] - hi[a]), 0);
+		d2 += d * d;
+	}
+	if(d2 >= CAMERA_RADIUS * CAMERA_RADIUS)
 		return 0;
 
-	return !is_chunk_surrounded(c) && !is_chunk_behind_camera(c) && !is_chunk_outside_2d_frustrum(c);
+	for(int i = 0; i < 6; i++){
+		double *p = planes[i];
+		double d = p[3];
+		for(int a = 0; a < 3; a++)
+			d += p[a] * (p[a] > 0 ? hi[a] : lo[a]);
+		if(d < 0)
+			return 0;
+	}
+	return 1;
 }
 
-static void
-update_render_list(void){
-	/* Nuke render list */
-	util_list_free(chunkmanager->render_chunks);
-	chunkmanager->render_chunks = util_list_create();
+/* Drop the chunks the search doesn't reach from the n_visible entries 
+ * of the render list. Returns how many are left */
+static int
+cave_cull(double planes[6][4], int n_visible){
+	if(cave_seen == NULL){
+		/* Chunks further than this are beyond the radius */
+		cave_reach = CAMERA_RADIUS / (2 * CHUNK_SIZE) + 2;
+		cave_side = 2 * cave_reach + 1;
+		cave_seen = malloc(cave_side * cave_side * cave_side);
+		cave_dirs = malloc(cave_side * cave_side * cave_side * 7);
+		cave_queued = malloc(cave_side * cave_side * cave_side * 7);
+		cave_queue = malloc(cave_side * cave_side * cave_side * 7 * sizeof(cave_step_t));
+	}
+	int n_slots = cave_side * cave_side * cave_side * 7;
+	memset(cave_seen, CAVE_UNTESTED, cave_side * cave_side * cave_side);
+	memset(cave_dirs, CAVE_UNSEEN, n_slots);
+	memset(cave_queued, 0, n_slots);
+	for(int a = 0; a < 3; a++)
+		cave_origin[a] = (int) floor((camera->eye[a] + 1) / (2 * CHUNK_SIZE)) - cave_reach;
+
+	int head = 0, n_queued = 0;
+	int start = (cave_reach * cave_side + cave_reach) * cave_side + cave_reach;
+	cave_seen[start] = CAVE_REACHED;
+	cave_dirs[start * 7] = 0;
+	cave_queued[start * 7] = 1;
+	cave_queue[0].cell = start;
+	cave_queue[0].entry = -1;
+	n_queued = 1;
+	while(n_queued > 0){
+		cave_step_t s = cave_queue[head];
+		head = (head + 1) % n_slots;
+		n_queued--;
+		int slot = s.cell * 7 + s.entry + 1;
+		cave_queued[slot] = 0;
+		int dirs = cave_dirs[slot];
+		int ind[3] = { s.cell / (cave_side * cave_side), s.cell / cave_side % cave_side, s.cell % cave_side };
+		chunk_t *c = chunkmanager_get_chunk(cave_origin[0] + ind[0], cave_origin[1] + ind[1], cave_origin[2] + ind[2]);
+		for(int face = 0; face < 6; face++){
+			if(dirs & (1 << face_opposite[face]))
+				continue;
+			if(s.entry >= 0 && c != NULL && !(c->face_links[s.entry] & (1 << face)))
+				continue;
+
+			int n[3] = { ind[0], ind[1], ind[2] };
+			int a = face_axis[face];
+			n[a] += face_dir[face];
+			if(n[a] < 0 || n[a] >= cave_side)
+				continue;
+			int cell = (n[0] * cave_side + n[1]) * cave_side + n[2];
+			if(cave_seen[cell] == CAVE_UNTESTED)
+				cave_seen[cell] = is_cave_cell_in_view(n, planes) ? CAVE_REACHED : CAVE_OUT;
+			if(cave_seen[cell] == CAVE_OUT)
+				continue;
+
+			/* Nothing new unless this path rules out less than the 
+			 * ones through the same face before it */
+			int next = cell * 7 + face_opposite[face] + 1;
+			int step_dirs = dirs | (1 << face);
+			int old = cave_dirs[next];
+			if(old != CAVE_UNSEEN && (old & step_dirs) == old)
+				continue;
+			cave_dirs[next] = old == CAVE_UNSEEN ? step_dirs : old & step_dirs;
+			if(cave_queued[next])
+				continue;
+			cave_queued[next] = 1;
+			int tail = (head + n_queued) % n_slots;
+			cave_queue[tail].cell = cell;
+			cave_queue[tail].entry = face_opposite[face];
+			n_queued++;
+		}
+	}
 
-	linked_list_elm_t *elm;
-	elm = chunkmanager->visible_chunks->head;
-	while(elm != NULL){
-		chunk_t *c = elm->data;
-		if(should_chunk_be_rendered(c))
-			util_list_add(chunkmanager->render_chunks, c);	
-		elm = elm->next;
+	cull_table_t *t = &chunkmanager->cull;
+	int kept = 0;
+	for(int j = 0; j < n_visible; j++){
+		chunk_t *c = t->handles[t->visible[j]];
+		int ind[3] = { c->ix - cave_origin[0], c->iy - cave_origin[1], c->iz - cave_origin[2] };
+		int inside = 1;
+		for(int a = 0; a < 3; a++)
+			inside = inside && ind[a] >= 0 && ind[a] < cave_side;
+		/* Outside the cube only by rounding, keep it */
+		if(!inside || cave_seen[(ind[0] * cave_side + ind[1]) * cave_side + ind[2]] == CAVE_REACHED)
+			t->visible[kept++] = t->visible[j];
 	}
+	return kept;
 }
 
-static int 
-inside_camera_radius(double pos[3]) {
-	double diff[3];
-	diff[0] = pos[0] - camera->eye[0];
-	diff[1] = pos[1] - camera->eye[1];
-	diff[2] = pos[2] - camera->eye[2];
-	return length(diff) < CAMERA_RADIUS;
+/* Drawn on the CPU every frame by occlusion_cull */
+static occlusion_buffer_t *occlusion = NULL;
+
+/* Go through the first n_render entries of the render list, nearest 
+ * first, dropping the chunks behind the occluders drawn so far and 
+ * drawing the occluder of every chunk kept. Returns how many are left */
+static int
+occlusion_cull(int n_render){
+	if(occlusion == NULL)
+		occlusion = malloc(sizeof(occlusion_buffer_t));
+	double proj[16], view[16], m[16];
+	camera_projection_matrix(proj);
+	camera_modelview_matrix(view);
+	mat_mult(m, proj, view);
+	occlusion_begin(occlusion, m, NEAR_PLANE);
+
+	cull_table_t *t = &chunkmanager->cull;
+	int kept = 0;
+	for(int j = 0; j < n_render; j++){
+		int i = t->visible[j];
+		float lo[3] = { t->min[0][i], t->min[1][i], t->min[2][i] };
+		float hi[3] = { t->max[0][i], t->max[1][i], t->max[2][i] };
+		if(occlusion_is_box_hidden(occlusion, lo, hi))
+			continue;
+		t->visible[kept++] = i;
+
+		chunk_t *c = t->handles[i];
+		for(int a = 0; a < 3; a++){
+			if(c->occluder_lo[a][a] > c->occluder_hi[a][a])
+				continue;
+			for(int b = 0; b < 3; b++){
+				lo[b] = c->pos[b] + 2 * c->occluder_lo[a][b] - 1;
+				hi[b] = c->pos[b] + 2 * c->occluder_hi[a][b] + 1;
+			}
+			occlusion_add_box(occlusion, lo, hi);
+		}
+	}
+	return kept;
 }
 
 static void
-update_visible_list(void) {
-	util_list_free(chunkmanager->visible_chunks);
-	chunkmanager->visible_chunks = util_list_create();
-	
-	linked_list_elm_t *elm;
-	elm = chunkmanager->loaded_chunks->head;
-	while(elm != NULL){
-		chunk_t *c = elm->data;
-		if(inside_camera_radius(c->pos)) 
-			util_list_add(chunkmanager->visible_chunks, c);
-		elm = elm->next;
+update_render_list(void){
+	double planes[6][4];
+	camera_frustum_planes(planes);
+	cull_stats_t stats;
+	int n = cull_table_visible(&chunkmanager->cull, planes, camera->eye, CAMERA_RADIUS, &stats);
+	chunkmanager->frustum_culled = stats.frustum;
+	chunkmanager->cave_culled = 0;
+	if(cave_culling){
+		int kept = cave_cull(planes, n);
+		chunkmanager->cave_culled = n - kept;
+		n = kept;
+	}
+	/* Front to back, so the depth test rejects the hidden fragments 
+	 * before they are shaded, and occluders come before what they hide */
+	cull_table_sort_visible(&chunkmanager->cull, n, camera->eye);
+	chunkmanager->occlusion_culled = 0;
+	if(occlusion_culling){
+		int kept = occlusion_cull(n);
+		chunkmanager->occlusion_culled = n - kept;
+		n = kept;
 	}
+	chunkmanager->n_render = n;
 }
 
+/* Write the edited chunks back when it is time, or right away with force */
 static void
-write_modified(void){
+write_modified(int force){
+	if(chunkmanager->n_modified == 0)
+		return;
+	if(!force && chunkmanager->n_modified < flush_blocks && 
+			(int)(SDL_GetTicks() - chunkmanager->modified_since) < flush_interval_ms)
+		return;
+
 	linked_list_elm_t *elm;
-	elm = chunkmanager->loaded_chunks->head;
+	elm = chunkmanager->modified_chunks->head;
 	while(elm != NULL){
-		chunk_t *c = elm->data;
-		if(c->modified)
-			world_update_chunk(chunkmanager->world, c);
+		io_store_chunk(elm->data);
 		elm = elm->next;
 	}
-}
-
-int 
-has_camera_moved(void) {
-	static int first = 1;
-	static double oldeye[3] = { 0 };
-
-	if(first){
-		first = 0;
-		vec_cpy(oldeye, camera->eye);
-		return 1;
-	}
-
-	/* Same position? */
-	if(oldeye[0] == camera->eye[0] &&
-	    oldeye[1] == camera->eye[1] &&
-	    oldeye[2] == camera->eye[2]){
-		return 0;
-	}else{
-		vec_cpy(oldeye, camera->eye);
-		return 1;
-	}
+	util_list_free(chunkmanager->modified_chunks);
+	chunkmanager->modified_chunks = util_list_create();
+	chunkmanager->n_modified = 0;
+	io_commit();
 }
 
 void
 chunkmanager_update(void){
-	if(has_camera_moved())
-		update_visible_list();
+	stream_update();
+	if(io_sync)
+		io_wait_loads(stream_loads_per_frame);
+	stream_complete(stream_loads_per_frame);
 	update_render_list();
-	write_modified();
+	write_modified(0);
+	save_update();
+	chunkmanager->frame_rebuilds = rebuild_dirty_chunks(rebuild_budget_ms);
+	mesher_upload(mesher_upload_budget);
 }
 
 void
 chunkmanager_free(void){
+	remove_console_cmds();
+	mesher_free();
+	write_modified(1);
+	save_finish();
+	io_free();
+	util_list_free(chunkmanager->modified_chunks);
+	util_list_free(chunkmanager->dirty_chunks);
 	util_list_free_custom(chunkmanager->loaded_chunks, chunk_free);
-	util_list_free(chunkmanager->render_chunks);
+	chunk_grid_free(&chunkmanager->grid);
+	chunk_grid_free(&chunkmanager->loading);
+	cull_table_free(&chunkmanager->cull);
+	free(cave_seen);
+	free(cave_dirs);
+	free(cave_queued);
+	free(cave_queue);
+	cave_seen = NULL;
+	cave_dirs = NULL;
+	cave_queued = NULL;
+	cave_queue = NULL;
+	free(occlusion);
+	occlusion = NULL;
 	free(chunkmanager);
+	mesh_cleanup();
 }
 
 int
 chunkmanager_nchunks(void){
-	return util_list_size(chunkmanager->render_chunks);
+	return chunkmanager->n_render;
 }
 
 int 
@@ -1269,6 +3999,39 @@ chunkmanager_ntrigs(void){
 	return chunkmanager->n_trigs;
 }
 
+int
+chunkmanager_ndirty(void){
+	return chunkmanager->n_dirty;
+}
+
+int
+chunkmanager_nqueued(void){
+	SDL_LockMutex(mesher.lock);
+	int n = util_pqueue_size(mesher.pending) + mesher.n_busy;
+	SDL_UnlockMutex(mesher.lock);
+	return n;
+}
+
+int
+chunkmanager_frame_rebuilds(void){
+	return chunkmanager->frame_rebuilds;
+}
+
+int
+chunkmanager_frustum_culled(void){
+	return chunkmanager->frustum_culled;
+}
+
+int
+chunkmanager_cave_culled(void){
+	return chunkmanager->cave_culled;
+}
+
+int
+chunkmanager_occlusion_culled(void){
+	return chunkmanager->occlusion_culled;
+}
+
 static GLuint
 load_cubemap(char *dir){
 	GLuint textureId;
@@ -1331,9 +4094,13 @@ skybox_init(void){
 }
 STARTUP_PROC(skybox, 7, skybox_init)
 
+/* Drawn after the world, squashed onto the far plane, so it only 
+ * covers the pixels the world left empty */
 void
 skybox_render(void){
+	glDepthRange(1.0, 1.0);
 	renderblock_with_textures(camera->eye[0], camera->eye[1], camera->eye[2], world_skybox->textureId);
+	glDepthRange(0.0, 1.0);
 }
 
 void
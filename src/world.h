@@ -20,76 +20,193 @@
 #include <GLee.h>
 
 #include "util.h"
-
-typedef Uint32 block_t;
+#include "worldfile.h"
 
 #define block_isactive(block) ((block & 0x80000000) >> 31)  
 #define block_type(block) ( block & 0x70000000 )
+/* The block type as a number from 0 to BLOCK_TYPES - 1 */
+#define block_type_index(block) ( (block & 0x70000000) >> 28 )
+#define BLOCK_TYPES 8
 
 #define CHUNK_SIZE 16
 #define MAX_ACTIVE_BLOCKS ( CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE )
 
+/* Packed chunk vertex. Positions are in whole units relative to the 
+ * chunk, texture coordinates in texels. 16 bytes */
+typedef struct mesh_vertex_s {
+	GLshort pos[3];
+	GLshort uv[2];
+	GLbyte normal[3];
+	GLubyte color[3];
+} mesh_vertex_t;
+
+/* Limited by the 16 bit indicies of the shared quad index buffer */
+#define MESH_MAX_QUADS (65536 / 4)
+
+/* A range of quads drawn with one sub texture */
+typedef struct mesh_batch_s {
+	int tex_ind;
+	int first_quad;
+} mesh_batch_t;
+
+/* A mesh made only of quads, four verticies each. Drawn with an index 
+ * buffer shared by all meshes */
 typedef struct mesh_s {
-	linked_list_t *vertex_list;
-	int n_verticies;
-	linked_list_t *trig_list;
-	int n_trigs;
-	GLuint elementId, vertexId;
+	/* Vertex data, grown geometrically and reused between rebuilds */
+	mesh_vertex_t *verticies;
+	int n_quads;
+	int quad_capacity;
+	/* Texture batches. A mesh without batches is drawn with the texture atlas */
+	mesh_batch_t *batches;
+	int n_batches;
+	int batch_capacity;
+	GLuint vertexId;
+	/* Quads the GL buffer has room for */
+	int gl_quads;
 } mesh_t;
 
 mesh_t* mesh_create(void);
-int mesh_add_vertex(mesh_t *m, float p[3], float c[3], float n[3], float t[2]);
-void mesh_add_trig(mesh_t *m, GLuint ind1, GLuint ind2, GLuint ind3);
+/* Returns the four verticies of a new quad for the caller to fill in */
+mesh_vertex_t* mesh_add_quad(mesh_t *m);
+/* Quads added after this call are drawn with the repeating sub texture tex_ind */
+void mesh_begin_batch(mesh_t *m, int tex_ind);
+/* Forget all quads but keep the allocated storage */
+void mesh_clear(mesh_t *m);
 void mesh_rebuild(mesh_t *m);
+/* Upload n_quads quads starting at first_quad after they were changed in place */
+void mesh_update_quads(mesh_t *m, int first_quad, int n_quads);
 void mesh_render(mesh_t *m);
 void mesh_free(void *p);
+/* Release the shared index buffer */
+void mesh_cleanup(void);
+/* Total number of heap allocations made by the mesh code so far */
+int mesh_allocations(void);
+
+/* Index size of block storage without a palette */
+#define BLOCK_STORAGE_FULL 32
+
+/* The blocks of a chunk, (x, y, z) stored at (x * CHUNK_SIZE + y) * CHUNK_SIZE + z. 
+ * Stored as a single value if all blocks are equal, as bit packed indices 
+ * into a palette of the distinct block values or, for chunks with more 
+ * than 256 distinct values, as plain blocks */
+typedef struct block_storage_s {
+	/* Bits per index: 0, 1, 2, 4, 8 or BLOCK_STORAGE_FULL. With 0 bits 
+	 * every block is uniform and nothing is allocated */
+	int bits;
+	int palette_size;
+	block_t uniform;
+	/* Room for 1 << bits entries. Unused without a palette */
+	block_t *palette;
+	Uint32 *data;
+	/* Set while a save shares palette and data. Points at a flag of the 
+	 * save that tells it they became its own when the storage changed */
+	int *shared;
+} block_storage_t;
+
+void block_storage_init(block_storage_t *s);
+void block_storage_free(block_storage_t *s);
+block_t block_storage_get(block_storage_t *s, int i);
+void block_storage_set(block_storage_t *s, int i, block_t block);
+/* Replace the contents with MAX_ACTIVE_BLOCKS blocks, leaving room for n_spare more distinct values */
+void block_storage_pack(block_storage_t *s, const block_t *blocks, int n_spare);
+void block_storage_unpack(block_storage_t *s, block_t *out);
+/* Bytes used by the storage */
+int block_storage_size(block_storage_t *s);
+/* Let a save keep the palette and data of s as they are now in copy. 
+ * They are left to the save and s gets its own the first time it 
+ * changes, setting *owned. Clear s->shared if the save ends first */
+void block_storage_share(block_storage_t *s, block_storage_t *copy, int *owned);
 
 typedef struct chunk_s {
 	/* Position of origo in world coordinates */
 	double pos[3]; 
 	/* Chunk position in chunk coordinates */
 	int ix, iy, iz;
-	block_t blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	block_storage_t blocks;
+	/* NULL while there is nothing to draw */
 	mesh_t *mesh;
+	/* Blocks edited since the chunk was last written back */
 	int modified;
-	linked_list_t *modified_list;					
+	/* A bit per block edited since the last write back, in storage order. 
+	 * Created on the first edit */
+	Uint32 *modified_bits;
 	int active_blocks;
+	/* Blocks lo to hi, inclusive, hold every active block of the mesh. 
+	 * Culling tests this box. lo is above hi without active blocks */
+	int box_lo[3];
+	int box_hi[3];
+	/* Entry in the cull table of the chunkmanager, -1 if not loaded */
+	int cull_index;
+	/* Faces of the chunk joined by air through it, bit g of face_links[f] 
+	 * for faces f and g. All set until the chunk is first meshed */
+	Uint8 face_links[6];
+	/* Blocks occluder_lo[a] to occluder_hi[a], inclusive, are a slab of 
+	 * solid blocks across axis a. Occlusion culling draws them to hide 
+	 * what is behind the chunk. lo is above hi on axis a for none */
+	int occluder_lo[3][3];
+	int occluder_hi[3][3];
+	/* Set while the chunk is waiting in the dirty list */
+	int dirty;
+	/* Bumped every time the chunk is queued for meshing */
+	int mesh_generation;
+	/* Generation of the mesh on the GPU */
+	int mesh_uploaded_generation;
+	/* Face index of the mesh for patching single block edits. Built on the first edit */
+	struct mesh_patch_s *patch;
+	/* Loaded neighbours in face order: front, back, top, bottom, left, right */
+	struct chunk_s *neighbours[6];
+	/* Mesh jobs of the chunk being built right now. Guarded by the mesher lock */
+	int meshing;
+	/* Queued mesh job that hasn't been picked up by a mesher thread yet */
+	struct mesh_job_s *pending_job;
 } chunk_t;
 
 chunk_t* chunk_create(void);
+/* Queue the chunk for meshing on a mesher thread */
 void chunk_rebuild(chunk_t *chunk);
+/* Rebuild the chunk during the next chunkmanager_update */
+void chunk_mark_dirty(chunk_t *chunk);
 void chunk_render(chunk_t *chunk);
 void chunk_free(void *p);
+block_t chunk_get_block(chunk_t *c, int x, int y, int z);
+/* Store a block without updating the mesh or marking it modified */
+void chunk_set_block(chunk_t *c, int x, int y, int z, block_t block);
 void chunk_add_modified_block(chunk_t *chunk, int ix, int iy, int iz);
+/* The chunk holding world block coordinate w along an axis, and the 
+ * coordinate of the block within that chunk. Both round down, so they 
+ * work for negative coordinates too */
+int chunk_index_of_block(int w);
+int chunk_block_offset(int w);
 /* Remove the block with world block coordinates (w_x, w_y, w_z) */
 void chunk_remove_block(chunk_t *c, int w_x, int w_y, int w_z);
 void chunk_add_block(chunk_t *c, Uint32 block_type, int w_x, int w_y, int w_z);
 
-#define WORLD_FILE_MAGIC_NUMBER 274263364
-
-typedef struct world_file_s {
-	/* Input */
-	char *path;
-	/* Output */
-	Uint32 size[3]; /* Size in blocks */
-	/* Internal */
-	FILE *file;
-} world_file_t;
-
-int world_open(world_file_t *f);
-int world_read_chunk(world_file_t *f, int x, int y, int z, chunk_t *chunk);
-/* Push the modified part of chunk to disk */
-void world_update_chunk(world_file_t *f, chunk_t *chunk);
-/* (Re-)write the entire world file to disk. */
-void world_write_file(world_file_t *f);
+/* Start writing the whole world to path, or over the world file if path 
+ * is NULL, in the background. Returns -1 if that isn't possible now */
+int world_write_file(char *path);
 
 void chunkmanager_init(world_file_t *f);
 void chunkmanager_rebuild(void);
+/* Wait for the mesher threads and upload every finished mesh */
+void chunkmanager_finish_meshing(void);
 void chunkmanager_render_world(void);
 void chunkmanager_free(void);
 int chunkmanager_nchunks(void);
 int chunkmanager_activeblocks(void);
 int chunkmanager_ntrigs(void);
+/* Chunks waiting to be rebuilt */
+int chunkmanager_ndirty(void);
+/* Chunks waiting for or being meshed by the mesher threads */
+int chunkmanager_nqueued(void);
+/* Chunks rebuilt by the last chunkmanager_update */
+int chunkmanager_frame_rebuilds(void);
+/* Chunks outside the view frustum when the render list was last made */
+int chunkmanager_frustum_culled(void);
+/* Chunks in the view frustum but cut off by solid blocks, found by cave 
+ * culling when the render list was last made */
+int chunkmanager_cave_culled(void);
+/* And by occlusion culling, behind the solid blocks of nearer chunks */
+int chunkmanager_occlusion_culled(void);
 chunk_t* chunkmanager_get_chunk(int, int, int);
 void chunkmanager_update(void);
 
@@ -105,8 +222,16 @@ void skybox_cleanup(void);
 void textureset_init(void);
 GLuint textureset_current_atlas(void);
 void textureset_free(void);
-GLfloat* textureset_texcoords(Uint32 block_type, int face, int vert);
+/* Atlas texel coordinates of a face corner. Points into a table baked by textureset_init */
+GLshort* textureset_texcoords(Uint32 block_type, int face, int vert);
+/* Index of the sub texture used for a face of a block type */
+int textureset_texture_index(Uint32 block_type, int face);
+int textureset_ntextures(void);
+/* A texture holding only sub texture tex_ind, set to repeat */
+GLuint textureset_tile_texture(int tex_ind);
+/* Bind the atlas or a repeating sub texture. Texture coordinates are given in texels */
 void textureset_bind(void);
+void textureset_bind_tile(int tex_ind);
 void textureset_unbind(void);
 
 /* Misc utility */
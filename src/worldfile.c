@@ -0,0 +1,1838 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+/* mmap, pread and friends */
+#define _POSIX_C_SOURCE 200809L
+/* Worlds can be bigger than 2 GB on 32 bit systems too */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <SDL/SDL.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define world_fseek fseeko
+#define world_ftell ftello
+#else
+#include <io.h>
+#define world_fseek fseeko64
+#define world_ftell ftello64
+#endif
+
+#include "util.h"
+#include "worldfile.h"
+
+#define WORLD_V2_HEADER_SIZE (6 * sizeof(Uint32))
+#define WORLD_V3_HEADER_SIZE (9 * sizeof(Uint32))
+/* A payload is never bigger than the encoding and the raw blocks */
+#define WORLD_PAYLOAD_MAX (sizeof(Uint32) + WORLD_CHUNK_BLOCKS * sizeof(block_t))
+/* Room to encode a payload in, runs can take more than the raw blocks */
+#define WORLD_ENCODE_MAX (sizeof(Uint32) + WORLD_CHUNK_BLOCKS * WORLD_RLE_RUN_SIZE)
+/* A run is a Uint16 count and a Uint32 block */
+#define WORLD_RLE_RUN_SIZE 6
+
+/* "WRR1" */
+#define WORLD_REGION_MAGIC 0x31525257
+#define WORLD_REGION_HEADER_SIZE (5 * sizeof(Uint32))
+#define WORLD_REGION_CHUNKS (WORLD_REGION_COLUMNS * WORLD_REGION_HEIGHT * WORLD_REGION_COLUMNS)
+/* Regions kept open. The least recently used is closed to make room */
+#define WORLD_OPEN_REGIONS 64
+
+/* "WJR1". A journal record is this magic number, the payload length and 
+ * the CRC-32 of the payload as Uint32s followed by the payload. The 
+ * payload is a list of chunk edits, each the chunk x, y and z and the 
+ * number of runs as Uint32s followed by the runs. A run is the index of 
+ * its first block in storage order and its length as Uint16s followed 
+ * by the blocks */
+#define WORLD_JOURNAL_MAGIC 0x31524a57
+#define WORLD_JOURNAL_HEADER_SIZE (3 * sizeof(Uint32))
+#define WORLD_MASK_WORDS (WORLD_CHUNK_BLOCKS / 32)
+/* How long the checkpointer waits to try again after failing to write, 
+ * unless something is committed sooner */
+#define WORLD_CHECKPOINT_RETRY_MS 1000
+
+/* A stretch of a file */
+typedef struct world_extent_s {
+	Sint64 offset;
+	Sint64 length;
+} world_extent_t;
+
+/* Space in a version 2 file or a region file that no payload uses, 
+ * sorted by offset. Payloads replaced by a checkpoint wait in deferred 
+ * until the entries that replaced them are on disk. Not stored, found 
+ * again between the payloads when the file is opened */
+typedef struct world_space_s {
+	world_extent_t *free;
+	int n_free;
+	int free_capacity;
+	world_extent_t *deferred;
+	int n_deferred;
+	int deferred_capacity;
+} world_space_t;
+
+/* A region of a version 3 world. file is NULL if the region has no file 
+ * yet, then all its chunks are air */
+typedef struct world_region_s {
+	int r[3];
+	FILE *file;
+	Uint8 *map;
+	Sint64 map_size;
+	world_chunk_entry_t *table;
+	world_space_t space;
+	Sint64 end;
+	/* Written since the last sync */
+	int dirty;
+	Uint32 last_use;
+} world_region_t;
+
+/* Committed edits of one chunk that aren't in the world file yet */
+typedef struct world_pending_s {
+	int x, y, z;
+	Uint32 mask[WORLD_MASK_WORDS];
+	block_t blocks[WORLD_CHUNK_BLOCKS];
+	/* Set by world_checkpoint once the edits are in the world file */
+	int done;
+	/* Set once a version 2 or 3 payload with the edits is written, entry 
+	 * is the table entry pointing at it to store once it is on disk */
+	int staged;
+	world_chunk_entry_t entry;
+} world_pending_t;
+
+struct world_journal_s {
+	char *path;
+	/* Opened by the first commit or by replay */
+	FILE *file;
+	Sint64 end;
+	/* Edits journaled since the last commit. The record header goes first */
+	Uint8 *batch;
+	long batch_size;
+	long batch_capacity;
+
+	/* Guarded by the world file lock. Committed edits wait in pending 
+	 * until the checkpointer moves them to checkpointing and writes them 
+	 * into the world file. Reads of chunks in either list have the edits 
+	 * applied on top */
+	linked_list_t *pending;
+	linked_list_t *checkpointing;
+	int n_commits;
+	/* Set while world_commit appends to the journal without the lock. The 
+	 * checkpointer leaves the journal alone meanwhile */
+	int appending;
+	int quit;
+	/* Set between world_freeze and world_thaw, the checkpointer waits meanwhile */
+	int frozen;
+	/* Set while the checkpointer is writing into the world file */
+	int busy;
+	SDL_cond *work;
+	/* Signaled when the checkpointer is done writing */
+	SDL_cond *idle;
+	SDL_Thread *thread;
+};
+
+static void world_journal_init(world_file_t *f);
+static void world_journal_replay(world_file_t *f);
+static void world_journal_close(world_file_t *f);
+static int world_checkpointer(void *data);
+
+/* Index of a chunk in a version 1 or 2 file */
+static Sint64
+world_chunk_index(world_file_t *f, int x, int y, int z){
+	Sint64 ny = f->size[1] / WORLD_CHUNK_SIZE;
+	Sint64 nz = f->size[2] / WORLD_CHUNK_SIZE;
+	return z + y * nz + x * nz * ny;
+}
+
+static Sint64
+world_n_chunks(world_file_t *f){
+	return (Sint64) (f->size[0] / WORLD_CHUNK_SIZE) * (f->size[1] / WORLD_CHUNK_SIZE) * (f->size[2] / WORLD_CHUNK_SIZE);
+}
+
+/* Where the chunk starts in a version 1 file */
+static Sint64
+world_chunk_offset(world_file_t *f, int x, int y, int z){
+	return (4 + world_chunk_index(f, x, y, z) * WORLD_CHUNK_BLOCKS) * sizeof(Uint32);
+}
+
+static int
+world_in_bounds(world_file_t *f, int x, int y, int z){
+	return x >= f->min[0] && x < f->max[0] && y >= f->min[1] && y < f->max[1] && 
+		z >= f->min[2] && z < f->max[2];
+}
+
+/* Read or write len bytes at offset without moving the stdio stream. 
+ * Return 0 on success */
+static int
+world_pread(FILE *file, void *buf, long len, Sint64 offset){
+#ifndef WIN32
+	int fd = fileno(file);
+	while(len > 0){
+		ssize_t n = pread(fd, buf, len, offset);
+		if(n <= 0)
+			return -1;
+		buf = (Uint8 *) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+#else
+	if(world_fseek(file, offset, SEEK_SET) < 0)
+		return -1;
+	return fread(buf, 1, len, file) == (size_t) len ? 0 : -1;
+#endif
+}
+
+static int
+world_pwrite(FILE *file, const void *buf, long len, Sint64 offset){
+#ifndef WIN32
+	int fd = fileno(file);
+	while(len > 0){
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if(n <= 0)
+			return -1;
+		buf = (const Uint8 *) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+#else
+	if(world_fseek(file, offset, SEEK_SET) < 0)
+		return -1;
+	return fwrite(buf, 1, len, file) == (size_t) len ? 0 : -1;
+#endif
+}
+
+Sint64
+world_file_size(FILE *file){
+	world_fseek(file, 0, SEEK_END);
+	return world_ftell(file);
+}
+
+/* Wait until everything written to file is on disk. Return 0 on success */
+static int
+world_sync(FILE *file){
+	if(fflush(file) != 0)
+		return -1;
+#ifndef WIN32
+	return fsync(fileno(file));
+#else
+	return _commit(_fileno(file));
+#endif
+}
+
+static void
+world_truncate(FILE *file, Sint64 size){
+	fflush(file);
+#ifndef WIN32
+	if(ftruncate(fileno(file), size) < 0)
+		LOG_WARN("Could not truncate file");
+#else
+	if(_chsize_s(_fileno(file), size) != 0)
+		LOG_WARN("Could not truncate file");
+#endif
+}
+
+/* Map file read only. map stays NULL if that isn't possible */
+static void
+world_map(FILE *file, char *path, Uint8 **map, Sint64 *map_size){
+#ifndef WIN32
+	struct stat st;
+	int fd = fileno(file);
+	if(fstat(fd, &st) < 0 || st.st_size == 0)
+		return;
+
+	/* Shared, so blocks written through file show up in the mapping */
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(m == MAP_FAILED){
+		LOG_DEBUG("Could not map %s, reading through stdio", path);
+		return;
+	}
+	*map = m;
+	*map_size = st.st_size;
+#else
+	(void) file; (void) path; (void) map; (void) map_size;
+#endif
+}
+
+static void
+world_unmap(Uint8 *map, Sint64 map_size){
+#ifndef WIN32
+	if(map != NULL)
+		munmap(map, map_size);
+#endif
+}
+
+static void
+world_extent_add(world_extent_t **list, int *n, int *capacity, int at, Sint64 offset, Sint64 length){
+	if(*n == *capacity){
+		*capacity = *capacity > 0 ? 2 * *capacity : 64;
+		*list = realloc(*list, *capacity * sizeof(world_extent_t));
+		if(*list == NULL)
+			FATAL_ERROR("Out of memory");
+	}
+	memmove(*list + at + 1, *list + at, (*n - at) * sizeof(world_extent_t));
+	(*list)[at].offset = offset;
+	(*list)[at].length = length;
+	(*n)++;
+}
+
+static void
+world_extent_remove(world_extent_t *list, int *n, int at){
+	memmove(list + at, list + at + 1, (*n - at - 1) * sizeof(world_extent_t));
+	(*n)--;
+}
+
+/* Make length bytes at offset free, joined with the free space next to them */
+static void
+world_space_free(world_space_t *s, Sint64 offset, Sint64 length){
+	if(length <= 0)
+		return;
+	/* From the back, the gaps are found in order when a file is opened */
+	int i = s->n_free;
+	while(i > 0 && s->free[i - 1].offset > offset)
+		i--;
+	if(i > 0 && s->free[i - 1].offset + s->free[i - 1].length == offset){
+		s->free[i - 1].length += length;
+		if(i < s->n_free && offset + length == s->free[i].offset){
+			s->free[i - 1].length += s->free[i].length;
+			world_extent_remove(s->free, &s->n_free, i);
+		}
+	}else if(i < s->n_free && offset + length == s->free[i].offset){
+		s->free[i].offset = offset;
+		s->free[i].length += length;
+	}else{
+		world_extent_add(&s->free, &s->n_free, &s->free_capacity, i, offset, length);
+	}
+}
+
+/* Find room for length bytes, the first free space it fits in or the end 
+ * of the file, which is end */
+static Sint64
+world_space_alloc(world_space_t *s, Sint64 *end, Sint64 length){
+	for(int i = 0; i < s->n_free; i++){
+		world_extent_t *e = &s->free[i];
+		if(e->length >= length){
+			Sint64 offset = e->offset;
+			e->offset += length;
+			e->length -= length;
+			if(e->length == 0)
+				world_extent_remove(s->free, &s->n_free, i);
+			return offset;
+		}
+	}
+	Sint64 offset = *end;
+	*end += length;
+	return offset;
+}
+
+/* Take length bytes at offset out of the free space, if they are in it */
+static void
+world_space_take(world_space_t *s, Sint64 offset, Sint64 length){
+	for(int i = 0; i < s->n_free; i++){
+		world_extent_t e = s->free[i];
+		if(offset >= e.offset && offset + length <= e.offset + e.length){
+			s->free[i].length = offset - e.offset;
+			if(s->free[i].length == 0)
+				world_extent_remove(s->free, &s->n_free, i);
+			world_space_free(s, offset + length, e.offset + e.length - offset - length);
+			return;
+		}
+	}
+}
+
+/* Hold length bytes at offset back until world_space_release */
+static void
+world_space_defer(world_space_t *s, Sint64 offset, Sint64 length){
+	if(length > 0)
+		world_extent_add(&s->deferred, &s->n_deferred, &s->deferred_capacity, 
+				s->n_deferred, offset, length);
+}
+
+static void
+world_space_release(world_space_t *s){
+	for(int i = 0; i < s->n_deferred; i++)
+		world_space_free(s, s->deferred[i].offset, s->deferred[i].length);
+	s->n_deferred = 0;
+}
+
+/* Cut the free space at the end of file off, end is its size. Returns 1 
+ * if there was any */
+static int
+world_space_trim(world_space_t *s, FILE *file, Sint64 *end){
+	if(s->n_free == 0)
+		return 0;
+	world_extent_t *last = &s->free[s->n_free - 1];
+	if(last->offset + last->length < *end)
+		return 0;
+	*end = last->offset;
+	s->n_free--;
+	world_truncate(file, *end);
+	return 1;
+}
+
+static void
+world_space_clear(world_space_t *s){
+	free(s->free);
+	free(s->deferred);
+	memset(s, 0, sizeof(world_space_t));
+}
+
+static int
+world_extent_cmp(const void *a, const void *b){
+	Sint64 oa = ((const world_extent_t *) a)->offset;
+	Sint64 ob = ((const world_extent_t *) b)->offset;
+	return oa < ob ? -1 : oa > ob;
+}
+
+/* Free space is every gap between the payloads of the n entries of 
+ * table, the first starting at start. Past the last payload new ones go 
+ * at the end of the file as usual */
+static void
+world_space_build(world_space_t *s, const world_chunk_entry_t *table, Sint64 n, Sint64 start){
+	world_extent_t *used = malloc((n > 0 ? n : 1) * sizeof(world_extent_t));
+	if(used == NULL)
+		FATAL_ERROR("Out of memory");
+	Sint64 n_used = 0;
+	for(Sint64 i = 0; i < n; i++){
+		if(table[i].capacity > 0 && (Sint64) table[i].offset >= start){
+			used[n_used].offset = table[i].offset;
+			used[n_used].length = table[i].capacity;
+			n_used++;
+		}
+	}
+	qsort(used, n_used, sizeof(world_extent_t), world_extent_cmp);
+
+	Sint64 pos = start;
+	for(Sint64 i = 0; i < n_used; i++){
+		if(used[i].offset > pos)
+			world_space_free(s, pos, used[i].offset - pos);
+		if(used[i].offset + used[i].length > pos)
+			pos = used[i].offset + used[i].length;
+	}
+	free(used);
+}
+
+static int
+world_check_size(world_file_t *f){
+	if(f->size[0] % WORLD_CHUNK_SIZE != 0){
+		LOG_DEBUG("Aborting. World length must be multiple of CHUNK_SIZE=%d", WORLD_CHUNK_SIZE);
+		return -1;
+	}
+	if((f->size[1] % WORLD_CHUNK_SIZE) != 0){
+		LOG_DEBUG("Aborting. World height must be multiple of CHUNK_SIZE=%d", WORLD_CHUNK_SIZE);
+		return -1;
+	}
+	if((f->size[2] % WORLD_CHUNK_SIZE) != 0){
+		LOG_DEBUG("Aborting. World width must be multiple of CHUNK_SIZE=%d", WORLD_CHUNK_SIZE);
+		return -1;
+	}
+	for(int a = 0; a < 3; a++){
+		f->min[a] = 0;
+		f->max[a] = f->size[a] / WORLD_CHUNK_SIZE;
+	}
+	return 0;
+}
+
+/* The size follows the bounds of a version 3 world */
+static void
+world_bounds_size(world_file_t *f){
+	for(int a = 0; a < 3; a++)
+		f->size[a] = (f->max[a] - f->min[a]) * WORLD_CHUNK_SIZE;
+}
+
+/* Read the rest of a version 3 header */
+static int
+world_open_regions(world_file_t *f){
+	Uint32 header[7];
+	if(fread(header, sizeof(Uint32), 7, f->file) != 7){
+		LOG_DEBUG("Could not read the header of %s", f->path);
+		return -1;
+	}
+	f->id = header[0];
+	for(int a = 0; a < 3; a++){
+		f->min[a] = (Sint32) header[1 + a];
+		f->max[a] = (Sint32) header[4 + a];
+	}
+	world_bounds_size(f);
+	f->regions = calloc(WORLD_OPEN_REGIONS, sizeof(world_region_t));
+	if(f->regions == NULL)
+		FATAL_ERROR("Out of memory");
+	return 0;
+}
+
+/* Open f->path and read its header and chunk table */
+static int
+world_open_file(world_file_t *f){
+	f->map = NULL;
+	f->map_size = 0;
+	f->table = NULL;
+	f->space = NULL;
+	f->regions = NULL;
+	f->n_regions = 0;
+	f->region_clock = 0;
+	f->file = fopen(f->path, "rb+");
+	if(f->file == NULL){
+		LOG_DEBUG("Could not open file %s", f->path);
+		return -1;
+	}
+	Uint32 first;
+	int r = fread(&first, sizeof(Uint32), 1, f->file);
+	if(r != 1){
+		LOG_DEBUG("Could not read magic number from file %s", f->path);
+		return -1;
+	}
+	if(first == WORLD_FILE_MAGIC_NUMBER){
+		f->version = 1;
+	}else if(first == WORLD_FILE_MAGIC_NUMBER_V2){
+		Uint32 version;
+		if(fread(&version, sizeof(Uint32), 1, f->file) != 1 || 
+				(version != WORLD_FILE_VERSION && version != WORLD_FILE_VERSION_REGIONS)){
+			LOG_DEBUG("File %s has an unknown world file version", f->path);
+			return -1;
+		}
+		f->version = version;
+	}else{
+		LOG_DEBUG("File %s doesn't have correct magic number. Is it a world file?", f->path);
+		return -1;
+	}
+	
+	if(f->version == WORLD_FILE_VERSION_REGIONS){
+		/* Only the header. Regions are opened when they are used */
+		if(world_open_regions(f) < 0)
+			return -1;
+	}else{
+		/* We probably have a world file. Read the world size */
+		r = fread(&f->size, sizeof(Uint32), 3, f->file);
+		if(r != 3){
+			LOG_DEBUG("Could not read world size from file %s", f->path);
+			return -1;
+		}
+		if(world_check_size(f) < 0)
+			return -1;
+	}
+
+	f->layout = WORLD_LAYOUT_LINEAR;
+	if(f->version == 2){
+		Uint32 layout;
+		if(fread(&layout, sizeof(Uint32), 1, f->file) != 1){
+			LOG_DEBUG("Could not read the layout of %s", f->path);
+			return -1;
+		}
+		/* Only a hint for writers, an unknown one does no harm */
+		if(layout == WORLD_LAYOUT_MORTON)
+			f->layout = layout;
+
+		Sint64 n_chunks = world_n_chunks(f);
+		f->table = malloc(n_chunks * sizeof(world_chunk_entry_t));
+		if(f->table == NULL)
+			FATAL_ERROR("Out of memory");
+		if(fseek(f->file, WORLD_V2_HEADER_SIZE, SEEK_SET) < 0 || 
+				fread(f->table, sizeof(world_chunk_entry_t), n_chunks, f->file) != (size_t) n_chunks){
+			LOG_DEBUG("Could not read the chunk table of %s", f->path);
+			return -1;
+		}
+	}
+
+	f->end = world_file_size(f->file);
+	if(f->version == 2){
+		f->space = calloc(1, sizeof(world_space_t));
+		if(f->space == NULL)
+			FATAL_ERROR("Out of memory");
+		world_space_build(f->space, f->table, world_n_chunks(f), 
+				WORLD_V2_HEADER_SIZE + world_n_chunks(f) * sizeof(world_chunk_entry_t));
+	}
+	return 0;
+}
+
+int 
+world_open(world_file_t *f){
+	if(world_open_file(f) < 0)
+		return -1;
+
+	/* Before mapping, so the mapping covers replayed edits */
+	world_journal_init(f);
+	world_journal_replay(f);
+
+	if(f->mmap && f->version != WORLD_FILE_VERSION_REGIONS)
+		world_map(f->file, f->path, &f->map, &f->map_size);
+	return 0;
+}
+
+int
+world_create(world_file_t *f, Uint32 size[3], int layout){
+	f->map = NULL;
+	f->map_size = 0;
+	f->regions = NULL;
+	f->n_regions = 0;
+	f->version = 2;
+	f->layout = layout;
+	for(int a = 0; a < 3; a++)
+		f->size[a] = size[a];
+	if(world_check_size(f) < 0)
+		return -1;
+
+	f->file = fopen(f->path, "wb+");
+	if(f->file == NULL){
+		LOG_DEBUG("Could not create file %s", f->path);
+		return -1;
+	}
+	Uint32 header[6] = { WORLD_FILE_MAGIC_NUMBER_V2, WORLD_FILE_VERSION, size[0], size[1], size[2], layout };
+	Sint64 n_chunks = world_n_chunks(f);
+	f->table = calloc(n_chunks, sizeof(world_chunk_entry_t));
+	f->space = calloc(1, sizeof(world_space_t));
+	if(f->table == NULL || f->space == NULL)
+		FATAL_ERROR("Out of memory");
+	if(fwrite(header, sizeof(Uint32), 6, f->file) != 6 || 
+			fwrite(f->table, sizeof(world_chunk_entry_t), n_chunks, f->file) != (size_t) n_chunks){
+		LOG_DEBUG("Could not write the header of %s", f->path);
+		return -1;
+	}
+	fflush(f->file);
+	f->end = world_ftell(f->file);
+	world_journal_init(f);
+	/* Left by an earlier world at path, world_open would replay it here */
+	remove(f->journal->path);
+	return 0;
+}
+
+/* Store the bounds of a version 3 world in its header */
+static int
+world_write_bounds(world_file_t *f){
+	Sint32 bounds[6] = { f->min[0], f->min[1], f->min[2], f->max[0], f->max[1], f->max[2] };
+	return world_pwrite(f->file, bounds, sizeof(bounds), 3 * sizeof(Uint32));
+}
+
+int
+world_create_regions(world_file_t *f){
+	f->map = NULL;
+	f->map_size = 0;
+	f->table = NULL;
+	f->space = NULL;
+	f->version = WORLD_FILE_VERSION_REGIONS;
+	f->layout = WORLD_LAYOUT_LINEAR;
+	/* Tells its region files from those of an earlier world at the same path */
+	f->id = (Uint32) time(NULL) * 2654435761u ^ (Uint32) clock();
+	for(int a = 0; a < 3; a++){
+		f->min[a] = 0;
+		f->max[a] = 0;
+	}
+	world_bounds_size(f);
+
+	f->file = fopen(f->path, "wb+");
+	if(f->file == NULL){
+		LOG_DEBUG("Could not create file %s", f->path);
+		return -1;
+	}
+	Uint32 header[3] = { WORLD_FILE_MAGIC_NUMBER_V2, WORLD_FILE_VERSION_REGIONS, f->id };
+	if(fwrite(header, sizeof(Uint32), 3, f->file) != 3 || world_write_bounds(f) < 0){
+		LOG_DEBUG("Could not write the header of %s", f->path);
+		return -1;
+	}
+	f->regions = calloc(WORLD_OPEN_REGIONS, sizeof(world_region_t));
+	if(f->regions == NULL)
+		FATAL_ERROR("Out of memory");
+	f->n_regions = 0;
+	f->region_clock = 0;
+	f->end = WORLD_V3_HEADER_SIZE;
+	world_journal_init(f);
+	remove(f->journal->path);
+	return 0;
+}
+
+static void
+world_region_close(world_region_t *reg){
+	if(reg->file == NULL)
+		return;
+	world_unmap(reg->map, reg->map_size);
+	if(world_space_trim(&reg->space, reg->file, &reg->end))
+		reg->dirty = 1;
+	if(reg->dirty)
+		world_sync(reg->file);
+	free(reg->table);
+	world_space_clear(&reg->space);
+	fclose(reg->file);
+	reg->file = NULL;
+}
+
+void
+world_close(world_file_t *f){
+	world_journal_close(f);
+	world_unmap(f->map, f->map_size);
+	f->map = NULL;
+	free(f->table);
+	f->table = NULL;
+	if(f->space != NULL){
+		world_space_trim(f->space, f->file, &f->end);
+		world_space_clear(f->space);
+		free(f->space);
+		f->space = NULL;
+	}
+	for(int i = 0; i < f->n_regions; i++)
+		world_region_close(&f->regions[i]);
+	free(f->regions);
+	f->regions = NULL;
+	/* Chunks written with world_write_chunk aren't in the journal */
+	world_sync(f->file);
+	fclose(f->file);
+	f->file = NULL;
+}
+
+/* Rounded towards minus infinity */
+static int
+world_floor_div(int a, int b){
+	return a >= 0 ? a / b : -((-(a + 1)) / b) - 1;
+}
+
+/* Payloads written by a checkpoint that has yet to store their entries 
+ * look free in the table of reg. Keep new payloads off them */
+static void
+world_region_keep_staged(world_file_t *f, world_region_t *reg){
+	if(f->journal == NULL)
+		return;
+	linked_list_elm_t *elm = f->journal->checkpointing->head;
+	for(; elm != NULL; elm = elm->next){
+		world_pending_t *p = elm->data;
+		if(p->staged && p->entry.length > 0 && 
+				world_floor_div(p->x, WORLD_REGION_COLUMNS) == reg->r[0] && 
+				world_floor_div(p->y, WORLD_REGION_HEIGHT) == reg->r[1] && 
+				world_floor_div(p->z, WORLD_REGION_COLUMNS) == reg->r[2])
+			world_space_take(&reg->space, p->entry.offset, p->entry.capacity);
+	}
+}
+
+/* Open the file of region reg. A missing file, or one of another world, 
+ * is created with create and otherwise left out. Returns -1 on error */
+static int
+world_region_open(world_file_t *f, world_region_t *reg, int create){
+	char *path = malloc(strlen(f->path) + 40);
+	sprintf(path, "%s.r.%d.%d.%d", f->path, reg->r[0], reg->r[1], reg->r[2]);
+	reg->table = malloc(WORLD_REGION_CHUNKS * sizeof(world_chunk_entry_t));
+	if(reg->table == NULL)
+		FATAL_ERROR("Out of memory");
+
+	reg->file = fopen(path, "rb+");
+	if(reg->file != NULL){
+		Uint32 header[5];
+		if(fread(header, sizeof(Uint32), 5, reg->file) == 5 && header[0] == WORLD_REGION_MAGIC && 
+				header[1] == f->id && 
+				fread(reg->table, sizeof(world_chunk_entry_t), WORLD_REGION_CHUNKS, reg->file) == WORLD_REGION_CHUNKS){
+			reg->end = world_file_size(reg->file);
+			world_space_build(&reg->space, reg->table, WORLD_REGION_CHUNKS, 
+					WORLD_REGION_HEADER_SIZE + WORLD_REGION_CHUNKS * sizeof(world_chunk_entry_t));
+			world_region_keep_staged(f, reg);
+		}else{
+			LOG_DEBUG("Region file %s isn't part of %s", path, f->path);
+			fclose(reg->file);
+			reg->file = NULL;
+		}
+	}
+	if(reg->file == NULL && create){
+		reg->file = fopen(path, "wb+");
+		if(reg->file == NULL){
+			LOG_WARN("Could not create region file %s", path);
+			free(path);
+			free(reg->table);
+			return -1;
+		}
+		Uint32 header[5] = { WORLD_REGION_MAGIC, f->id, reg->r[0], reg->r[1], reg->r[2] };
+		memset(reg->table, 0, WORLD_REGION_CHUNKS * sizeof(world_chunk_entry_t));
+		if(fwrite(header, sizeof(Uint32), 5, reg->file) != 5 || 
+				fwrite(reg->table, sizeof(world_chunk_entry_t), WORLD_REGION_CHUNKS, reg->file) != WORLD_REGION_CHUNKS){
+			LOG_WARN("Could not write region file %s", path);
+			fclose(reg->file);
+			reg->file = NULL;
+			free(path);
+			free(reg->table);
+			return -1;
+		}
+		fflush(reg->file);
+		reg->end = WORLD_REGION_HEADER_SIZE + WORLD_REGION_CHUNKS * sizeof(world_chunk_entry_t);
+		reg->dirty = 1;
+	}
+
+	if(reg->file == NULL){
+		free(reg->table);
+		reg->table = NULL;
+	}else if(f->mmap){
+		world_map(reg->file, path, &reg->map, &reg->map_size);
+	}
+	free(path);
+	return 0;
+}
+
+/* The region of chunk (x, y, z), opened if needed. With create it gets a 
+ * file if it has none. The caller holds the lock. NULL on error */
+static world_region_t *
+world_region(world_file_t *f, int x, int y, int z, int create){
+	int r[3] = { 
+		world_floor_div(x, WORLD_REGION_COLUMNS), 
+		world_floor_div(y, WORLD_REGION_HEIGHT), 
+		world_floor_div(z, WORLD_REGION_COLUMNS) 
+	};
+	world_region_t *reg = NULL;
+	for(int i = 0; i < f->n_regions && reg == NULL; i++)
+		if(f->regions[i].r[0] == r[0] && f->regions[i].r[1] == r[1] && f->regions[i].r[2] == r[2])
+			reg = &f->regions[i];
+
+	if(reg == NULL){
+		if(f->n_regions < WORLD_OPEN_REGIONS){
+			reg = &f->regions[f->n_regions++];
+		}else{
+			reg = &f->regions[0];
+			for(int i = 1; i < f->n_regions; i++)
+				if(f->regions[i].last_use < reg->last_use)
+					reg = &f->regions[i];
+			world_region_close(reg);
+		}
+		memset(reg, 0, sizeof(world_region_t));
+		memcpy(reg->r, r, sizeof(r));
+		if(world_region_open(f, reg, create) < 0){
+			*reg = f->regions[--f->n_regions];
+			return NULL;
+		}
+	}else if(reg->file == NULL && create){
+		if(world_region_open(f, reg, create) < 0)
+			return NULL;
+	}
+	reg->last_use = ++f->region_clock;
+	return reg;
+}
+
+/* Index of chunk (x, y, z) in the table of its region */
+static int
+world_region_index(world_region_t *reg, int x, int y, int z){
+	int lx = x - reg->r[0] * WORLD_REGION_COLUMNS;
+	int ly = y - reg->r[1] * WORLD_REGION_HEIGHT;
+	int lz = z - reg->r[2] * WORLD_REGION_COLUMNS;
+	return (lx * WORLD_REGION_HEIGHT + ly) * WORLD_REGION_COLUMNS + lz;
+}
+
+/* Encode blocks as runs into out. Returns the number of bytes used */
+static int
+world_rle_encode(const block_t *blocks, Uint8 *out){
+	int n = 0;
+	for(int i = 0; i < WORLD_CHUNK_BLOCKS;){
+		Uint16 count = 1;
+		while(i + count < WORLD_CHUNK_BLOCKS && blocks[i + count] == blocks[i])
+			count++;
+		memcpy(out + n, &count, sizeof(Uint16));
+		memcpy(out + n + sizeof(Uint16), &blocks[i], sizeof(block_t));
+		n += WORLD_RLE_RUN_SIZE;
+		i += count;
+	}
+	return n;
+}
+
+static int
+world_rle_decode(const Uint8 *in, long length, block_t *out){
+	int n = 0;
+	for(long i = 0; i + WORLD_RLE_RUN_SIZE <= length; i += WORLD_RLE_RUN_SIZE){
+		Uint16 count;
+		block_t block;
+		memcpy(&count, in + i, sizeof(Uint16));
+		memcpy(&block, in + i + sizeof(Uint16), sizeof(block_t));
+		if(n + count > WORLD_CHUNK_BLOCKS)
+			return -1;
+		for(int j = 0; j < count; j++)
+			out[n++] = block;
+	}
+	return n == WORLD_CHUNK_BLOCKS ? 0 : -1;
+}
+
+static const block_t *
+world_decode_payload(const Uint8 *payload, long length, block_t *buf){
+	Uint32 encoding;
+	memcpy(&encoding, payload, sizeof(Uint32));
+	payload += sizeof(Uint32);
+	length -= sizeof(Uint32);
+
+	if(encoding == WORLD_CHUNK_RAW && length == WORLD_CHUNK_BLOCKS * sizeof(block_t)){
+		memcpy(buf, payload, length);
+		return buf;
+	}
+	if(encoding == WORLD_CHUNK_RLE && world_rle_decode(payload, length, buf) == 0)
+		return buf;
+	return NULL;
+}
+
+/* Decode the payload of chunk (x, y, z) at table entry e of a version 2 
+ * file or a region file, read through map when it covers the payload */
+static const block_t *
+world_payload_blocks(FILE *file, const Uint8 *map, Sint64 map_size, const world_chunk_entry_t *e, 
+		int x, int y, int z, block_t *buf){
+	if(e->length == 0){
+		memset(buf, 0, WORLD_CHUNK_BLOCKS * sizeof(block_t));
+		return buf;
+	}
+	if(e->length < sizeof(Uint32) || e->length > WORLD_PAYLOAD_MAX){
+		LOG_DEBUG("Chunk (%d %d %d) has a bad length", x, y, z);
+		return NULL;
+	}
+
+	const block_t *blocks;
+	if(map != NULL && (Sint64) (e->offset + e->length) <= map_size){
+		blocks = world_decode_payload(map + e->offset, e->length, buf);
+	}else{
+		/* Not mapped, or written after the file was mapped */
+		Uint8 payload[WORLD_PAYLOAD_MAX];
+		if(world_pread(file, payload, e->length, e->offset) < 0){
+			LOG_DEBUG("Could not read chunk (%d %d %d)", x, y, z);
+			return NULL;
+		}
+		blocks = world_decode_payload(payload, e->length, buf);
+	}
+	if(blocks == NULL)
+		LOG_DEBUG("Chunk (%d %d %d) is corrupt", x, y, z);
+	return blocks;
+}
+
+/* The blocks of chunk (x, y, z) as they are in the world file */
+static const block_t *
+world_file_blocks(world_file_t *f, int x, int y, int z, block_t *buf){
+	if(f->version == WORLD_FILE_VERSION_REGIONS){
+		world_region_t *reg = world_region(f, x, y, z, 0);
+		if(reg == NULL)
+			return NULL;
+		if(reg->file == NULL){
+			memset(buf, 0, WORLD_CHUNK_BLOCKS * sizeof(block_t));
+			return buf;
+		}
+		return world_payload_blocks(reg->file, reg->map, reg->map_size, 
+				&reg->table[world_region_index(reg, x, y, z)], x, y, z, buf);
+	}
+	if(f->version == 2)
+		return world_payload_blocks(f->file, f->map, f->map_size, 
+				&f->table[world_chunk_index(f, x, y, z)], x, y, z, buf);
+
+	Sint64 offset = world_chunk_offset(f, x, y, z);
+	if(f->map != NULL){
+		if(offset + (Sint64) (WORLD_CHUNK_BLOCKS * sizeof(block_t)) > f->map_size){
+			LOG_DEBUG("Chunk (%d %d %d) is past the end of the file", x, y, z);
+			return NULL;
+		}
+		return (const block_t *) (f->map + offset);
+	}
+
+	if(world_pread(f->file, buf, WORLD_CHUNK_BLOCKS * sizeof(block_t), offset) < 0){
+		LOG_DEBUG("Could not read chunk (%d %d %d)", x, y, z);
+		return NULL;
+	}
+	return buf;
+}
+
+static int
+world_is_air(const block_t *blocks){
+	for(int i = 0; i < WORLD_CHUNK_BLOCKS; i++)
+		if(blocks[i] != 0)
+			return 0;
+	return 1;
+}
+
+/* Where a chunk of a version 2 or 3 world is stored */
+typedef struct world_slot_s {
+	/* NULL for a chunk of a region without a file */
+	FILE *file;
+	Sint64 *end;
+	world_space_t *space;
+	world_chunk_entry_t *entry;
+	/* Where entry is in file */
+	Sint64 entry_offset;
+	/* NULL in version 2 */
+	world_region_t *reg;
+} world_slot_t;
+
+/* Find where chunk (x, y, z) is stored. With create its region gets a 
+ * file if it has none. The caller holds the lock. Returns -1 on error */
+static int
+world_chunk_slot(world_file_t *f, int x, int y, int z, int create, world_slot_t *slot){
+	if(f->version == 2){
+		Sint64 ind = world_chunk_index(f, x, y, z);
+		slot->file = f->file;
+		slot->end = &f->end;
+		slot->space = f->space;
+		slot->entry = &f->table[ind];
+		slot->entry_offset = WORLD_V2_HEADER_SIZE + ind * sizeof(world_chunk_entry_t);
+		slot->reg = NULL;
+		return 0;
+	}
+
+	world_region_t *reg = world_region(f, x, y, z, create);
+	if(reg == NULL)
+		return -1;
+	slot->file = reg->file;
+	slot->reg = reg;
+	if(reg->file == NULL)
+		return 0;
+	int ind = world_region_index(reg, x, y, z);
+	slot->end = &reg->end;
+	slot->space = &reg->space;
+	slot->entry = &reg->table[ind];
+	slot->entry_offset = WORLD_REGION_HEADER_SIZE + ind * sizeof(world_chunk_entry_t);
+	return 0;
+}
+
+/* Encode blocks as a payload into out, which has room for 
+ * WORLD_ENCODE_MAX bytes. Returns its length, 0 for air */
+static long
+world_payload_encode(const block_t *blocks, Uint8 *out){
+	if(world_is_air(blocks))
+		return 0;
+	Uint32 encoding = WORLD_CHUNK_RLE;
+	long length = sizeof(Uint32) + world_rle_encode(blocks, out + sizeof(Uint32));
+	if(length > (long) WORLD_PAYLOAD_MAX){
+		encoding = WORLD_CHUNK_RAW;
+		length = WORLD_PAYLOAD_MAX;
+		memcpy(out + sizeof(Uint32), blocks, WORLD_CHUNK_BLOCKS * sizeof(block_t));
+	}
+	memcpy(out, &encoding, sizeof(Uint32));
+	return length;
+}
+
+/* Store blocks as the payload of the chunk at slot right away. A payload 
+ * that fits where the old one was is written over it, otherwise it takes 
+ * free space and the old space is freed. Air keeps the space for later */
+static int
+world_payload_write(world_slot_t *slot, const block_t *blocks){
+	world_chunk_entry_t *e = slot->entry;
+	Uint8 payload[WORLD_ENCODE_MAX];
+	long length = world_payload_encode(blocks, payload);
+	if(length > e->capacity){
+		Sint64 offset = world_space_alloc(slot->space, slot->end, length);
+		if(world_pwrite(slot->file, payload, length, offset) < 0){
+			world_space_free(slot->space, offset, length);
+			return -1;
+		}
+		world_space_free(slot->space, e->offset, e->capacity);
+		e->offset = offset;
+		e->capacity = length;
+	}else if(length > 0 && world_pwrite(slot->file, payload, length, e->offset) < 0){
+		return -1;
+	}
+	e->length = length;
+	return world_pwrite(slot->file, e, sizeof(world_chunk_entry_t), slot->entry_offset);
+}
+
+/* Write blocks as a new payload of the chunk at slot in free space, 
+ * leaving the old payload and the entry alone, so a crash before the 
+ * entry is stored leaves the old payload readable. The entry to store 
+ * goes to staged */
+static int
+world_payload_stage(world_slot_t *slot, const block_t *blocks, world_chunk_entry_t *staged){
+	Uint8 payload[WORLD_ENCODE_MAX];
+	long length = world_payload_encode(blocks, payload);
+	*staged = *slot->entry;
+	staged->length = length;
+	if(length == 0)
+		return 0;
+	Sint64 offset = world_space_alloc(slot->space, slot->end, length);
+	if(world_pwrite(slot->file, payload, length, offset) < 0){
+		world_space_free(slot->space, offset, length);
+		return -1;
+	}
+	staged->offset = offset;
+	staged->capacity = length;
+	return 0;
+}
+
+/* Make the bounds of a version 3 world cover chunk (x, y, z) */
+static int
+world_grow(world_file_t *f, int x, int y, int z){
+	if(world_in_bounds(f, x, y, z))
+		return 0;
+	int c[3] = { x, y, z };
+	int empty = f->max[0] <= f->min[0];
+	for(int a = 0; a < 3; a++){
+		if(empty || c[a] < f->min[a])
+			f->min[a] = c[a];
+		if(empty || c[a] >= f->max[a])
+			f->max[a] = c[a] + 1;
+	}
+	world_bounds_size(f);
+	return world_write_bounds(f);
+}
+
+/* Store the blocks of chunk (x, y, z) in a version 2 or 3 world */
+static int
+world_write_compressed(world_file_t *f, int x, int y, int z, const block_t *blocks){
+	/* Air where there is no region file yet stays without one */
+	int air = world_is_air(blocks);
+	world_slot_t slot;
+	if(world_chunk_slot(f, x, y, z, !air, &slot) < 0)
+		return -1;
+	if(slot.file == NULL)
+		return 0;
+	if(slot.reg != NULL)
+		slot.reg->dirty = 1;
+	if(world_payload_write(&slot, blocks) < 0)
+		return -1;
+	return air || slot.reg == NULL ? 0 : world_grow(f, x, y, z);
+}
+
+/* Store n blocks of version 1 chunk (x, y, z) from block index first in one write */
+static int
+world_write_blocks(world_file_t *f, int x, int y, int z, int first, int n, const block_t *blocks){
+	Sint64 offset = world_chunk_offset(f, x, y, z) + first * sizeof(block_t);
+	return world_pwrite(f->file, blocks, n * sizeof(block_t), offset);
+}
+
+int
+world_write_chunk(world_file_t *f, int x, int y, int z, const block_t *blocks){
+	if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z)){
+		LOG_DEBUG("Chunk (%d %d %d) is outside %s", x, y, z, f->path);
+		return -1;
+	}
+	SDL_LockMutex(f->lock);
+	int r;
+	if(f->version == 1)
+		r = world_write_blocks(f, x, y, z, 0, WORLD_CHUNK_BLOCKS, blocks);
+	else
+		r = world_write_compressed(f, x, y, z, blocks);
+	SDL_UnlockMutex(f->lock);
+	return r;
+}
+
+static Uint32
+world_crc32(const Uint8 *data, long len){
+	static Uint32 table[256];
+	static int table_ready = 0;
+	if(!table_ready){
+		for(Uint32 i = 0; i < 256; i++){
+			Uint32 c = i;
+			for(int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		table_ready = 1;
+	}
+
+	Uint32 crc = 0xffffffff;
+	for(long i = 0; i < len; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static world_pending_t *
+world_pending_find(linked_list_t *lst, int x, int y, int z){
+	linked_list_elm_t *elm = lst->head;
+	while(elm != NULL){
+		world_pending_t *p = elm->data;
+		if(p->x == x && p->y == y && p->z == z)
+			return p;
+		elm = elm->next;
+	}
+	return NULL;
+}
+
+/* Put p back in lst for another checkpoint, under the newer edits of the 
+ * same chunk there */
+static void
+world_pending_requeue(linked_list_t *lst, world_pending_t *p){
+	world_pending_t *newer = world_pending_find(lst, p->x, p->y, p->z);
+	p->staged = 0;
+	if(newer == NULL){
+		util_list_add(lst, p);
+		return;
+	}
+	for(int i = 0; i < WORLD_CHUNK_BLOCKS; i++){
+		Uint32 bit = 1u << (i % 32);
+		if((p->mask[i / 32] & bit) && !(newer->mask[i / 32] & bit)){
+			newer->blocks[i] = p->blocks[i];
+			newer->mask[i / 32] |= bit;
+		}
+	}
+	free(p);
+}
+
+static void
+world_pending_apply(world_pending_t *p, block_t *blocks){
+	for(int w = 0; w < WORLD_MASK_WORDS; w++)
+		for(Uint32 m = p->mask[w]; m != 0; m &= m - 1){
+			int bit = 0;
+			while(!(m & 1u << bit))
+				bit++;
+			blocks[w * 32 + bit] = p->blocks[w * 32 + bit];
+		}
+}
+
+/* Add the chunk edits of a record payload to the pending edits. The 
+ * caller holds the lock. Returns -1 if the payload is malformed */
+static int
+world_journal_apply(world_file_t *f, const Uint8 *payload, long len){
+	long pos = 0;
+	while(pos < len){
+		Uint32 c[4];
+		if(pos + (long) sizeof(c) > len)
+			return -1;
+		memcpy(c, payload + pos, sizeof(c));
+		pos += sizeof(c);
+		/* Signed chunk coordinates */
+		int x = (Sint32) c[0], y = (Sint32) c[1], z = (Sint32) c[2];
+		if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z))
+			return -1;
+
+		world_pending_t *p = world_pending_find(f->journal->pending, x, y, z);
+		if(p == NULL){
+			p = calloc(1, sizeof(world_pending_t));
+			if(p == NULL)
+				FATAL_ERROR("Out of memory");
+			p->x = x; p->y = y; p->z = z;
+			util_list_add(f->journal->pending, p);
+		}
+
+		for(Uint32 r = 0; r < c[3]; r++){
+			Uint16 run[2];
+			if(pos + (long) sizeof(run) > len)
+				return -1;
+			memcpy(run, payload + pos, sizeof(run));
+			pos += sizeof(run);
+			if(run[0] + run[1] > WORLD_CHUNK_BLOCKS || pos + (long) (run[1] * sizeof(block_t)) > len)
+				return -1;
+			memcpy(&p->blocks[run[0]], payload + pos, run[1] * sizeof(block_t));
+			pos += run[1] * sizeof(block_t);
+			for(int i = run[0]; i < run[0] + run[1]; i++)
+				p->mask[i / 32] |= 1u << (i % 32);
+		}
+	}
+	return 0;
+}
+
+const block_t *
+world_chunk_blocks(world_file_t *f, int x, int y, int z, block_t *buf){
+	if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z)){
+		LOG_DEBUG("Chunk (%d %d %d) is outside %s", x, y, z, f->path);
+		return NULL;
+	}
+	SDL_LockMutex(f->lock);
+	const block_t *blocks = world_file_blocks(f, x, y, z, buf);
+
+	/* Edits not checkpointed yet go on top, the newest last */
+	struct world_journal_s *j = f->journal;
+	if(blocks != NULL && (j->pending->head != NULL || j->checkpointing->head != NULL)){
+		world_pending_t *old = world_pending_find(j->checkpointing, x, y, z);
+		world_pending_t *new = world_pending_find(j->pending, x, y, z);
+		if(old != NULL || new != NULL){
+			if(blocks != buf)
+				memcpy(buf, blocks, WORLD_CHUNK_BLOCKS * sizeof(block_t));
+			if(old != NULL)
+				world_pending_apply(old, buf);
+			if(new != NULL)
+				world_pending_apply(new, buf);
+			blocks = buf;
+		}
+	}
+	SDL_UnlockMutex(f->lock);
+	return blocks;
+}
+
+void
+world_journal_blocks(world_file_t *f, int x, int y, int z, const Uint32 *mask, const block_t *blocks){
+	struct world_journal_s *j = f->journal;
+	/* Would make the whole record fail to replay */
+	if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z)){
+		LOG_WARN("Chunk (%d %d %d) is outside %s", x, y, z, f->path);
+		return;
+	}
+	/* At worst every other block is a run */
+	long max = 4 * sizeof(Uint32) + WORLD_CHUNK_BLOCKS / 2 * 2 * sizeof(Uint16) + WORLD_CHUNK_BLOCKS * sizeof(block_t);
+	if(j->batch_size + max > j->batch_capacity){
+		j->batch_capacity = 2 * j->batch_capacity + max;
+		j->batch = realloc(j->batch, j->batch_capacity);
+		if(j->batch == NULL)
+			FATAL_ERROR("Out of memory");
+	}
+
+	Uint8 *start = j->batch + j->batch_size;
+	Uint8 *out = start + 4 * sizeof(Uint32);
+	Uint32 n_runs = 0;
+	int i = 0;
+	while(i < WORLD_CHUNK_BLOCKS){
+		if(mask[i / 32] == 0){
+			i += 32;
+			continue;
+		}
+		if(!(mask[i / 32] & 1u << (i % 32))){
+			i++;
+			continue;
+		}
+		int first = i;
+		while(i < WORLD_CHUNK_BLOCKS && (mask[i / 32] & 1u << (i % 32)))
+			i++;
+		Uint16 run[2] = { first, i - first };
+		memcpy(out, run, sizeof(run));
+		memcpy(out + sizeof(run), &blocks[first], run[1] * sizeof(block_t));
+		out += sizeof(run) + run[1] * sizeof(block_t);
+		n_runs++;
+	}
+
+	Uint32 c[4] = { x, y, z, n_runs };
+	memcpy(start, c, sizeof(c));
+	j->batch_size = out - j->batch;
+}
+
+int
+world_commit(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	long payload_len = j->batch_size - WORLD_JOURNAL_HEADER_SIZE;
+	if(payload_len == 0)
+		return 0;
+
+	/* The whole batch in one append */
+	Uint32 header[3] = { WORLD_JOURNAL_MAGIC, payload_len, 0 };
+	header[2] = world_crc32(j->batch + WORLD_JOURNAL_HEADER_SIZE, payload_len);
+	memcpy(j->batch, header, WORLD_JOURNAL_HEADER_SIZE);
+
+	SDL_LockMutex(f->lock);
+	if(j->file == NULL){
+		j->file = fopen(j->path, "wb+");
+		if(j->file == NULL){
+			SDL_UnlockMutex(f->lock);
+			LOG_WARN("Could not create journal %s", j->path);
+			return -1;
+		}
+		j->end = 0;
+	}
+	j->appending = 1;
+	Sint64 end = j->end;
+	SDL_UnlockMutex(f->lock);
+
+	/* Readers don't wait for the disk */
+	int r = world_pwrite(j->file, j->batch, j->batch_size, end);
+	if(r == 0)
+		r = world_sync(j->file);
+
+	SDL_LockMutex(f->lock);
+	j->appending = 0;
+	if(r < 0){
+		SDL_UnlockMutex(f->lock);
+		LOG_WARN("Could not write journal %s", j->path);
+		return -1;
+	}
+	j->end = end + j->batch_size;
+	world_journal_apply(f, j->batch + WORLD_JOURNAL_HEADER_SIZE, payload_len);
+	j->n_commits++;
+	SDL_CondSignal(j->work);
+	SDL_UnlockMutex(f->lock);
+
+	if(j->thread == NULL)
+		j->thread = SDL_CreateThread(world_checkpointer, f);
+	j->batch_size = WORLD_JOURNAL_HEADER_SIZE;
+	return 0;
+}
+
+/* Write the edits of p into the world file. Version 1 chunks are done 
+ * right away, version 2 and 3 ones are staged for world_checkpoint_entry. 
+ * The caller holds the lock */
+static int
+world_checkpoint_chunk(world_file_t *f, world_pending_t *p){
+	p->done = 0;
+	p->staged = 0;
+	if(f->version == 1){
+		/* Each run of edited blocks in one write */
+		int i = 0;
+		while(i < WORLD_CHUNK_BLOCKS){
+			if(p->mask[i / 32] == 0){
+				i += 32;
+				continue;
+			}
+			if(!(p->mask[i / 32] & 1u << (i % 32))){
+				i++;
+				continue;
+			}
+			int first = i;
+			while(i < WORLD_CHUNK_BLOCKS && (p->mask[i / 32] & 1u << (i % 32)))
+				i++;
+			if(world_write_blocks(f, p->x, p->y, p->z, first, i - first, p->blocks + first) < 0)
+				return -1;
+		}
+		p->done = 1;
+		return 0;
+	}
+
+	block_t buf[WORLD_CHUNK_BLOCKS];
+	const block_t *blocks = world_file_blocks(f, p->x, p->y, p->z, buf);
+	if(blocks == NULL)
+		return -1;
+	if(blocks != buf)
+		memcpy(buf, blocks, sizeof(buf));
+	world_pending_apply(p, buf);
+
+	world_slot_t slot;
+	if(world_chunk_slot(f, p->x, p->y, p->z, !world_is_air(buf), &slot) < 0)
+		return -1;
+	if(slot.file == NULL){
+		/* Air in a region without a file */
+		p->done = 1;
+		return 0;
+	}
+	if(slot.reg != NULL)
+		slot.reg->dirty = 1;
+	if(world_payload_stage(&slot, buf, &p->entry) < 0)
+		return -1;
+	p->staged = 1;
+	return 0;
+}
+
+/* Store the entry of the payload staged for p, now on disk. The payload 
+ * it replaces is deferred, the space is free once the entry is on disk 
+ * too. The caller holds the lock */
+static int
+world_checkpoint_entry(world_file_t *f, world_pending_t *p){
+	world_slot_t slot;
+	if(world_chunk_slot(f, p->x, p->y, p->z, 1, &slot) < 0 || slot.file == NULL)
+		return -1;
+	world_chunk_entry_t old = *slot.entry;
+	*slot.entry = p->entry;
+	if(world_pwrite(slot.file, slot.entry, sizeof(world_chunk_entry_t), slot.entry_offset) < 0){
+		*slot.entry = old;
+		return -1;
+	}
+	if(old.offset != p->entry.offset)
+		world_space_defer(slot.space, old.offset, old.capacity);
+	p->done = 1;
+	if(slot.reg == NULL)
+		return 0;
+	slot.reg->dirty = 1;
+	return p->entry.length > 0 ? world_grow(f, p->x, p->y, p->z) : 0;
+}
+
+/* Wait until the regions written to are on disk. The caller holds the 
+ * lock. Regions closed before that were synced when they were closed. 
+ * Returns -1 if any of them failed */
+static int
+world_sync_regions(world_file_t *f){
+	int r = 0;
+	for(int i = 0; i < f->n_regions; i++){
+		world_region_t *reg = &f->regions[i];
+		if(reg->dirty){
+			if(world_sync(reg->file) < 0)
+				r = -1;
+			else
+				reg->dirty = 0;
+		}
+	}
+	return r;
+}
+
+/* Wait until everything written to the world is on disk. Returns -1 if 
+ * that failed */
+static int
+world_checkpoint_sync(world_file_t *f){
+	int r = world_sync(f->file);
+	SDL_LockMutex(f->lock);
+	if(world_sync_regions(f) < 0)
+		r = -1;
+	SDL_UnlockMutex(f->lock);
+	return r;
+}
+
+/* Write all pending edits into the world file. The new payloads go on 
+ * disk before the table entries pointing at them, and the entries before 
+ * the space of the old payloads is reused, so a crash at any point leaves 
+ * every chunk readable. Edits that couldn't be written go back to pending 
+ * for the next checkpoint. Once everything is on disk and nothing was 
+ * committed meanwhile the journal is emptied, the journal is the only 
+ * copy of the edits until then. Returns -1 if anything failed */
+static int
+world_checkpoint(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	SDL_LockMutex(f->lock);
+	linked_list_t *work = j->pending;
+	j->pending = j->checkpointing;
+	j->checkpointing = work;
+	int n_commits = j->n_commits;
+	SDL_UnlockMutex(f->lock);
+
+	/* Chunk by chunk, so readers wait at most for one */
+	int n_failed = 0;
+	linked_list_elm_t *elm;
+	for(elm = work->head; elm != NULL; elm = elm->next){
+		SDL_LockMutex(f->lock);
+		if(world_checkpoint_chunk(f, elm->data) < 0)
+			n_failed++;
+		SDL_UnlockMutex(f->lock);
+	}
+	int r = world_checkpoint_sync(f);
+	for(elm = work->head; elm != NULL; elm = elm->next){
+		world_pending_t *p = elm->data;
+		if(!p->staged)
+			continue;
+		SDL_LockMutex(f->lock);
+		if(r < 0 || world_checkpoint_entry(f, p) < 0)
+			n_failed++;
+		SDL_UnlockMutex(f->lock);
+	}
+	if(r == 0)
+		r = world_checkpoint_sync(f);
+
+	SDL_LockMutex(f->lock);
+	if(r == 0){
+		if(f->space != NULL)
+			world_space_release(f->space);
+		for(int i = 0; i < f->n_regions; i++)
+			world_space_release(&f->regions[i].space);
+	}
+	for(elm = work->head; elm != NULL; elm = elm->next){
+		world_pending_t *p = elm->data;
+		if(p->done)
+			free(p);
+		else
+			world_pending_requeue(j->pending, p);
+	}
+	util_list_free(work);
+	j->checkpointing = util_list_create();
+	if(n_failed == 0 && r == 0 && j->n_commits == n_commits && !j->appending && j->file != NULL){
+		world_truncate(j->file, 0);
+		j->end = 0;
+	}
+	SDL_UnlockMutex(f->lock);
+
+	if(n_failed > 0)
+		LOG_WARN("Could not checkpoint %d chunks to %s, keeping them in the journal", n_failed, f->path);
+	else if(r < 0)
+		LOG_WARN("Could not sync %s, keeping the journal", f->path);
+	return n_failed > 0 || r < 0 ? -1 : 0;
+}
+
+static int
+world_checkpointer(void *data){
+	world_file_t *f = data;
+	struct world_journal_s *j = f->journal;
+	SDL_LockMutex(f->lock);
+	while(!j->quit){
+		if(j->pending->head == NULL || j->frozen){
+			SDL_CondWait(j->work, f->lock);
+			continue;
+		}
+		j->busy = 1;
+		SDL_UnlockMutex(f->lock);
+		int r = world_checkpoint(f);
+		SDL_LockMutex(f->lock);
+		j->busy = 0;
+		SDL_CondBroadcast(j->idle);
+		if(r < 0 && !j->quit)
+			SDL_CondWaitTimeout(j->work, f->lock, WORLD_CHECKPOINT_RETRY_MS);
+	}
+	SDL_UnlockMutex(f->lock);
+	return 0;
+}
+
+static void
+world_journal_init(world_file_t *f){
+	struct world_journal_s *j = calloc(1, sizeof(struct world_journal_s));
+	if(j == NULL)
+		FATAL_ERROR("Out of memory");
+	j->path = malloc(strlen(f->path) + strlen(".journal") + 1);
+	sprintf(j->path, "%s.journal", f->path);
+	j->batch_capacity = WORLD_JOURNAL_HEADER_SIZE;
+	j->batch_size = WORLD_JOURNAL_HEADER_SIZE;
+	j->batch = malloc(j->batch_capacity);
+	j->pending = util_list_create();
+	j->checkpointing = util_list_create();
+	j->work = SDL_CreateCond();
+	j->idle = SDL_CreateCond();
+	f->lock = SDL_CreateMutex();
+	f->journal = j;
+}
+
+/* Apply the edits left in the journal by a crash. A torn record at the 
+ * end and anything after it is dropped */
+static void
+world_journal_replay(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	j->file = fopen(j->path, "rb+");
+	if(j->file == NULL)
+		return;
+	Sint64 size = world_file_size(j->file);
+	Uint8 *data = malloc(size > 0 ? size : 1);
+	if(data == NULL)
+		FATAL_ERROR("Out of memory");
+	if(world_pread(j->file, data, size, 0) < 0)
+		size = 0;
+
+	int n_records = 0;
+	Sint64 pos = 0;
+	while(pos + (Sint64) WORLD_JOURNAL_HEADER_SIZE <= size){
+		Uint32 header[3];
+		memcpy(header, data + pos, WORLD_JOURNAL_HEADER_SIZE);
+		long len = header[1];
+		if(header[0] != WORLD_JOURNAL_MAGIC || pos + (Sint64) WORLD_JOURNAL_HEADER_SIZE + len > size)
+			break;
+		const Uint8 *payload = data + pos + WORLD_JOURNAL_HEADER_SIZE;
+		if(world_crc32(payload, len) != header[2] || world_journal_apply(f, payload, len) < 0)
+			break;
+		pos += WORLD_JOURNAL_HEADER_SIZE + len;
+		n_records++;
+	}
+	free(data);
+	if(pos < size)
+		LOG_WARN("Dropped %ld bytes of torn journal %s", (long) (size - pos), j->path);
+	LOG_DEBUG("Replaying %d journal records from %s", n_records, j->path);
+
+	j->end = pos;
+	world_checkpoint(f);
+}
+
+/* Stop the checkpointer and get every edit into the world file */
+static void
+world_journal_close(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	world_commit(f);
+	if(j->thread != NULL){
+		SDL_LockMutex(f->lock);
+		j->quit = 1;
+		SDL_CondSignal(j->work);
+		SDL_UnlockMutex(f->lock);
+		SDL_WaitThread(j->thread, NULL);
+	}
+	if(j->pending->head != NULL)
+		world_checkpoint(f);
+	if(j->file != NULL){
+		fclose(j->file);
+		if(j->end == 0)
+			remove(j->path);
+	}
+
+	util_list_free_data(j->pending);
+	util_list_free_data(j->checkpointing);
+	SDL_DestroyCond(j->work);
+	SDL_DestroyCond(j->idle);
+	SDL_DestroyMutex(f->lock);
+	free(j->batch);
+	free(j->path);
+	free(j);
+	f->journal = NULL;
+}
+
+int
+world_freeze(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	SDL_LockMutex(f->lock);
+	j->frozen = 1;
+	while(j->busy)
+		SDL_CondWait(j->idle, f->lock);
+	SDL_UnlockMutex(f->lock);
+	/* Nothing can be committed meanwhile, so this empties the journal too */
+	return world_checkpoint(f);
+}
+
+const block_t *
+world_frozen_blocks(world_file_t *f, int x, int y, int z, block_t *buf){
+	if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z))
+		return NULL;
+	SDL_LockMutex(f->lock);
+	const block_t *blocks = world_file_blocks(f, x, y, z, buf);
+	SDL_UnlockMutex(f->lock);
+	return blocks;
+}
+
+void
+world_thaw(world_file_t *f){
+	struct world_journal_s *j = f->journal;
+	SDL_LockMutex(f->lock);
+	j->frozen = 0;
+	SDL_CondSignal(j->work);
+	SDL_UnlockMutex(f->lock);
+}
+
+/* Make the rename of a file in the directory of path durable */
+static void
+world_sync_dir(char *path){
+#ifndef WIN32
+	char *dir = malloc(strlen(path) + 2);
+	strcpy(dir, path);
+	char *slash = strrchr(dir, '/');
+	if(slash == NULL)
+		strcpy(dir, ".");
+	else
+		slash[slash == dir] = '\0';
+	int fd = open(dir, O_RDONLY);
+	if(fd >= 0){
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+#else
+	(void) path;
+#endif
+}
+
+int
+world_replace(world_file_t *f, char *path){
+	if(f->version == WORLD_FILE_VERSION_REGIONS)
+		return -1;
+
+	SDL_LockMutex(f->lock);
+	world_unmap(f->map, f->map_size);
+	free(f->table);
+	if(f->space != NULL)
+		world_space_clear(f->space);
+	free(f->space);
+	fclose(f->file);
+#ifdef WIN32
+	/* rename doesn't replace files here. A crash right after this leaves 
+	 * the world at path */
+	remove(f->path);
+#endif
+	int r = rename(path, f->path);
+	if(r < 0)
+		LOG_WARN("Could not move %s to %s", path, f->path);
+	else
+		world_sync_dir(f->path);
+
+	/* The old file again if the rename failed. Only what depends on the 
+	 * file changes, the rest is read by other threads */
+	world_file_t file;
+	file.path = f->path;
+	if(world_open_file(&file) < 0 || memcmp(file.size, f->size, sizeof(f->size)) != 0)
+		FATAL_ERROR("Could not reopen %s", f->path);
+	f->version = file.version;
+	f->file = file.file;
+	f->table = file.table;
+	f->space = file.space;
+	f->end = file.end;
+	f->map = NULL;
+	f->map_size = 0;
+	if(f->mmap)
+		world_map(f->file, f->path, &f->map, &f->map_size);
+	SDL_UnlockMutex(f->lock);
+	return r < 0 ? -1 : 0;
+}
+
+void
+world_prefetch_chunk(world_file_t *f, int x, int y, int z){
+#ifndef WIN32
+	if(f->version != WORLD_FILE_VERSION_REGIONS && !world_in_bounds(f, x, y, z))
+		return;
+	const Uint8 *map = f->map;
+	Sint64 map_size = f->map_size;
+	Sint64 offset, len;
+	SDL_LockMutex(f->lock);
+	if(f->version == WORLD_FILE_VERSION_REGIONS){
+		world_region_t *reg = world_region(f, x, y, z, 0);
+		map = NULL;
+		if(reg != NULL && reg->map != NULL){
+			world_chunk_entry_t *e = &reg->table[world_region_index(reg, x, y, z)];
+			map = reg->map;
+			map_size = reg->map_size;
+			offset = e->offset;
+			len = e->length;
+		}
+	}else if(f->version == 2){
+		world_chunk_entry_t *e = &f->table[world_chunk_index(f, x, y, z)];
+		offset = e->offset;
+		len = e->length;
+	}else{
+		offset = world_chunk_offset(f, x, y, z);
+		len = WORLD_CHUNK_BLOCKS * sizeof(block_t);
+	}
+	/* The region can't be closed while its mapping is advised */
+	if(map != NULL && len > 0 && offset + len <= map_size){
+		/* posix_madvise wants a page aligned start */
+		long page = sysconf(_SC_PAGESIZE);
+		Sint64 start = offset & ~(Sint64) (page - 1);
+		posix_madvise((Uint8 *) map + start, len + offset - start, POSIX_MADV_WILLNEED);
+	}
+	SDL_UnlockMutex(f->lock);
+#else
+	(void) f; (void) x; (void) y; (void) z;
+#endif
+}
+
+/* Chunks along each axis of the bounds and the bits to number them */
+static void
+world_layout_extent(world_file_t *f, Sint64 n[3], int bits[3]){
+	for(int a = 0; a < 3; a++){
+		n[a] = (Sint64) f->max[a] - f->min[a];
+		for(bits[a] = 0; ((Sint64) 1 << bits[a]) < n[a]; bits[a]++);
+	}
+}
+
+Uint64
+world_layout_codes(world_file_t *f, int layout){
+	Sint64 n[3];
+	int bits[3];
+	world_layout_extent(f, n, bits);
+	if(n[0] <= 0 || n[1] <= 0 || n[2] <= 0)
+		return 0;
+	if(layout == WORLD_LAYOUT_MORTON)
+		return (Uint64) 1 << (bits[0] + bits[1] + bits[2]);
+	return (Uint64) n[0] * n[1] * n[2];
+}
+
+/* A Morton code interleaves the bits of the coordinates from the lowest 
+ * up, x then y then z. An axis whose bits run out is left out of the 
+ * higher levels, so flat worlds don't waste most of the codes */
+Uint64
+world_layout_code(world_file_t *f, int layout, int x, int y, int z){
+	Sint64 n[3];
+	int bits[3];
+	world_layout_extent(f, n, bits);
+	Uint64 c[3] = { x - f->min[0], y - f->min[1], z - f->min[2] };
+	if(layout != WORLD_LAYOUT_MORTON)
+		return (c[0] * n[1] + c[1]) * n[2] + c[2];
+
+	Uint64 code = 0;
+	int bit = 0;
+	for(int level = 0; level < bits[0] || level < bits[1] || level < bits[2]; level++)
+		for(int a = 0; a < 3; a++)
+			if(level < bits[a])
+				code |= (c[a] >> level & 1) << bit++;
+	return code;
+}
+
+int
+world_layout_chunk(world_file_t *f, int layout, Uint64 code, int c[3]){
+	Sint64 n[3];
+	int bits[3];
+	world_layout_extent(f, n, bits);
+	if(code >= world_layout_codes(f, layout))
+		return -1;
+	if(layout != WORLD_LAYOUT_MORTON){
+		c[2] = code % n[2];
+		c[1] = code / n[2] % n[1];
+		c[0] = code / n[2] / n[1];
+	}else{
+		int bit = 0;
+		c[0] = c[1] = c[2] = 0;
+		for(int level = 0; level < bits[0] || level < bits[1] || level < bits[2]; level++)
+			for(int a = 0; a < 3; a++)
+				if(level < bits[a])
+					c[a] |= (int) (code >> bit++ & 1) << level;
+		for(int a = 0; a < 3; a++)
+			if(c[a] >= n[a])
+				return -1;
+	}
+	for(int a = 0; a < 3; a++)
+		c[a] += f->min[a];
+	return 0;
+}
+
+Sint64
+world_chunk_position(world_file_t *f, int x, int y, int z){
+	if(f->version == WORLD_FILE_VERSION_REGIONS || !world_in_bounds(f, x, y, z))
+		return -1;
+	if(f->version == 1)
+		return world_chunk_offset(f, x, y, z);
+	SDL_LockMutex(f->lock);
+	world_chunk_entry_t *e = &f->table[world_chunk_index(f, x, y, z)];
+	Sint64 offset = e->length > 0 ? (Sint64) e->offset : -1;
+	SDL_UnlockMutex(f->lock);
+	return offset;
+}
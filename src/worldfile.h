@@ -0,0 +1,166 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __WORLDFILE_H__
+#define __WORLDFILE_H__
+
+#include <stdio.h>
+#include <SDL/SDL.h>
+
+typedef Uint32 block_t;
+
+#define WORLD_FILE_MAGIC_NUMBER 274263364
+/* "WRL2" followed by the format version */
+#define WORLD_FILE_MAGIC_NUMBER_V2 0x324c5257
+#define WORLD_FILE_VERSION 2
+#define WORLD_FILE_VERSION_REGIONS 3
+#define WORLD_CHUNK_SIZE 16
+#define WORLD_CHUNK_BLOCKS (WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE)
+/* A version 3 region is WORLD_REGION_COLUMNS x WORLD_REGION_COLUMNS chunk 
+ * columns, WORLD_REGION_HEIGHT chunks tall */
+#define WORLD_REGION_COLUMNS 32
+#define WORLD_REGION_HEIGHT 16
+
+/* Chunk payload encodings */
+#define WORLD_CHUNK_RAW 0
+#define WORLD_CHUNK_RLE 1
+
+/* Orders of the payloads in a version 2 file. Along a Morton curve the 
+ * chunks near each other in the world are mostly near in the file too, 
+ * so loading around the camera reads fewer places of it */
+#define WORLD_LAYOUT_LINEAR 0
+#define WORLD_LAYOUT_MORTON 1
+
+/* Where the payload of a chunk is in a version 2 file. Length 0 means 
+ * the chunk is all air */
+typedef struct world_chunk_entry_s {
+	Uint64 offset;
+	Uint32 length;
+	/* Bytes reserved at offset. Rewrites that fit stay in place */
+	Uint32 capacity;
+} world_chunk_entry_t;
+
+/* A version 1 world file is the magic number and the size as four Uint32s 
+ * followed by every chunk, x major then y then z, each as CHUNK_SIZE^3 
+ * blocks in the same order. 
+ *
+ * Version 2 starts with the magic number, the version, the size and the 
+ * layout the payloads were written in as a Uint32, followed by a 
+ * world_chunk_entry_t for every chunk in the same order. A chunk payload 
+ * is its encoding as a Uint32 and then either the raw blocks or runs of 
+ * a Uint16 count and a Uint32 block. 
+ *
+ * Version 3 stores the chunks in region files next to the world file, 
+ * path.r.X.Y.Z for region (X, Y, Z), so it opens in constant time and 
+ * grows in every direction. The world file is the magic number, the 
+ * version, a world id and the chunk bounds as six Sint32s, min x, y, z 
+ * and then max. A region file starts with "WRR1", the world id and the 
+ * region coordinates as Sint32s, followed by a world_chunk_entry_t for 
+ * every chunk of the region, x major then y then z, and the payloads as 
+ * in version 2. A region file of another world id, or none, is all air */
+typedef struct world_file_s {
+	/* Input */
+	char *path;
+	/* Read chunks through a memory mapping of the file where supported */
+	int mmap;
+	/* Output */
+	int version;
+	Uint32 size[3]; /* Size in blocks */
+	/* WORLD_LAYOUT_*, the order new version 2 files of the world should 
+	 * have. Always linear for versions 1 and 3 */
+	int layout;
+	/* Version 1 and 2 worlds have the chunks min <= (x, y, z) < max. 
+	 * Version 3 worlds have every chunk, all air outside the bounds, and 
+	 * the bounds grow when blocks are written outside */
+	int min[3];
+	int max[3];
+	/* Internal */
+	FILE *file;
+	/* The file as it was when opened, mapped read only. NULL when 
+	 * reading through stdio */
+	Uint8 *map;
+	Sint64 map_size;
+	/* Version 2 chunk table */
+	world_chunk_entry_t *table;
+	/* Space between the version 2 payloads that new ones can take */
+	struct world_space_s *space;
+	/* File size. Version 2 payloads that don't fit elsewhere go here */
+	Sint64 end;
+	/* Version 3 regions that were used last, at most WORLD_OPEN_REGIONS */
+	struct world_region_s *regions;
+	int n_regions;
+	Uint32 region_clock;
+	Uint32 id;
+	/* Edit journal at path.journal */
+	struct world_journal_s *journal;
+	/* Guards the file and the table against the checkpointer */
+	SDL_mutex *lock;
+} world_file_t;
+
+int world_open(world_file_t *f);
+/* Create an all air version 2 world of the given size in blocks at f->path. 
+ * The payloads are stored in the order they are written, the caller 
+ * writes them in the given layout */
+int world_create(world_file_t *f, Uint32 size[3], int layout);
+/* Create an empty version 3 world at f->path */
+int world_create_regions(world_file_t *f);
+void world_close(world_file_t *f);
+/* The blocks of chunk (x, y, z). May point into the mapping, otherwise 
+ * the blocks are read into buf. NULL on error or if a version 1 or 2 
+ * world doesn't have the chunk */
+const block_t *world_chunk_blocks(world_file_t *f, int x, int y, int z, block_t *buf);
+/* Store all blocks of chunk (x, y, z) right away, bypassing the journal */
+int world_write_chunk(world_file_t *f, int x, int y, int z, const block_t *blocks);
+/* Journal the blocks of chunk (x, y, z) set in mask, a bit per block in 
+ * storage order. They are kept at the next world_commit */
+void world_journal_blocks(world_file_t *f, int x, int y, int z, const Uint32 *mask, const block_t *blocks);
+/* Make the journaled blocks durable with one append to the journal. A 
+ * background thread then checkpoints them into the world file. Edits 
+ * left in the journal by a crash are replayed by world_open */
+int world_commit(world_file_t *f);
+/* Let the OS start reading chunk (x, y, z) in the background */
+void world_prefetch_chunk(world_file_t *f, int x, int y, int z);
+/* Size of an open file, which can be past 2 GB */
+Sint64 world_file_size(FILE *file);
+
+/* Number the chunks within the bounds of f in a layout. Every chunk has a 
+ * code below world_layout_codes. world_layout_chunk returns -1 for the 
+ * Morton codes past the bounds */
+Uint64 world_layout_codes(world_file_t *f, int layout);
+Uint64 world_layout_code(world_file_t *f, int layout, int x, int y, int z);
+int world_layout_chunk(world_file_t *f, int layout, Uint64 code, int c[3]);
+/* Where the payload of chunk (x, y, z) starts in a version 1 or 2 file, 
+ * -1 if it is all air or not in the file */
+Sint64 world_chunk_position(world_file_t *f, int x, int y, int z);
+
+/* Write every committed edit into the world file, then keep the file as 
+ * it is until world_thaw. Later commits are journaled and read as usual, 
+ * and checkpointed after the thaw. Called from the thread that commits. 
+ * Returns -1 if some edits couldn't be written, world_frozen_blocks 
+ * doesn't have them then */
+int world_freeze(world_file_t *f);
+/* The blocks of chunk (x, y, z) as they were at world_freeze, ignoring 
+ * later commits. Like world_chunk_blocks otherwise */
+const block_t *world_frozen_blocks(world_file_t *f, int x, int y, int z, block_t *buf);
+void world_thaw(world_file_t *f);
+/* Move the world file at path over the one of f and read from it from 
+ * now on. Meant for a frozen version 1 or 2 world rewritten as of the 
+ * freeze, so the edits committed since go on top of it. Only f->version 
+ * may change. Nobody may hold blocks returned by world_chunk_blocks 
+ * meanwhile. Returns -1, still reading the old file, if it couldn't be 
+ * moved */
+int world_replace(world_file_t *f, char *path);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writes chunks far apart in a region world, and more than 4 GB into a
+ * region file, and reads them back after reopening the world. Checks that
+ * the layouts number every chunk of a version 2 world once, and that a
+ * journal left by a crash is replayed up to a corrupted record */
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#include "util.h"
+#include "worldfile.h"
+
+#ifdef WIN32
+#define fseeko fseeko64
+#define ftello ftello64
+#endif
+
+#define N_CHUNKS 6
+
+/* Chunk coordinates. Stored one after the other in a version 1 file the
+ * far ones would be terabytes in */
+static int chunks[N_CHUNKS][3] = {
+	{ 0, 0, 0 },
+	{ -1, -1, -1 },
+	{ 31, 15, 31 },
+	{ 300000, 2, 1 },
+	{ -300000, 40, -70000 },
+	{ 5, -100000, 7 }
+};
+
+static int n_failed = 0;
+
+static void
+fill_chunk(block_t *blocks, int seed){
+	for(int i = 0; i < WORLD_CHUNK_BLOCKS; i++)
+		blocks[i] = (i * 7 + seed) % 5 == 0 ? 0x80000000 | (Uint32) (seed % 8) << 28 : 0;
+}
+
+static void
+check_chunk(world_file_t *f, int x, int y, int z, int seed, char *when){
+	block_t expected[WORLD_CHUNK_BLOCKS];
+	block_t buf[WORLD_CHUNK_BLOCKS];
+	if(seed >= 0)
+		fill_chunk(expected, seed);
+	else
+		memset(expected, 0, sizeof(expected));
+
+	const block_t *blocks = world_chunk_blocks(f, x, y, z, buf);
+	if(blocks == NULL || memcmp(blocks, expected, sizeof(expected)) != 0){
+		printf("chunk (%d %d %d) is wrong %s\n", x, y, z, when);
+		n_failed++;
+	}
+}
+
+static void
+check_all(world_file_t *f, char *when){
+	for(int i = 0; i < N_CHUNKS; i++)
+		check_chunk(f, chunks[i][0], chunks[i][1], chunks[i][2], i, when);
+	/* Next to written chunks, in the same region and in none */
+	check_chunk(f, 1, 0, 0, -1, when);
+	check_chunk(f, 1000, 1000, 1000, -1, when);
+}
+
+/* Every chunk gets one code and back, and a Morton world says so */
+static void
+check_layouts(char *path){
+	Uint32 size[3] = { 5 * WORLD_CHUNK_SIZE, 3 * WORLD_CHUNK_SIZE, 9 * WORLD_CHUNK_SIZE };
+	world_file_t f;
+	f.path = path;
+	f.mmap = 1;
+	if(world_create(&f, size, WORLD_LAYOUT_MORTON) < 0){
+		printf("could not create %s\n", path);
+		n_failed++;
+		return;
+	}
+	world_close(&f);
+	if(world_open(&f) < 0 || f.layout != WORLD_LAYOUT_MORTON){
+		printf("%s isn't a Morton world\n", path);
+		n_failed++;
+		return;
+	}
+
+	for(int layout = WORLD_LAYOUT_LINEAR; layout <= WORLD_LAYOUT_MORTON; layout++){
+		int seen[5 * 3 * 9] = { 0 };
+		Uint64 n_codes = world_layout_codes(&f, layout);
+		for(Uint64 code = 0; code < n_codes; code++){
+			int c[3];
+			if(world_layout_chunk(&f, layout, code, c) < 0)
+				continue;
+			if(world_layout_code(&f, layout, c[0], c[1], c[2]) != code){
+				printf("chunk (%d %d %d) has another code in layout %d\n", c[0], c[1], c[2], layout);
+				n_failed++;
+			}
+			seen[(c[0] * 3 + c[1]) * 9 + c[2]]++;
+		}
+		for(int i = 0; i < 5 * 3 * 9; i++)
+			if(seen[i] != 1){
+				printf("chunk %d is numbered %d times in layout %d\n", i, seen[i], layout);
+				n_failed++;
+			}
+	}
+	world_close(&f);
+	remove(path);
+}
+
+/* Read all of the file at path. Returns NULL if it can't be read */
+static Uint8 *
+read_file(char *path, long *size){
+	FILE *file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	Uint8 *data = malloc(*size > 0 ? *size : 1);
+	fseek(file, 0, SEEK_SET);
+	if(fread(data, 1, *size, file) != (size_t) *size){
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	return data;
+}
+
+static int
+write_file(char *path, const Uint8 *data, long size){
+	FILE *file = fopen(path, "wb");
+	if(file == NULL)
+		return -1;
+	int r = fwrite(data, 1, size, file) == (size_t) size ? 0 : -1;
+	fclose(file);
+	return r;
+}
+
+/* Copy a version 2 world and its journal as they are on disk while the
+ * world is frozen, so nothing committed is checkpointed. That is what a
+ * crash leaves. The last record of the journal is corrupted and a torn
+ * header follows it. Reopening the copy must bring back the other
+ * records and drop those */
+static void
+check_replay(char *path){
+	Uint32 size[3] = { 4 * WORLD_CHUNK_SIZE, WORLD_CHUNK_SIZE, WORLD_CHUNK_SIZE };
+	block_t blocks[WORLD_CHUNK_BLOCKS];
+	Uint32 mask[WORLD_CHUNK_BLOCKS / 32];
+	memset(mask, 0xff, sizeof(mask));
+	world_file_t f;
+	f.path = path;
+	f.mmap = 1;
+	if(world_create(&f, size, WORLD_LAYOUT_LINEAR) < 0){
+		printf("could not create %s\n", path);
+		n_failed++;
+		return;
+	}
+	fill_chunk(blocks, 20);
+	world_write_chunk(&f, 0, 0, 0, blocks);
+	world_freeze(&f);
+
+	char *journal_path = malloc(strlen(path) + 32);
+	sprintf(journal_path, "%s.journal", path);
+	long n_good = 0;
+	for(int i = 1; i <= 3; i++){
+		/* The records before the last one */
+		if(i == 3)
+			free(read_file(journal_path, &n_good));
+		fill_chunk(blocks, 20 + i);
+		world_journal_blocks(&f, i, 0, 0, mask, blocks);
+		if(world_commit(&f) < 0){
+			puts("could not commit");
+			n_failed++;
+		}
+	}
+
+	long world_size, journal_size;
+	Uint8 *world = read_file(path, &world_size);
+	Uint8 *journal = read_file(journal_path, &journal_size);
+	world_thaw(&f);
+	world_close(&f);
+	if(world == NULL || journal == NULL || n_good == 0 || journal_size <= n_good + 16){
+		printf("could not copy %s as of the crash\n", path);
+		n_failed++;
+		return;
+	}
+
+	char *copy = malloc(strlen(path) + 32);
+	sprintf(copy, "%s.crash", path);
+	char *copy_journal = malloc(strlen(path) + 32);
+	sprintf(copy_journal, "%s.journal", copy);
+	/* A block near the end of the last record, which would still apply */
+	journal[journal_size - 8] ^= 0x01;
+	journal = realloc(journal, journal_size + 8);
+	memcpy(journal + journal_size, journal, 8);
+	write_file(copy, world, world_size);
+	write_file(copy_journal, journal, journal_size + 8);
+	free(world);
+	free(journal);
+
+	for(int pass = 0; pass < 2; pass++){
+		char *when = pass == 0 ? "after replaying the journal" : "after reopening the replayed world";
+		f.path = copy;
+		f.mmap = 1;
+		if(world_open(&f) < 0){
+			printf("could not open %s\n", copy);
+			n_failed++;
+			break;
+		}
+		check_chunk(&f, 0, 0, 0, 20, when);
+		check_chunk(&f, 1, 0, 0, 21, when);
+		check_chunk(&f, 2, 0, 0, 22, when);
+		check_chunk(&f, 3, 0, 0, -1, when);
+		world_close(&f);
+	}
+	long left = 0;
+	free(read_file(copy_journal, &left));
+	if(left != 0){
+		printf("%ld bytes are left in %s\n", left, copy_journal);
+		n_failed++;
+	}
+
+	remove(path);
+	remove(journal_path);
+	remove(copy);
+	remove(copy_journal);
+	free(journal_path);
+	free(copy);
+	free(copy_journal);
+}
+
+static int
+open_world(world_file_t *f, char *path){
+	f->path = path;
+	f->mmap = 1;
+	if(world_open(f) < 0){
+		printf("could not open %s\n", path);
+		return -1;
+	}
+	if(f->version != WORLD_FILE_VERSION_REGIONS){
+		printf("%s has version %d\n", path, f->version);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[]){
+	char *path = argc > 1 ? argv[1] : "worldtest.wrl";
+	block_t blocks[WORLD_CHUNK_BLOCKS];
+	world_file_t f;
+
+	f.path = path;
+	f.mmap = 1;
+	if(world_create_regions(&f) < 0){
+		printf("could not create %s\n", path);
+		return 1;
+	}
+	for(int i = 0; i < N_CHUNKS - 1; i++){
+		fill_chunk(blocks, i);
+		if(world_write_chunk(&f, chunks[i][0], chunks[i][1], chunks[i][2], blocks) < 0){
+			printf("could not write chunk %d\n", i);
+			n_failed++;
+		}
+	}
+	/* The last one through the journal */
+	Uint32 mask[WORLD_CHUNK_BLOCKS / 32];
+	memset(mask, 0xff, sizeof(mask));
+	fill_chunk(blocks, N_CHUNKS - 1);
+	world_journal_blocks(&f, chunks[N_CHUNKS - 1][0], chunks[N_CHUNKS - 1][1], chunks[N_CHUNKS - 1][2], mask, blocks);
+	if(world_commit(&f) < 0){
+		puts("could not commit");
+		n_failed++;
+	}
+	check_all(&f, "before closing");
+	world_close(&f);
+
+	if(open_world(&f, path) < 0)
+		return 1;
+	check_all(&f, "after reopening");
+	int min[3] = { -300000, -100000, -70000 };
+	int max[3] = { 300001, 41, 32 };
+	for(int a = 0; a < 3; a++)
+		if(f.min[a] != min[a] || f.max[a] != max[a]){
+			printf("bounds on axis %d are %d %d, not %d %d\n", a, f.min[a], f.max[a], min[a], max[a]);
+			n_failed++;
+		}
+	world_close(&f);
+
+	/* Grow region (0, 0, 0) to 5 GB without writing it, so the next
+	 * payloads are appended past 4 GB */
+	char *region = malloc(strlen(path) + 16);
+	sprintf(region, "%s.r.0.0.0", path);
+	FILE *rf = fopen(region, "rb+");
+	if(rf == NULL || fseeko(rf, (Sint64) 5 << 30, SEEK_SET) < 0 || fputc(0, rf) == EOF){
+		printf("could not grow %s\n", region);
+		return 1;
+	}
+	fclose(rf);
+
+	if(open_world(&f, path) < 0)
+		return 1;
+	/* One rewritten in place, one new and one through the journal */
+	fill_chunk(blocks, 100);
+	world_write_chunk(&f, 0, 0, 0, blocks);
+	fill_chunk(blocks, 101);
+	world_write_chunk(&f, 3, 4, 5, blocks);
+	fill_chunk(blocks, 102);
+	world_journal_blocks(&f, 31, 15, 31, mask, blocks);
+	world_commit(&f);
+	world_close(&f);
+
+	if(open_world(&f, path) < 0)
+		return 1;
+	check_chunk(&f, 0, 0, 0, 100, "past 4 GB");
+	check_chunk(&f, 3, 4, 5, 101, "past 4 GB");
+	check_chunk(&f, 31, 15, 31, 102, "past 4 GB");
+	check_chunk(&f, -1, -1, -1, 1, "past 4 GB");
+	world_close(&f);
+
+	rf = fopen(region, "rb");
+	fseeko(rf, 0, SEEK_END);
+	/* The payloads went after the byte at 5 GB, not somewhere below */
+	if(ftello(rf) <= ((Sint64) 5 << 30) + 1){
+		printf("%s didn't grow past 5 GB\n", region);
+		n_failed++;
+	}
+	fclose(rf);
+
+	/* Leave nothing behind */
+	remove(path);
+	for(int i = 0; i < N_CHUNKS; i++){
+		int r[3] = { chunks[i][0], chunks[i][1], chunks[i][2] };
+		int size[3] = { WORLD_REGION_COLUMNS, WORLD_REGION_HEIGHT, WORLD_REGION_COLUMNS };
+		for(int a = 0; a < 3; a++)
+			r[a] = r[a] >= 0 ? r[a] / size[a] : -((-r[a] - 1) / size[a]) - 1;
+		sprintf(region, "%s.r.%d.%d.%d", path, r[0], r[1], r[2]);
+		remove(region);
+	}
+	free(region);
+
+	check_layouts(path);
+	check_replay(path);
+
+	printf("%s\n", n_failed == 0 ? "worldtest passed" : "worldtest failed");
+	return n_failed != 0;
+}
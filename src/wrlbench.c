@@ -0,0 +1,291 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+/* Times loading every chunk of a world file through stdio and through 
+ * the memory mapping, with a cold and a warm page cache. Only the time 
+ * spent reading counts, not the frames slept between prefetches. The 
+ * neighbourhood loads compare layouts, run it on a file repacked with 
+ * wrlrepack and on one with -l */
+
+/* posix_fadvise and clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <SDL/SDL.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+#include "util.h"
+#include "worldfile.h"
+
+/* Streaming loads BENCH_BATCH chunks per frame of BENCH_FRAME_MS, 
+ * BENCH_STREAM_CHUNKS chunks in all */
+#define BENCH_BATCH 32
+#define BENCH_FRAME_MS 8
+#define BENCH_STREAM_CHUNKS 4096
+/* Neighbourhood loads read the chunks within BENCH_RADIUS chunks of 
+ * BENCH_NEIGHBOURHOODS random places, closest first, like streaming 
+ * around the camera does */
+#define BENCH_NEIGHBOURHOODS 16
+#define BENCH_RADIUS 4
+/* Size of the pieces of the file counted as read by a neighbourhood */
+#define BENCH_WINDOW 65536
+
+enum { BENCH_STDIO, BENCH_MMAP, BENCH_MMAP_PREFETCH };
+static char *bench_names[] = { "stdio", "mmap", "mmap+prefetch" };
+
+void
+usage(void){
+	fprintf(stderr, "Usage: wrlbench <world.wrl> [runs]\n");
+	exit(1);
+}
+
+/* Throw the file out of the page cache. Returns -1 if that isn't possible */
+static int
+drop_cache(char *path){
+#ifndef WIN32
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return -1;
+	int r = posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+	fclose(f);
+	return r == 0 ? 0 : -1;
+#else
+	(void) path;
+	return -1;
+#endif
+}
+
+static double
+bench_ms(void){
+#ifndef WIN32
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+#else
+	return SDL_GetTicks();
+#endif
+}
+
+/* Load n_chunks chunks in the given order and return the time spent 
+ * reading in ms. The active blocks are counted to touch all data, as 
+ * packing them would. With frames set the chunks are loaded in batches 
+ * with a sleep in between, like streaming does. With prefetching the 
+ * next batch is asked for before sleeping */
+static double
+load_chunks(char *path, int mode, int *order, int n_chunks, int frames, long *active){
+	world_file_t f;
+	f.path = path;
+	f.mmap = mode != BENCH_STDIO;
+
+	double start = bench_ms();
+	if(world_open(&f) < 0){
+		fprintf(stderr, "Could not open world file %s\n", path);
+		exit(1);
+	}
+	int ny = f.size[1] / WORLD_CHUNK_SIZE;
+	int nz = f.size[2] / WORLD_CHUNK_SIZE;
+	/* Chunk i in file order is chunk (x, y, z) + min */
+	int *min = f.min;
+
+	block_t buf[WORLD_CHUNK_BLOCKS];
+	double elapsed = 0;
+	*active = 0;
+	for(int i = 0; i < n_chunks; i++){
+		if(frames && i % BENCH_BATCH == 0){
+			for(int j = i + BENCH_BATCH; mode == BENCH_MMAP_PREFETCH && j < i + 2 * BENCH_BATCH && j < n_chunks; j++)
+				world_prefetch_chunk(&f, min[0] + order[j] / (ny * nz), min[1] + order[j] / nz % ny, min[2] + order[j] % nz);
+			elapsed += bench_ms() - start;
+			SDL_Delay(BENCH_FRAME_MS);
+			start = bench_ms();
+		}
+
+		const block_t *blocks = world_chunk_blocks(&f, min[0] + order[i] / (ny * nz), min[1] + order[i] / nz % ny, 
+				min[2] + order[i] % nz, buf);
+		if(blocks == NULL){
+			fprintf(stderr, "Could not read chunk %d\n", order[i]);
+			exit(1);
+		}
+		for(int j = 0; j < WORLD_CHUNK_BLOCKS; j++)
+			*active += blocks[j] >> 31;
+	}
+	world_close(&f);
+	return elapsed + bench_ms() - start;
+}
+
+static int
+bench_offset_cmp(const void *a, const void *b){
+	const int *oa = a, *ob = b;
+	return oa[3] - ob[3];
+}
+
+static int
+bench_position_cmp(const void *a, const void *b){
+	Sint64 pa = *(const Sint64 *) a, pb = *(const Sint64 *) b;
+	return pa < pb ? -1 : pa > pb;
+}
+
+/* Put the chunks of the neighbourhoods in order as indices like those of 
+ * load_chunks, n chunks along each axis, neighbourhood i from starts[i] 
+ * on. Returns how many there are */
+static int
+neighbourhoods(int n[3], int *order, int *starts){
+	int side = 2 * BENCH_RADIUS + 1;
+	int (*offsets)[4] = malloc(side * side * side * sizeof(*offsets));
+	int n_offsets = 0;
+	for(int x = -BENCH_RADIUS; x <= BENCH_RADIUS; x++)
+		for(int y = -BENCH_RADIUS; y <= BENCH_RADIUS; y++)
+			for(int z = -BENCH_RADIUS; z <= BENCH_RADIUS; z++){
+				int d = x * x + y * y + z * z;
+				if(d > BENCH_RADIUS * BENCH_RADIUS)
+					continue;
+				int *o = offsets[n_offsets++];
+				o[0] = x; o[1] = y; o[2] = z; o[3] = d;
+			}
+	qsort(offsets, n_offsets, sizeof(*offsets), bench_offset_cmp);
+
+	int n_loads = 0;
+	srand(2);
+	for(int i = 0; i < BENCH_NEIGHBOURHOODS; i++){
+		starts[i] = n_loads;
+		int centre[3] = { rand() % n[0], rand() % n[1], rand() % n[2] };
+		for(int j = 0; j < n_offsets; j++){
+			int c[3];
+			int inside = 1;
+			for(int a = 0; a < 3; a++){
+				c[a] = centre[a] + offsets[j][a];
+				inside = inside && c[a] >= 0 && c[a] < n[a];
+			}
+			if(inside)
+				order[n_loads++] = (c[0] * n[1] + c[1]) * n[2] + c[2];
+		}
+	}
+	starts[BENCH_NEIGHBOURHOODS] = n_loads;
+	free(offsets);
+	return n_loads;
+}
+
+/* How many runs of adjacent BENCH_WINDOW pieces of the file the chunks 
+ * start in, about the seeks to read them. Fewer are faster however fast 
+ * the disk under the page cache is */
+static int
+count_runs(world_file_t *f, int *order, int n_loads){
+	int ny = f->size[1] / WORLD_CHUNK_SIZE;
+	int nz = f->size[2] / WORLD_CHUNK_SIZE;
+	Sint64 *windows = malloc((n_loads > 0 ? n_loads : 1) * sizeof(Sint64));
+	int n = 0;
+	for(int i = 0; i < n_loads; i++){
+		Sint64 position = world_chunk_position(f, f->min[0] + order[i] / (ny * nz), f->min[1] + order[i] / nz % ny, 
+				f->min[2] + order[i] % nz);
+		if(position >= 0)
+			windows[n++] = position / BENCH_WINDOW;
+	}
+	qsort(windows, n, sizeof(Sint64), bench_position_cmp);
+	int n_runs = 0;
+	for(int i = 0; i < n; i++)
+		n_runs += i == 0 || windows[i] > windows[i - 1] + 1;
+	free(windows);
+	return n_runs;
+}
+
+int
+main(int argc, char *argv[]){
+	if(argc != 2 && argc != 3)
+		usage();
+	char *path = argv[1];
+	int runs = argc == 3 ? atoi(argv[2]) : 3;
+	if(runs < 1)
+		usage();
+
+	world_file_t f;
+	f.path = path;
+	f.mmap = 0;
+	if(world_open(&f) < 0){
+		fprintf(stderr, "Could not open world file %s\n", path);
+		exit(1);
+	}
+	int n[3] = { f.size[0] / WORLD_CHUNK_SIZE, f.size[1] / WORLD_CHUNK_SIZE, f.size[2] / WORLD_CHUNK_SIZE };
+	int n_chunks = n[0] * n[1] * n[2];
+	printf("%s: version %d, %s layout, %d x %d x %d blocks, %d chunks, %ld KB\n", path, f.version, 
+			f.layout == WORLD_LAYOUT_MORTON ? "Morton" : "linear", f.size[0], f.size[1], f.size[2], n_chunks, 
+			(long) (world_file_size(f.file) / 1024));
+
+	int side = 2 * BENCH_RADIUS + 1;
+	int n_neighbours = BENCH_NEIGHBOURHOODS * side * side * side;
+	int *order = malloc((n_chunks > n_neighbours ? n_chunks : n_neighbours) * sizeof(int));
+	/* Counted now, load_chunks opens the file itself */
+	int starts[BENCH_NEIGHBOURHOODS + 1];
+	int n_neighbourhood_loads = neighbourhoods(n, order, starts);
+	int n_runs = 0;
+	for(int i = 0; i < BENCH_NEIGHBOURHOODS; i++)
+		n_runs += count_runs(&f, order + starts[i], starts[i + 1] - starts[i]);
+	world_close(&f);
+
+	if(drop_cache(path) < 0)
+		printf("Can't drop the page cache here, cold numbers are warm\n");
+
+	/* Startup reads everything, streaming a scattered few chunks per frame */
+	printf("%-14s %-14s %10s %10s %14s\n", "load", "backend", "cold ms", "warm ms", "cold us/chunk");
+	for(int streaming = 0; streaming < 2; streaming++){
+		for(int i = 0; i < n_chunks; i++)
+			order[i] = i;
+		srand(1);
+		for(int i = n_chunks - 1; streaming && i > 0; i--){
+			int j = rand() % (i + 1);
+			int tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+		}
+		int n_loads = streaming && n_chunks > BENCH_STREAM_CHUNKS ? BENCH_STREAM_CHUNKS : n_chunks;
+
+		for(int mode = BENCH_STDIO; mode <= (streaming ? BENCH_MMAP_PREFETCH : BENCH_MMAP); mode++){
+			double cold = 1e30, warm = 1e30;
+			long active;
+			for(int r = 0; r < runs; r++){
+				drop_cache(path);
+				double t = load_chunks(path, mode, order, n_loads, streaming, &active);
+				cold = fmin(cold, t);
+				t = load_chunks(path, mode, order, n_loads, streaming, &active);
+				warm = fmin(warm, t);
+			}
+			printf("%-14s %-14s %10.0f %10.0f %14.1f\n", streaming ? "streaming" : "startup", bench_names[mode], 
+					cold, warm, cold * 1000 / n_loads);
+		}
+	}
+
+	/* Cold is all of the neighbourhoods after one drop, they hardly overlap */
+	neighbourhoods(n, order, starts);
+	for(int mode = BENCH_STDIO; mode <= BENCH_MMAP; mode++){
+		double cold = 1e30, warm = 1e30;
+		long active;
+		for(int r = 0; r < runs; r++){
+			drop_cache(path);
+			double t = load_chunks(path, mode, order, n_neighbourhood_loads, 0, &active);
+			cold = fmin(cold, t);
+			t = load_chunks(path, mode, order, n_neighbourhood_loads, 0, &active);
+			warm = fmin(warm, t);
+		}
+		printf("%-14s %-14s %10.0f %10.0f %14.1f\n", "neighbourhood", bench_names[mode], 
+				cold, warm, cold * 1000 / n_neighbourhood_loads);
+	}
+	printf("%d neighbourhoods of %d chunks, each read in %.1f runs of %d KB pieces\n", BENCH_NEIGHBOURHOODS, 
+			n_neighbourhood_loads / BENCH_NEIGHBOURHOODS, (double) n_runs / BENCH_NEIGHBOURHOODS, BENCH_WINDOW / 1024);
+
+	free(order);
+	return 0;
+}
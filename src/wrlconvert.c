@@ -0,0 +1,127 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+/* Converts a world file of any version to a compact version 2 file, or 
+ * with -r to a version 3 world stored in region files. Version 2 files 
+ * start at chunk (0, 0, 0), so the chunks are moved by the bounds. With -m 
+ * a version 2 file stores its chunks along a Morton curve */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#include "util.h"
+#include "worldfile.h"
+
+void
+usage(void){
+	fprintf(stderr, "Usage: wrlconvert [-r | -m] <in.wrl> <out.wrl>\n");
+	exit(1);
+}
+
+/* Size of a world file and its region files */
+static Sint64
+world_size(world_file_t *f){
+	Sint64 size = world_file_size(f->file);
+	if(f->version != WORLD_FILE_VERSION_REGIONS)
+		return size;
+
+	int lo[3] = { 
+		f->min[0] / WORLD_REGION_COLUMNS - 1, f->min[1] / WORLD_REGION_HEIGHT - 1, f->min[2] / WORLD_REGION_COLUMNS - 1 
+	};
+	int hi[3] = { 
+		f->max[0] / WORLD_REGION_COLUMNS, f->max[1] / WORLD_REGION_HEIGHT, f->max[2] / WORLD_REGION_COLUMNS 
+	};
+	char *path = malloc(strlen(f->path) + 40);
+	for(int rx = lo[0]; rx <= hi[0]; rx++)
+		for(int ry = lo[1]; ry <= hi[1]; ry++)
+			for(int rz = lo[2]; rz <= hi[2]; rz++){
+				sprintf(path, "%s.r.%d.%d.%d", f->path, rx, ry, rz);
+				FILE *region = fopen(path, "rb");
+				if(region == NULL)
+					continue;
+				size += world_file_size(region);
+				fclose(region);
+			}
+	free(path);
+	return size;
+}
+
+int
+main(int argc, char *argv[]){
+	int regions = argc == 4 && strcmp(argv[1], "-r") == 0;
+	int layout = argc == 4 && strcmp(argv[1], "-m") == 0 ? WORLD_LAYOUT_MORTON : WORLD_LAYOUT_LINEAR;
+	int flag = regions || layout != WORLD_LAYOUT_LINEAR;
+	if(argc != 3 + flag)
+		usage();
+	char *in_path = argv[1 + flag];
+	char *out_path = argv[2 + flag];
+
+	world_file_t in, out;
+	in.path = in_path;
+	in.mmap = 1;
+	if(world_open(&in) < 0){
+		fprintf(stderr, "Could not open world file %s\n", in_path);
+		exit(1);
+	}
+	out.path = out_path;
+	out.mmap = 1;
+	if((regions ? world_create_regions(&out) : world_create(&out, in.size, layout)) < 0){
+		fprintf(stderr, "Could not create world file %s\n", out_path);
+		exit(1);
+	}
+
+	int n_chunks[3];
+	int shift[3];
+	for(int a = 0; a < 3; a++){
+		n_chunks[a] = in.max[a] - in.min[a];
+		shift[a] = regions ? 0 : -in.min[a];
+	}
+
+	/* All air chunks are left out of the new file */
+	int n_stored = 0;
+	block_t buf[WORLD_CHUNK_BLOCKS];
+	Uint64 n_codes = world_layout_codes(&in, layout);
+	for(Uint64 code = 0; code < n_codes; code++){
+		int c[3];
+		if(world_layout_chunk(&in, layout, code, c) < 0)
+			continue;
+		const block_t *blocks = world_chunk_blocks(&in, c[0], c[1], c[2], buf);
+		if(blocks == NULL){
+			fprintf(stderr, "Could not read chunk %d %d %d\n", c[0], c[1], c[2]);
+			exit(1);
+		}
+		int all_air = 1;
+		for(int i = 0; i < WORLD_CHUNK_BLOCKS && all_air; i++)
+			all_air = blocks[i] == 0;
+		if(all_air)
+			continue;
+		if(world_write_chunk(&out, c[0] + shift[0], c[1] + shift[1], c[2] + shift[2], blocks) < 0){
+			fprintf(stderr, "Could not write chunk %d %d %d\n", c[0], c[1], c[2]);
+			exit(1);
+		}
+		n_stored++;
+	}
+
+	Sint64 in_size = world_size(&in);
+	Sint64 out_size = world_size(&out);
+	printf("%s: version %d, %ld KB\n", in_path, in.version, (long) (in_size / 1024));
+	printf("%s: version %d, %ld KB, %d of %d chunks stored\n", out_path, out.version, (long) (out_size / 1024), 
+			n_stored, n_chunks[0] * n_chunks[1] * n_chunks[2]);
+	world_close(&in);
+	world_close(&out);
+	return 0;
+}
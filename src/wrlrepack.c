@@ -0,0 +1,108 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify 
+ *  it under the terms of the GNU General Public License as published by 
+ *  the Free Software Foundation, either version 3 of the License, or 
+ *  (at your option) any later version. 
+
+ *  This program is distributed in the hope that it will be useful, 
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *  GNU General Public License for more details. 
+
+ *  You should have received a copy of the GNU General Public License 
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+/* Rewrites a version 2 world file in place with its chunks along a Morton 
+ * curve, or with -l x major then y then z. Payloads moved out of place by 
+ * edits are put back in order and the space they left is dropped. Run it 
+ * while the game doesn't have the world open */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#include "util.h"
+#include "worldfile.h"
+
+void
+usage(void){
+	fprintf(stderr, "Usage: wrlrepack [-l] <world.wrl>\n");
+	exit(1);
+}
+
+static Sint64
+file_size(char *path){
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return 0;
+	Sint64 size = world_file_size(f);
+	fclose(f);
+	return size;
+}
+
+int
+main(int argc, char *argv[]){
+	int linear = argc == 3 && strcmp(argv[1], "-l") == 0;
+	if(argc != 2 + linear)
+		usage();
+	char *path = argv[1 + linear];
+	int layout = linear ? WORLD_LAYOUT_LINEAR : WORLD_LAYOUT_MORTON;
+
+	world_file_t in, out;
+	in.path = path;
+	in.mmap = 1;
+	if(world_open(&in) < 0){
+		fprintf(stderr, "Could not open world file %s\n", path);
+		exit(1);
+	}
+	if(in.version != WORLD_FILE_VERSION){
+		/* Version 1 offsets follow from the coordinates, and region files 
+		 * are small enough for their order not to matter much */
+		fprintf(stderr, "%s is a version %d world. Only version 2 worlds can be repacked, "
+				"convert it with wrlconvert -m\n", path, in.version);
+		exit(1);
+	}
+
+	char *tmp_path = malloc(strlen(path) + 8);
+	sprintf(tmp_path, "%s.repack", path);
+	out.path = tmp_path;
+	out.mmap = 0;
+	if(world_create(&out, in.size, layout) < 0){
+		fprintf(stderr, "Could not create world file %s\n", tmp_path);
+		exit(1);
+	}
+
+	int n_stored = 0;
+	block_t buf[WORLD_CHUNK_BLOCKS];
+	Uint64 n_codes = world_layout_codes(&in, layout);
+	for(Uint64 code = 0; code < n_codes; code++){
+		int c[3];
+		if(world_layout_chunk(&in, layout, code, c) < 0 || world_chunk_position(&in, c[0], c[1], c[2]) < 0)
+			continue;
+		const block_t *blocks = world_chunk_blocks(&in, c[0], c[1], c[2], buf);
+		if(blocks == NULL || world_write_chunk(&out, c[0], c[1], c[2], blocks) < 0){
+			fprintf(stderr, "Could not copy chunk %d %d %d\n", c[0], c[1], c[2]);
+			remove(tmp_path);
+			exit(1);
+		}
+		n_stored++;
+	}
+
+	Sint64 in_size = file_size(path);
+	world_close(&out);
+	world_close(&in);
+#ifdef WIN32
+	/* rename doesn't replace files here */
+	remove(path);
+#endif
+	if(rename(tmp_path, path) < 0){
+		fprintf(stderr, "Could not move %s over %s\n", tmp_path, path);
+		exit(1);
+	}
+	printf("%s: %d chunks stored %s, %ld KB, was %ld KB\n", path, n_stored,
+			linear ? "x major" : "along a Morton curve", (long) (file_size(path) / 1024), (long) (in_size / 1024));
+	free(tmp_path);
+	return 0;
+}